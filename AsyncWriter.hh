@@ -0,0 +1,132 @@
+#ifndef ASYNC_WRITER_HH
+#define ASYNC_WRITER_HH
+
+#include "HistogramBase.hh"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// =================================================================================================
+
+// dedicated thread running output tasks (row fills, serialization, compression) in submission order, so that the threads
+// filling histograms never wait for ROOT I/O; each task runs with outputMutex() held
+// tasks are submitted on behalf of an owner (e.g. a HistogramBase instance), which may have at most maxPending tasks queued or running:
+// the owner fills one buffer while the writer drains the other, and only waits if it gets two buffers ahead
+class AsyncWriter {
+
+  public:
+
+    static constexpr std::size_t maxPending = 2;
+
+    AsyncWriter() : running_(nullptr), stopping_(false), thread_(&AsyncWriter::loop, this) {}
+
+    ~AsyncWriter() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      changed_.notify_all();
+      thread_.join();
+    }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    // queue a task; blocks while the owner already has maxPending tasks queued or running
+    // must not be called with outputMutex() held, since the writer needs it to make room
+    void submit(const void* owner, std::function<void()> task) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this, owner]() { return pending(owner) < maxPending; });
+      tasks_.push_back(Task{owner, std::move(task)});
+      changed_.notify_all();
+    }
+
+    // run the owner's queued tasks on the calling thread, in order, e.g. before the owner writes its final output
+    // safe with outputMutex() held: the writer only starts a task while holding outputMutex() itself
+    void runPending(const void* owner) {
+      std::lock_guard<std::recursive_mutex> output(outputMutex());
+      std::deque<Task> owned;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::deque<Task>::iterator it = tasks_.begin(); it != tasks_.end(); ) {
+          if (it -> owner == owner) {
+            owned.push_back(std::move(*it));
+            it = tasks_.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+      changed_.notify_all();
+      for (Task& task: owned) {
+        task.run();
+      }
+    }
+
+  private:
+
+    class Task {
+      public:
+        const void* owner;
+        std::function<void()> run;
+    };
+
+    std::size_t pending(const void* owner) const {
+      std::size_t count = (running_ == owner);
+      for (const Task& task: tasks_) {
+        count += (task.owner == owner);
+      }
+      return count;
+    }
+
+    void loop() {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          changed_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+          if (tasks_.empty()) {
+            return;
+          }
+        }
+        // take the task only once outputMutex() is held, so that runPending() never races with a running task
+        std::lock_guard<std::recursive_mutex> output(outputMutex());
+        Task task;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (tasks_.empty()) {
+            continue;
+          }
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+          running_ = task.owner;
+        }
+        task.run();
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          running_ = nullptr;
+        }
+        changed_.notify_all();
+      }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Task> tasks_;
+    const void* running_;
+    bool stopping_;
+
+    std::thread thread_;
+
+};
+
+// the writer shared by all instances; its thread starts on first use
+inline AsyncWriter& outputWriter() {
+  static AsyncWriter writer;
+  return writer;
+}
+
+#endif
@@ -1,72 +1,148 @@
 #include "Byu2Histograms.hh"
 
+#include "HistogramRegistry.hh"
+#include "PileupWeights.hh"
+#include "Profiler.hh"
+
+#include <algorithm>
+#include <set>
+
+// Subruns kept open per stream before the least recently used one is staged; sorted input only ever needs one.
+static const std::size_t maxOpenSubruns = 8;
+
+// Same for the per-calorimeter spectra, whose grids are 24 times larger (14 MB for singles, 43 MB for pileup).
+static const std::size_t maxOpenCaloSubruns = 2;
+
+// Per-calorimeter shard grids per process, whatever the number of threads and seeds (4 x 57 MB for singles and pileup together).
+static const std::size_t maxCaloShards = 4;
+
+// Available to the driver as "-c Byu2Histograms".
+REGISTER_HISTOGRAM_CLASS(Byu2Histograms);
 
-template <typename T> bool isElementOf(std::vector<T> array, T element)
-{
-    for (uint i=0; i<array.size(); i++) {
-        if (element == array[i]) {
-            return true;
-        }
-    }
-    return false;
-}
 
 // Constructor.
 Byu2Histograms::Byu2Histograms()
 {
-    // Initialization of the energy time bin information
-	t_min                = 0; 								// in us
-	t_max                = 700; 							// in us
-	t_n_bins             = (t_max - t_min) / 0.1492;  		// 4691
-	t_max                = t_min + t_n_bins * 0.1492; 		// 699.8972 us
-
-	E_min                = 1050;							// in MeV
-	E_max                = 3060;							// in MeV
+    // Initialization of the energy time bin information (same numbers as the compile-time Byu2Binning used by the grids)
+	t_min                = Byu2Binning::xMin; 				// 0 us
+	t_n_bins             = Byu2Binning::nx;		  		// 4691 = 700 / 0.1492
+	t_max                = Byu2Binning::xMax; 				// 699.8972 us
+
+	E_min                = Byu2Binning::yMin;				// 1050 MeV
 	E_bin_width          = 67;								// in MeV
-	E_n_bins             = (E_max - E_min) / E_bin_width;   // 30
-	E_max                = E_min + E_n_bins * E_bin_width;  // 3060 MeV
+	E_n_bins             = Byu2Binning::ny;				   // 30
+	E_max                = Byu2Binning::yMax;  				// 3060 MeV
 
     // Initialization of the runIndex and subrunIndex
 	prev_runIndexS_	    =-1;
-	prev_runIndexD_	    =-1;
-	prev_runIndexH_	    =-1;
-
     prev_subrunIndexS_ = -1;
-    prev_subrunIndexD_ = -1;
-    prev_subrunIndexH_ = -1;
 
     
-    // Initialization of the tree and branch
-    TREE_ET_aux_            = new TTree("ET", "ET");    
-
-    prev_runindex_S     = TREE_ET_aux_->Branch("prev_runIndexS_", &prev_runIndexS_, "prev_runIndexS_/I");
-    prev_runindex_D     = TREE_ET_aux_->Branch("prev_runIndexD_", &prev_runIndexD_, "prev_runIndexD_/I");
-    prev_runindex_H     = TREE_ET_aux_->Branch("prev_runIndexH_", &prev_runIndexH_, "prev_runIndexH_/I");
-
-    prev_index_S        = TREE_ET_aux_->Branch("prev_subrunIndexS_", &prev_subrunIndexS_, "prev_subrunIndexS_/I");
-    prev_index_D        = TREE_ET_aux_->Branch("prev_subrunIndexD_", &prev_subrunIndexD_, "prev_subrunIndexD_/I");
-    prev_index_H        = TREE_ET_aux_->Branch("prev_subrunIndexH_", &prev_subrunIndexH_, "prev_subrunIndexH_/I");
-    
     // initialization of subruntime
     subruntimeindex_    = 0;
-    subruntime_         = TREE_ET_aux_->Branch("subruntimeindex_", &subruntimeindex_, "subruntimeindex_/D");
+
+    TREE_ET_            = nullptr;
+    EvsT_               = nullptr;
+    EvsT_PU_            = nullptr;
+
+    threadPool_         = nullptr;
+}
+
+// Destructor. Trees and histograms are registered in the (shared) output directory, so they are removed under the output lock.
+Byu2Histograms::~Byu2Histograms()
+{
+    std::lock_guard<std::recursive_mutex> lock(outputMutex());
+    outputWriter().runPending(this);
+    accumulator_S_.reset();
+    accumulator_PU_.reset();
+    caloAccumulator_S_.reset();
+    caloAccumulator_PU_.reset();
+    columns_S_.reset();
+    columns_PU_.reset();
+    caloColumns_S_.reset();
+    caloColumns_PU_.reset();
+    projectionTrees_.clear();
+    delete TREE_ET_;
+    delete EvsT_;
+    delete EvsT_PU_;
+}
+
+void Byu2Histograms::setThreadPool(ThreadPool* threadPool)
+{
+    threadPool_ = threadPool;
+}
+
+void Byu2Histograms::setOutputOptions(const OutputOptions& options)
+{
+    outputOptions_ = options;
+}
+
+void Byu2Histograms::setCaloMask(const CaloMask& calos)
+{
+    caloMask_ = calos;
+}
+
+unsigned int Byu2Histograms::requiredFields() const
+{
+    return SkimFields::gpsInteger | SkimFields::time | SkimFields::energy | SkimFields::caloIndex
+         | SkimFields::runIndex | SkimFields::subrunIndex | SkimFields::pileupIndex;
 }
 
 
 void Byu2Histograms::bookHistograms(int seedIndex, int skimIndex)
 {
 
+    // Per-subrun accumulators; subruns that are not being filled any more are staged in their private scratch files, never in the output
+    accumulator_S_.reset(new SubrunAccumulator<Byu2Grid>("ET_S_staged", maxOpenSubruns));
+    accumulator_PU_.reset(new SubrunAccumulator<Byu2WeightedGrid>("ET_PU_staged", maxOpenSubruns));
+
+    // Per-calorimeter spectra: zero-suppressed rows in the blocked cell layout of Byu2CaloGrid, whatever the layout of the calorimeter sums
+    if (outputOptions_.perCalo) {
+        caloAccumulator_S_.reset(new SubrunAccumulator<Byu2CaloGrid>("ET_calo_staged", maxOpenCaloSubruns));
+        caloAccumulator_PU_.reset(new SubrunAccumulator<Byu2CaloWeightedGrid>("ET_PU_calo_staged", maxOpenCaloSubruns));
+        caloColumns_S_  = SubrunSpectrumWriter<Byu2CaloGrid>::create(outputOptions_.format, "ET_calo",
+            Form("Energy vs Time per calorimeter and subrun, cell = ((binT / %d * %d + calo - 1) * %d + binE) * %d + binT %% %d",
+                 Byu2CaloGrid::timeBlock, Byu2CaloGrid::nCalos, Byu2CaloGrid::nCellsY, Byu2CaloGrid::timeBlock, Byu2CaloGrid::timeBlock), true);
+        caloColumns_PU_ = SubrunSpectrumWriter<Byu2CaloWeightedGrid>::create(outputOptions_.format, "ET_PU_calo",
+            Form("Energy vs Time (Total PU) per calorimeter and subrun, cell = ((binT / %d * %d + calo - 1) * %d + binE) * %d + binT %% %d",
+                 Byu2CaloGrid::timeBlock, Byu2CaloGrid::nCalos, Byu2CaloGrid::nCellsY, Byu2CaloGrid::timeBlock, Byu2CaloGrid::timeBlock), true);
+    }
+
+    // Projections: one time bin of the grids is one cyclotron period, so rebinning by whole bins rebins by whole periods
+    if (!outputOptions_.projections.empty()) {
+        views_S_.reset(new SpectrumViews<Byu2Grid>(outputOptions_.projections));
+        views_PU_.reset(new SpectrumViews<Byu2WeightedGrid>(outputOptions_.projections));
+        for (std::size_t k = 0; k < outputOptions_.projections.size(); k++) {
+            const ProjectionSpec& spec = outputOptions_.projections[k];
+            projectionTrees_.emplace_back(new ProjectionTree("W_" + spec.name,
+                Form("%s wiggle per subrun, %g <= E < %g MeV, %d cyclotron periods per bin", spec.asymmetryWeighted ? "A-weighted" : "T-method", spec.eMin, spec.eMax, spec.rebin),
+                views_S_->nBins(k), views_S_->low(k), views_S_->high(k)));
+        }
+    }
+
+    // Columnar output: one row of bin contents per subrun, and a single empty histogram describing the axes of all rows
+    if (outputOptions_.columnar) {
+        EvsT_       = new TH2F("EvsT_axes", "Energy vs Time binning of ET and ET_PU ;Time [us]; Energy [MeV]", t_n_bins, t_min, t_max, E_n_bins, E_min, E_max);
+        columns_S_  = SubrunSpectrumWriter<Byu2Grid>::create(outputOptions_.format, "ET", "Energy vs Time per subrun", outputOptions_.zeroSuppressed);
+        columns_S_->addScalar("subrunTime", &subruntimeindex_);
+        columns_PU_ = SubrunSpectrumWriter<Byu2WeightedGrid>::create(outputOptions_.format, "ET_PU", "Energy vs Time (Total PU) per subrun", outputOptions_.zeroSuppressed);
+        return;
+    }
+
     // Histograms initialization 
 	EvsT_                = new TH2F("EvsT_",    "Energy vs Time             ;Time [us]; Energy [MeV]", t_n_bins, t_min, t_max, E_n_bins, E_min, E_max);
-	EvsT_D_	             = new TH2F("EvsT_D_",  "Energy vs Time (Double PU) ;Time [us]; Energy [MeV]", t_n_bins, t_min, t_max, E_n_bins, E_min, E_max);
-	EvsT_H_	             = new TH2F("EvsT_H_",  "Energy vs Time (Higher PU) ;Time [us]; Energy [MeV]", t_n_bins, t_min, t_max, E_n_bins, E_min, E_max);
 	EvsT_PU_	         = new TH2F("EvsT_PU_", "Energy vs Time (Total PU)  ;Time [us]; Energy [MeV]", t_n_bins, t_min, t_max, E_n_bins, E_min, E_max);
 
+    // Initialization of the tree and branch (one row per (run, subrun), written in key order by writeHistograms)
+    TREE_ET_            = new TTree("ET", "ET");
+
+    TREE_ET_->Branch("prev_runIndexS_", &prev_runIndexS_, "prev_runIndexS_/I");
+    TREE_ET_->Branch("prev_subrunIndexS_", &prev_subrunIndexS_, "prev_subrunIndexS_/I");
+    TREE_ET_->Branch("subruntimeindex_", &subruntimeindex_, "subruntimeindex_/D");
+
     // Branch initialization (This must be after the histogram initialization)
-    EvsT_branch     = TREE_ET_aux_->Branch("EvsT_",    "TH2F",  &EvsT_);
-    EvsT_D_branch   = TREE_ET_aux_->Branch("EvsT_D_",  "TH2F",  &EvsT_D_);
-    EvsT_H_branch   = TREE_ET_aux_->Branch("EvsT_H_",  "TH2F",  &EvsT_H_);
-    EvsT_PU_branch  = TREE_ET_aux_->Branch("EvsT_PU_", "TH2F",  &EvsT_PU_);
+    TREE_ET_->Branch("EvsT_",    "TH2F",  &EvsT_);
+    TREE_ET_->Branch("EvsT_PU_", "TH2F",  &EvsT_PU_);
 
 }
 
@@ -81,35 +157,25 @@ void Byu2Histograms::fillSinglesHistograms(PositronData& entry, double frRandomi
     double energy = entry.energy;
     double convertedTime = entry.time * ct2us + frRandomization;
     int caloIndex = entry.caloIndex;
-    timestamps_.push_back(entry.gpsInteger);
-    // Exclude calorimeter 18 in Run2F dataset       //////////////////////////Don't Forget////////////////////////
-    // if (caloIndex == 18) {
-    //     return;
-    // }   
-
-    // Fill EvsT histogram, runIndex, and subrunIndex branches in this if statement 
-    if ((entry.runIndex != prev_runIndexS_ || entry.subrunIndex != prev_subrunIndexS_) && prev_subrunIndexS_ != -1) {
-        double gpstime_size = timestamps_.size();
-        double average_time = 0;
-        for (unsigned int i = 0; i < timestamps_.size(); i++){
-		    average_time += timestamps_[i] / gpstime_size;
-	    }
-	    subruntimeindex_ = average_time;
-        subruntime_->Fill();
-        timestamps_.clear();
-        
-        EvsT_->SetTitle(Form("EvsT_subrun%d", entry.subrunIndex));
-        prev_index_S->Fill();
-        prev_runindex_S->Fill();
-        EvsT_branch->Fill();
-        EvsT_->Reset();
+
+    // Calorimeters excluded on the command line (e.g. calorimeter 18 in the Run2F dataset) are skipped
+    if (!caloMask_.contains(caloIndex)) {
+        return;
+    }
+
+    // Fill clusters (entry in PositronData) in the EvsT spectrum of their own (run, subrun)
+    addTimestamps(entry.runIndex, entry.subrunIndex, entry.gpsInteger, 1);
+    accumulator_S_->grid(entry.runIndex, entry.subrunIndex).fill(convertedTime, energy);
+    if (outputOptions_.perCalo) {
+        caloAccumulator_S_->grid(entry.runIndex, entry.subrunIndex).fill(convertedTime, energy, caloIndex);
     }
+}
 
-    // Fill clusters (entry in PositronData) in EvsT histogram (assign runIndex and subrunIndex after each cluster is filled)
-    EvsT_->Fill(convertedTime, energy);
-    prev_subrunIndexS_      = entry.subrunIndex; // Update previousSubrunIndex
-    prev_runIndexS_         = entry.runIndex;
-    subruntimeindex_        = entry.gpsInteger;
+void Byu2Histograms::addTimestamps(int runIndex, int subrunIndex, double sum, long long count)
+{
+    std::pair<double, long long>& timestamps = timestamps_[SubrunKey(runIndex, subrunIndex)];
+    timestamps.first += sum;
+    timestamps.second += count;
 }
 
 
@@ -118,92 +184,331 @@ void Byu2Histograms::fillSinglesHistograms(PositronData& entry, double frRandomi
 void Byu2Histograms::fillDoublesHistograms(PileupData& entry, double frRandomization, double vwRandomization, int seedIndex, int skimIndex)
 {
 
-    // Fill EvsT histogram, runIndex, and subrunIndex branches in this if statement 
-    if ((entry.runIndex != prev_runIndexD_ || entry.subrunIndex != prev_subrunIndexD_) && prev_subrunIndexD_ != -1) {
-        EvsT_D_->SetTitle(Form("EvsT_D_subrun%d", entry.subrunIndex));
-        prev_index_D->Fill();
-        prev_runindex_D->Fill();
-        EvsT_D_branch->Fill();
-        EvsT_D_->Reset();
-    }
-
-    // Fill clusters (entry in PileupData) in EvsT_D histogram with proper weights (assign runIndex and subrunIndex after each cluster is filled)
-    double weight = 0;
+    // Fill clusters (entry in PileupData) in the total PU spectrum of their (run, subrun) with proper weights
+    Byu2WeightedGrid& grid = accumulator_PU_->grid(entry.runIndex, entry.subrunIndex);
     for (uint i=0; i<entry.pileupIndex.size(); i++) {
 
         double energy = entry.pileupEnergy.at(i);
         double convertedTime = entry.pileupTime.at(i) * ct2us + frRandomization + 0.5 * cyclotronPeriod;
         int caloIndex = entry.pileupCaloIndex.at(i);
 
-        // Exclude calorimeter 18 in Run2F dataset       //////////////////////////Don't Forget////////////////////////
-        // if (caloIndex == 18) {
-        //     return;
-        // }    
-
-
-        if (entry.pileupIndex.at(i) == 2) {
-            weight = 0.5;
-            EvsT_D_->Fill(convertedTime, energy, weight);
-
-        } 
-        else {
-            weight = -0.5;
-            EvsT_D_->Fill(convertedTime, energy, weight);
+        // Clusters of excluded calorimeters are skipped
+        if (!caloMask_.contains(caloIndex)) {
+            continue;
+        }
 
+        double weight = doublesPileupWeights.weight(entry.pileupIndex.at(i));
+        grid.fill(convertedTime, energy, weight);
+        if (outputOptions_.perCalo) {
+            caloAccumulator_PU_->grid(entry.runIndex, entry.subrunIndex).fill(convertedTime, energy, caloIndex, weight);
         }
 
     } 
-    prev_subrunIndexD_      = entry.subrunIndex; // Update previousSubrunIndex
-    prev_runIndexD_         = entry.runIndex;
-        
 
 }
 
-
-
 void Byu2Histograms::fillTriplesHistograms(PileupData& entry, double frRandomization, double vwRandomization, int seedIndex, int skimIndex)
 {
     
-    // Fill EvsT histogram, runIndex, and subrunIndex branches in this if statement 
-    if ((entry.runIndex != prev_runIndexH_ || entry.subrunIndex != prev_subrunIndexH_) && prev_subrunIndexH_ != -1) {
-        EvsT_H_->SetTitle(Form("EvsT_H_subrun%d", entry.subrunIndex));
-        prev_index_H->Fill();
-        prev_runindex_H->Fill();
-        EvsT_H_branch->Fill();
-        EvsT_H_->Reset();
-    }
-
-
-    // Fill clusters (entry in PileupData) in EvsT_H histogram with proper weights (assign runIndex and subrunIndex after each cluster is filled)
-    std::vector<int> pu3DoublesIndices = {0, 1, 2, 6, 9, 12};     // Analogous to doubles in double-pileup events.
-    std::vector<int> pu3SinglesIndices = {3, 4, 5, 7, 8, 10, 11}; // Analogous to singles in double-pileup events.
-    double weight = 0;
+    // Fill clusters (entry in PileupData) in the total PU spectrum of their (run, subrun) with proper weights
+    // (see triplesPileupWeights for which pileup indices are added, subtracted or skipped)
+    Byu2WeightedGrid& grid = accumulator_PU_->grid(entry.runIndex, entry.subrunIndex);
     for (uint i=0; i<entry.pileupIndex.size(); i++) {
         double energy = entry.pileupEnergy.at(i);
         double convertedTime = entry.pileupTime.at(i) * ct2us + frRandomization + cyclotronPeriod;
         int caloIndex = entry.pileupCaloIndex.at(i);
 
-        // Exclude calorimeter 18 in Run2F dataset       //////////////////////////Don't Forget////////////////////////
-        // if (caloIndex == 18) {
-        //     return;
-        // }   
-        
-        if (isElementOf(pu3DoublesIndices, entry.pileupIndex.at(i))) {
-            weight = 0.5;
-            EvsT_H_->Fill(convertedTime, energy, weight);
+        // Clusters of excluded calorimeters are skipped
+        if (!caloMask_.contains(caloIndex)) {
+            continue;
+        }
 
-        } else if (isElementOf(pu3SinglesIndices, entry.pileupIndex.at(i))) {
-            weight = -0.5;
-            EvsT_H_->Fill(convertedTime, energy, weight);
+        double weight = triplesPileupWeights.weight(entry.pileupIndex.at(i));
+        if (weight == 0) {
+            continue;
+        }
+        grid.fill(convertedTime, energy, weight);
+        if (outputOptions_.perCalo) {
+            caloAccumulator_PU_->grid(entry.runIndex, entry.subrunIndex).fill(convertedTime, energy, caloIndex, weight);
+        }
 
-        } else {
+    }
+
+}
+
+// Start indices of the runs of consecutive entries that share (runIndex, subrunIndex), followed by 'size'.
+static std::vector<std::size_t> subrunSegments(const int* runIndex, const int* subrunIndex, std::size_t size)
+{
+    std::vector<std::size_t> bounds;
+    for (std::size_t i = 0; i < size; i++) {
+        if (i == 0 || runIndex[i] != runIndex[i - 1] || subrunIndex[i] != subrunIndex[i - 1]) {
+            bounds.push_back(i);
+        }
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+// Shard grids of one kind for the parallel segment fills, shared by all instances of the process: in preload mode up to one seed
+// per thread fills at the same time, and private shards per instance would add up to threads x threads grids.
+template <typename Grid>
+class ShardPool {
+public:
+    static ShardPool& instance()
+    {
+        static ShardPool pool;
+        return pool;
+    }
+
+    // Take up to 'count' shards, allocating new ones while fewer than 'capacity' exist; may return fewer, or none.
+    void acquire(std::size_t count, std::size_t capacity, std::vector<std::unique_ptr<Grid>>& shards)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (shards.size() < count && !free_.empty()) {
+            shards.push_back(std::move(free_.back()));
+            free_.pop_back();
+        }
+        while (shards.size() < count && allocated_ < capacity) {
+            shards.emplace_back(new Grid());
+            allocated_++;
+        }
+    }
+
+    // Hand shards back, empty (reset).
+    void release(std::vector<std::unique_ptr<Grid>>& shards)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (std::unique_ptr<Grid>& shard: shards) {
+            free_.push_back(std::move(shard));
+        }
+        shards.clear();
+    }
+
+private:
+    ShardPool() : allocated_(0) {}
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Grid>> free_;
+    std::size_t allocated_;
+};
+
+template <typename Grid>
+void Byu2Histograms::fillSegments(SubrunAccumulator<Grid>& accumulator, std::size_t maxShards,
+                                  const std::vector<std::size_t>& bounds, const int* runIndex, const int* subrunIndex,
+                                  const std::function<void(Grid&, std::size_t)>& fillSegment, const std::function<void(std::size_t)>& adoptSegment)
+{
+    std::size_t nSegments = bounds.size() - 1;
+    std::size_t poolWidth = (threadPool_ != nullptr) ? threadPool_->size() : 1;
+    std::size_t capacity = (maxShards == 0) ? poolWidth : std::min(maxShards, poolWidth);
+
+    // Shards only pay off for waves of at least two segments; with fewer available, every segment is a wave of its own
+    std::vector<std::unique_ptr<Grid>> shards;
+    if (capacity > 1 && nSegments > 1) {
+        ShardPool<Grid>::instance().acquire(std::min(capacity, nSegments), capacity, shards);
+        if (shards.size() < 2) {
+            ShardPool<Grid>::instance().release(shards);
+        }
+    }
+    std::size_t width = std::max<std::size_t>(shards.size(), 1);
+
+    for (std::size_t first = 0; first < nSegments; first += width) {
+        std::size_t last = std::min(first + width, nSegments);
+
+        // A single segment goes straight into its accumulator grid
+        if (last - first == 1) {
+            std::size_t begin = bounds[first];
+            fillSegment(accumulator.grid(runIndex[begin], subrunIndex[begin]), first);
+            adoptSegment(first);
             continue;
         }
 
+        threadPool_->parallelFor(last - first, [&](std::size_t k) {
+            fillSegment(*shards[k], first + k);
+        });
+
+        // Accumulator grids are only touched here, on the calling thread
+        for (std::size_t j = first; j < last; j++) {
+            std::size_t begin = bounds[j];
+            accumulator.grid(runIndex[begin], subrunIndex[begin]).add(*shards[j - first]);
+            shards[j - first]->reset();
+            adoptSegment(j);
+        }
+    }
+
+    ShardPool<Grid>::instance().release(shards);
+}
+
+// Fill the singles [begin, end) into 'grid'; the cell kernel converts the clock-tick times straight from the columns.
+// With calorimeters excluded, the singles of the other calorimeters are gathered first.
+static void fillSinglesSegment(Byu2Grid& grid, const SinglesBatch& batch, const double* frRandomization, const CaloMask& calos, std::size_t begin, std::size_t end)
+{
+    if (calos.all()) {
+        grid.fillScaled(end - begin, batch.time + begin, ct2us, frRandomization + begin, batch.energy + begin, nullptr);
+        return;
+    }
+    std::vector<double> ticks;
+    std::vector<double> shifts;
+    std::vector<double> energies;
+    ticks.reserve(end - begin);
+    shifts.reserve(end - begin);
+    energies.reserve(end - begin);
+    for (std::size_t i = begin; i < end; i++) {
+        if (calos.contains(batch.caloIndex[i])) {
+            ticks.push_back(batch.time[i]);
+            shifts.push_back(frRandomization[i]);
+            energies.push_back(batch.energy[i]);
+        }
+    }
+    grid.fillScaled(ticks.size(), ticks.data(), ct2us, shifts.data(), energies.data(), nullptr);
+}
+
+// Fill the singles [begin, end) into the spectra of their calorimeters.
+static void fillSinglesCaloSegment(Byu2CaloGrid& grid, const SinglesBatch& batch, const double* frRandomization, const CaloMask& calos, std::size_t begin, std::size_t end)
+{
+    grid.fillScaled(end - begin, batch.time + begin, ct2us, frRandomization + begin, batch.energy + begin, batch.caloIndex + begin, nullptr, calos);
+}
+
+// Clusters of a run of pileup events that enter the pileup spectra, as contiguous columns.
+class PileupClusters {
+public:
+    std::vector<double> ticks;      // clock ticks
+    std::vector<double> shifts;     // us, added to the converted times
+    std::vector<double> energies;
+    std::vector<double> weights;
+    std::vector<int>    calos;
+    std::size_t size() const { return ticks.size(); }
+};
+
+// Gather the clusters of the pileup events [begin, end) that have a non-zero weight and come from a calorimeter in 'calos';
+// the clusters of event i are shifted by frRandomization[i] + 'shift'.
+static void gatherPileupClusters(const PileupBatch& batch, const double* frRandomization, double shift, const PileupWeightTable& weights,
+                                 const CaloMask& calos, std::size_t begin, std::size_t end, PileupClusters& clusters)
+{
+    // Sized once for all clusters of the segment, and compacted to the kept ones
+    std::size_t nClusters = batch.offset[end] - batch.offset[begin];
+    clusters.ticks.resize(nClusters);
+    clusters.shifts.resize(nClusters);
+    clusters.energies.resize(nClusters);
+    clusters.weights.resize(nClusters);
+    clusters.calos.resize(nClusters);
+    std::size_t n = 0;
+    for (std::size_t i = begin; i < end; i++) {
+        double eventShift = frRandomization[i] + shift;
+        for (std::size_t c = batch.offset[i]; c < batch.offset[i + 1]; c++) {
+            double weight = weights.weight(batch.pileupIndex[c]);
+            if (weight == 0 || !calos.contains(batch.pileupCaloIndex[c])) {
+                continue;
+            }
+            clusters.ticks[n] = batch.pileupTime[c];
+            clusters.shifts[n] = eventShift;
+            clusters.energies[n] = batch.pileupEnergy[c];
+            clusters.weights[n] = weight;
+            clusters.calos[n] = batch.pileupCaloIndex[c];
+            n++;
+        }
+    }
+    clusters.ticks.resize(n);
+    clusters.shifts.resize(n);
+    clusters.energies.resize(n);
+    clusters.weights.resize(n);
+    clusters.calos.resize(n);
+}
+
+// Fill the clusters of the double-pileup events [begin, end) into 'grid', weighted by doublesPileupWeights.
+static void fillDoublesSegment(Byu2WeightedGrid& grid, const PileupBatch& batch, const double* frRandomization, const CaloMask& calos, std::size_t begin, std::size_t end)
+{
+    if (!calos.all()) {
+        PileupClusters clusters;
+        gatherPileupClusters(batch, frRandomization, 0.5 * cyclotronPeriod, doublesPileupWeights, calos, begin, end, clusters);
+        grid.fillScaled(clusters.size(), clusters.ticks.data(), ct2us, clusters.shifts.data(), clusters.energies.data(), clusters.weights.data());
+        return;
     }
-    prev_subrunIndexH_ = entry.subrunIndex; // Update previousSubrunIndex
-    prev_runIndexH_         = entry.runIndex;
 
+    // The clusters of all events in the segment are contiguous in the flattened columns, only the per-event shift is expanded
+    std::size_t first = batch.offset[begin];
+    std::size_t n = batch.offset[end] - first;
+    std::vector<double> shifts(n);
+    std::vector<double> weights(n);
+    for (std::size_t i = begin; i < end; i++) {
+        double shift = frRandomization[i] + 0.5 * cyclotronPeriod;
+        for (std::size_t c = batch.offset[i]; c < batch.offset[i + 1]; c++) {
+            shifts[c - first] = shift;
+        }
+    }
+    for (std::size_t c = 0; c < n; c++) {
+        weights[c] = doublesPileupWeights.weight(batch.pileupIndex[first + c]);
+    }
+    grid.fillScaled(n, batch.pileupTime + first, ct2us, shifts.data(), batch.pileupEnergy + first, weights.data());
+}
+
+// Fill the clusters of the triple-pileup events [begin, end) into 'grid', weighted by triplesPileupWeights (skipped indices dropped).
+static void fillTriplesSegment(Byu2WeightedGrid& grid, const PileupBatch& batch, const double* frRandomization, const CaloMask& calos, std::size_t begin, std::size_t end)
+{
+    PileupClusters clusters;
+    gatherPileupClusters(batch, frRandomization, cyclotronPeriod, triplesPileupWeights, calos, begin, end, clusters);
+    grid.fillScaled(clusters.size(), clusters.ticks.data(), ct2us, clusters.shifts.data(), clusters.energies.data(), clusters.weights.data());
+}
+
+// Fill the clusters of the pileup events [begin, end) into the spectra of their calorimeters (see gatherPileupClusters).
+static void fillPileupCaloSegment(Byu2CaloWeightedGrid& grid, const PileupBatch& batch, const double* frRandomization, double shift, const PileupWeightTable& weights,
+                                  const CaloMask& calos, std::size_t begin, std::size_t end)
+{
+    PileupClusters clusters;
+    gatherPileupClusters(batch, frRandomization, shift, weights, calos, begin, end, clusters);
+    grid.fillScaled(clusters.size(), clusters.ticks.data(), ct2us, clusters.shifts.data(), clusters.energies.data(), clusters.calos.data(), clusters.weights.data(), calos);
+}
+
+void Byu2Histograms::fillSinglesBatch(const SinglesBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex)
+{
+    std::vector<std::size_t> bounds = subrunSegments(batch.runIndex, batch.subrunIndex, batch.size);
+    fillSegments<Byu2Grid>(*accumulator_S_, 0, bounds, batch.runIndex, batch.subrunIndex,
+        [&](Byu2Grid& grid, std::size_t j) { fillSinglesSegment(grid, batch, frRandomization, caloMask_, bounds[j], bounds[j + 1]); },
+        [&](std::size_t j) {
+            double sum = 0;
+            long long count = 0;
+            for (std::size_t i = bounds[j]; i < bounds[j + 1]; i++) {
+                if (caloMask_.contains(batch.caloIndex[i])) {
+                    sum += batch.gpsInteger[i];
+                    count++;
+                }
+            }
+            addTimestamps(batch.runIndex[bounds[j]], batch.subrunIndex[bounds[j]], sum, count);
+        });
+    if (outputOptions_.perCalo) {
+        fillSegments<Byu2CaloGrid>(*caloAccumulator_S_, maxCaloShards, bounds, batch.runIndex, batch.subrunIndex,
+            [&](Byu2CaloGrid& grid, std::size_t j) { fillSinglesCaloSegment(grid, batch, frRandomization, caloMask_, bounds[j], bounds[j + 1]); },
+            [](std::size_t) {});
+    }
+}
+
+void Byu2Histograms::fillDoublesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex)
+{
+    std::vector<std::size_t> bounds = subrunSegments(batch.runIndex, batch.subrunIndex, batch.size);
+    fillSegments<Byu2WeightedGrid>(*accumulator_PU_, 0, bounds, batch.runIndex, batch.subrunIndex,
+        [&](Byu2WeightedGrid& grid, std::size_t j) { fillDoublesSegment(grid, batch, frRandomization, caloMask_, bounds[j], bounds[j + 1]); },
+        [](std::size_t) {});
+    if (outputOptions_.perCalo) {
+        fillSegments<Byu2CaloWeightedGrid>(*caloAccumulator_PU_, maxCaloShards, bounds, batch.runIndex, batch.subrunIndex,
+            [&](Byu2CaloWeightedGrid& grid, std::size_t j) {
+                fillPileupCaloSegment(grid, batch, frRandomization, 0.5 * cyclotronPeriod, doublesPileupWeights, caloMask_, bounds[j], bounds[j + 1]);
+            },
+            [](std::size_t) {});
+    }
+}
+
+void Byu2Histograms::fillTriplesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex)
+{
+    std::vector<std::size_t> bounds = subrunSegments(batch.runIndex, batch.subrunIndex, batch.size);
+    fillSegments<Byu2WeightedGrid>(*accumulator_PU_, 0, bounds, batch.runIndex, batch.subrunIndex,
+        [&](Byu2WeightedGrid& grid, std::size_t j) { fillTriplesSegment(grid, batch, frRandomization, caloMask_, bounds[j], bounds[j + 1]); },
+        [](std::size_t) {});
+    if (outputOptions_.perCalo) {
+        fillSegments<Byu2CaloWeightedGrid>(*caloAccumulator_PU_, maxCaloShards, bounds, batch.runIndex, batch.subrunIndex,
+            [&](Byu2CaloWeightedGrid& grid, std::size_t j) {
+                fillPileupCaloSegment(grid, batch, frRandomization, cyclotronPeriod, triplesPileupWeights, caloMask_, bounds[j], bounds[j + 1]);
+            },
+            [](std::size_t) {});
+    }
 }
 
 void Byu2Histograms::fillLostMuonHistograms(LostMuonData& entry, LostMuonInput& lmInput, double frRandomization, double vwRandomization, int seedIndex, int skimIndex)
@@ -211,64 +516,138 @@ void Byu2Histograms::fillLostMuonHistograms(LostMuonData& entry, LostMuonInput&
     
 }
 
-void Byu2Histograms::writeHistograms(TFile* outputFile, int seedIndex)
-{   
-    
-    // 각 fillsingles/double/triple Histograms 함수들에서 마지막으로 들어온 subrun에 대해서는 각 함수에 있는 if문의 조건이 성립되지 않아서 EvsT_ EvsT_D_ EvsT_H_가 tree에 fill이 안되었다.
-    // 이곳 writeHistgrams에서 저 히스토그램들을 각각의 branch에 fill을 해준다.
-    prev_runindex_S->Fill();
-    prev_index_S->Fill();
-    EvsT_branch->Fill();
-    
-    prev_runindex_D->Fill();
-    prev_index_D->Fill();
-    EvsT_D_branch->Fill();
-
-    prev_runindex_H->Fill();
-    prev_index_H->Fill();
-    EvsT_H_branch->Fill();
-
-    double gpstime_size = timestamps_.size();
-    double average_time = 0;
-    for (unsigned int i = 0; i < timestamps_.size(); i++){
-        average_time += timestamps_[i] / gpstime_size;
+void Byu2Histograms::finishSubrunsUpTo(int runIndex, int subrunIndex)
+{
+    const SubrunKey last(runIndex, subrunIndex);
+    writeSubruns(&last, true);
+}
+
+void Byu2Histograms::writeSubruns(const SubrunKey* last, bool async)
+{
+
+    // One row per (run, subrun) seen in any stream, in key order: the singles and total PU spectra of a row always belong to the same subrun,
+    // however the entries were ordered, interleaved or split between sources
+    std::set<SubrunKey> keys = accumulator_S_->keys();
+    std::set<SubrunKey> pileupKeys = accumulator_PU_->keys();
+    keys.insert(pileupKeys.begin(), pileupKeys.end());
+
+    for (const SubrunKey& key: keys) {
+        if (last != nullptr && *last < key) {
+            break;
+        }
+
+        // The subrun's spectra move into a spare snapshot and are dropped from the accumulators, so their memory is reused as soon as they are complete
+        std::unique_ptr<SubrunSnapshot> snapshot = spareSnapshot();
+        snapshot->key = key;
+        snapshot->grid_S.reset();
+        snapshot->grid_PU.reset();
+        accumulator_S_->take(key, snapshot->grid_S);
+        accumulator_PU_->take(key, snapshot->grid_PU);
+        if (outputOptions_.perCalo) {
+            if (!snapshot->calo_S) {
+                snapshot->calo_S.reset(new Byu2CaloGrid());
+                snapshot->calo_PU.reset(new Byu2CaloWeightedGrid());
+            }
+            snapshot->calo_S->reset();
+            snapshot->calo_PU->reset();
+            caloAccumulator_S_->take(key, *snapshot->calo_S);
+            caloAccumulator_PU_->take(key, *snapshot->calo_PU);
+        }
+        const std::pair<double, long long>& timestamps = timestamps_[key];
+        snapshot->subrunTime = (timestamps.second > 0) ? timestamps.first / timestamps.second : 0;
+        timestamps_.erase(key);
+
+        // The row itself (TH2F copies, TTree/RNTuple fill, compression) is written by the writer thread, or right here at the end of the job
+        if (async) {
+            SubrunSnapshot* pending = snapshot.release();
+            outputWriter().submit(this, [this, pending]() {
+                writeRow(*pending);
+                recycleSnapshot(std::unique_ptr<SubrunSnapshot>(pending));
+            });
+        } else {
+            std::lock_guard<std::recursive_mutex> lock(outputMutex());
+            writeRow(*snapshot);
+            recycleSnapshot(std::move(snapshot));
+        }
     }
-    subruntimeindex_ = average_time;
-    subruntime_->Fill();
 
-    // tree에 fill을 하지 않고 branch마다 fill을 따로 하였기 때문에 tree의 entry는 수동으로 아래와 같이 직접 정해주어야 한다.
-    TREE_ET_aux_->SetEntries(prev_index_S->GetEntries());
-    // TREE_ET_aux_->SetEntries(10);
-    
-   
-    // Fill PU EvsT histogram
-    TH2F* double_h = new TH2F();
-    TREE_ET_aux_->SetBranchAddress("EvsT_D_", &double_h);
-    TH2F* higher_h = new TH2F();
-    TREE_ET_aux_->SetBranchAddress("EvsT_H_", &higher_h);
-    for (int i = 0; i < TREE_ET_aux_->GetEntries(); i++){
-        TREE_ET_aux_->GetEntry(i);
-        EvsT_PU_->Reset();
-        EvsT_PU_->Add(double_h, 1);
-        EvsT_PU_->Add(higher_h, 1);
-        EvsT_PU_branch->Fill();
+}
+
+void Byu2Histograms::writeRow(const SubrunSnapshot& snapshot)
+{
+    ScopedTimer timer("writeSubrunRow");
+    profiler().count("subrun rows written");
+
+    prev_runIndexS_ = snapshot.key.first;
+    prev_subrunIndexS_ = snapshot.key.second;
+    subruntimeindex_ = snapshot.subrunTime;
+
+    if (outputOptions_.columnar) {
+        columns_S_->fill(snapshot.key.first, snapshot.key.second, snapshot.grid_S);
+        columns_PU_->fill(snapshot.key.first, snapshot.key.second, snapshot.grid_PU);
+    } else {
+        snapshot.grid_S.copyTo(EvsT_);
+        EvsT_->SetTitle(Form("EvsT_subrun%d", snapshot.key.second));
+        snapshot.grid_PU.copyTo(EvsT_PU_);
+        EvsT_PU_->SetTitle(Form("EvsT_PU_subrun%d", snapshot.key.second));
+        TREE_ET_->Fill();
     }
 
-    
+    if (outputOptions_.perCalo) {
+        caloColumns_S_->fill(snapshot.key.first, snapshot.key.second, *snapshot.calo_S);
+        caloColumns_PU_->fill(snapshot.key.first, snapshot.key.second, *snapshot.calo_PU);
+    }
+
+    // Projections are computed from the snapshot on demand: the energy prefix sums are built once per weighting and shared by all projections
+    if (views_S_) {
+        views_S_->setSpectrum(snapshot.grid_S);
+        views_PU_->setSpectrum(snapshot.grid_PU);
+        for (std::size_t k = 0; k < projectionTrees_.size(); k++) {
+            projectionTrees_[k]->fill(snapshot.key.first, snapshot.key.second, views_S_->projection(k), views_PU_->projection(k));
+        }
+    }
+}
+
+std::unique_ptr<Byu2Histograms::SubrunSnapshot> Byu2Histograms::spareSnapshot()
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex_);
+    if (spareSnapshots_.empty()) {
+        return std::unique_ptr<SubrunSnapshot>(new SubrunSnapshot());
+    }
+    std::unique_ptr<SubrunSnapshot> snapshot = std::move(spareSnapshots_.back());
+    spareSnapshots_.pop_back();
+    return snapshot;
+}
+
+void Byu2Histograms::recycleSnapshot(std::unique_ptr<SubrunSnapshot> snapshot)
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex_);
+    spareSnapshots_.push_back(std::move(snapshot));
+}
 
+void Byu2Histograms::writeHistograms(TFile* outputFile, int seedIndex)
+{   
 
-    // TREE_subrun_->Fill();
-    // TREE_ET_aux_->Write();
+    // Rows still queued for the writer thread go first (the driver holds outputMutex, so none of them is running), then all remaining subruns
+    outputWriter().runPending(this);
+    writeSubruns(nullptr, false);
+    spareSnapshots_.clear();
 
+    if (outputOptions_.perCalo) {
+        caloColumns_S_->write();
+        caloColumns_PU_->write();
+    }
 
-    TREE_ET_aux_->SetBranchStatus("*", 0);
-    TREE_ET_aux_->SetBranchStatus("prev_runIndexS_", 1);
-    TREE_ET_aux_->SetBranchStatus("prev_subrunIndexS_", 1);
-    TREE_ET_aux_->SetBranchStatus("subruntimeindex_", 1);
-    TREE_ET_aux_->SetBranchStatus("EvsT_", 1);
-    TREE_ET_aux_->SetBranchStatus("EvsT_PU_", 1);
+    for (std::unique_ptr<ProjectionTree>& projectionTree: projectionTrees_) {
+        projectionTree->write();
+    }
 
-    TREE_ET_ = TREE_ET_aux_->CloneTree();
+    if (outputOptions_.columnar) {
+        EvsT_->Write();
+        columns_S_->write();
+        columns_PU_->write();
+        return;
+    }
 
     TREE_ET_->Write();
 
@@ -3,7 +3,19 @@
 
 #include <iostream>
 
+#include "AsyncWriter.hh"
+#include "CaloGrid3D.hh"
 #include "HistogramBase.hh"
+#include "SpectrumViews.hh"
+#include "SubrunAccumulator.hh"
+#include "SubrunSpectrumWriter.hh"
+#include "ThreadPool.hh"
+#include "UniformGrid2D.hh"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 
 // ROOT libraries.
 #include <TTree.h>
@@ -14,12 +26,29 @@
 static const double ct2us = 1.25/1000;    // Conversion factor from clock tick to microsecond.
 static const double cyclotronPeriod = 0.1492; // microseconds
 
+// Energy-time binning of all spectra, fixed at compile time so that the fill path uses constant bin widths.
+struct Byu2Binning {
+    static constexpr int    nx   = int((700.0 - 0.0) / 0.1492);     // 4691 (0.1492us = bin width)
+    static constexpr double xMin = 0;                               // 0 us
+    static constexpr double xMax = xMin + nx * 0.1492;              // 699.8972 us
+    static constexpr int    ny   = int((3060 - 1050) / 67);         // 30 = (2010/67)
+    static constexpr double yMin = 1050;                            // 1050 MeV
+    static constexpr double yMax = yMin + ny * 67;                  // 3060 MeV
+};
+
+typedef UniformGrid2D<Byu2Binning, false>   Byu2Grid;           // singles: unit weights
+typedef UniformGrid2D<Byu2Binning, true>    Byu2WeightedGrid;   // pileup: +-0.5 weights, keeps the sum of squared weights
+typedef CaloGrid3D<Byu2Binning, false>      Byu2CaloGrid;           // singles, per calorimeter
+typedef CaloGrid3D<Byu2Binning, true>       Byu2CaloWeightedGrid;   // pileup, per calorimeter
+
 class Byu2Histograms: public HistogramBase {
 
 public:
 
-    // Constructor.
+    // Constructor. The output trees are created by bookHistograms() in the current directory (gDirectory), where their baskets are flushed while filling;
+    // partial spectra of unsorted input are staged in scratch files of the accumulators (see SubrunAccumulator).
     Byu2Histograms();
+    ~Byu2Histograms() override;
 
     void bookHistograms(int seedIndex, int skimIndex) override;
     void fillSinglesHistograms(PositronData& entry, double frRandomization, double vwRandomization, int seedIndex, int skimIndex) override;
@@ -28,8 +57,66 @@ public:
     void fillLostMuonHistograms(LostMuonData& entry, LostMuonInput& lmInput, double frRandomization, double vwRandomization, int seedIndex, int skimIndex) override;
     void writeHistograms(TFile* outputFile, int seedIndex) override;
 
+    // Fused mode: rows of complete subruns are written as soon as the driver reports them, and their spectra are freed.
+    void finishSubrunsUpTo(int runIndex, int subrunIndex) override;
+
+    // Block fills: each run of consecutive entries from the same subrun (a segment) is converted in one loop and filled with one FillN call.
+    // With a thread pool, the segments of a block are filled concurrently into private histograms and merged back in order.
+    // Entries may come in any order: spectra are accumulated per (run, subrun) and aligned by key when written.
+    void fillSinglesBatch(const SinglesBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) override;
+    void fillDoublesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) override;
+    void fillTriplesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) override;
+
+    void setThreadPool(ThreadPool* threadPool) override;
+
+    // Skim fields read by the fills above; x, y, bunchNumber and the pileup flags and positions are never used.
+    unsigned int requiredFields() const override;
+
+    // Columnar output: the singles and total pileup spectra go to the SubrunSpectrumWriters "ET" and "ET_PU" (TTrees or RNTuples) instead of TH2F branches.
+    // Per-calorimeter output: the spectra of each calorimeter also go to "ET_calo" and "ET_PU_calo" (zero-suppressed rows, blocked layout of Byu2CaloGrid).
+    // Projections: every requested wiggle plot is derived from each row's singles and total PU spectra and stored as "W_<name>" (see ProjectionTree).
+    void setOutputOptions(const OutputOptions& options) override;
+
+    // Clusters of calorimeters outside the mask enter no spectrum, and singles outside it do not count towards the subrun time.
+    void setCaloMask(const CaloMask& calos) override;
+
 private:
 
+    // Fill the segments [bounds[j], bounds[j + 1]) of one stream into the accumulator, in waves of one segment per shard.
+    // Each segment of a wave is filled into a shard grid, and the shards are added to their subruns' accumulator grids in order.
+    // Shards come from a pool shared by all instances of the process, which holds at most maxShards grids of a kind (0: one per
+    // pool thread); when the other seeds hold them all, the segments are filled one after another straight into the accumulator.
+    // adoptSegment(j) is called after segment j has been added.
+    template <typename Grid>
+    void fillSegments(SubrunAccumulator<Grid>& accumulator, std::size_t maxShards,
+                      const std::vector<std::size_t>& bounds, const int* runIndex, const int* subrunIndex,
+                      const std::function<void(Grid&, std::size_t)>& fillSegment, const std::function<void(std::size_t)>& adoptSegment);
+
+    // Complete spectra of one subrun, handed from the filling thread to the writer.
+    class SubrunSnapshot {
+    public:
+        SubrunKey           key;
+        double              subrunTime;
+        Byu2Grid            grid_S;
+        Byu2WeightedGrid    grid_PU;
+        std::unique_ptr<Byu2CaloGrid>           calo_S;     // per-calorimeter output only
+        std::unique_ptr<Byu2CaloWeightedGrid>   calo_PU;
+    };
+
+    // Move the spectra of all subruns up to and including 'last' (all subruns if null) out of the accumulators in key order,
+    // and write one row per subrun, either on the shared writer thread (async) or right away.
+    void writeSubruns(const SubrunKey* last, bool async);
+
+    // Write one ET row; needs outputMutex.
+    void writeRow(const SubrunSnapshot& snapshot);
+
+    // Snapshots are recycled, so that at most a few (AsyncWriter::maxPending + 1) are ever allocated.
+    std::unique_ptr<SubrunSnapshot> spareSnapshot();
+    void recycleSnapshot(std::unique_ptr<SubrunSnapshot> snapshot);
+
+    // Record the gps time of a singles entry towards the average time of its subrun.
+    void addTimestamps(int runIndex, int subrunIndex, double sum, long long count);
+
 	double   			t_min; 			     	// 0 us
 	double   			t_max;					// 700 us rounding issue가 있어서 뒤에서 재정의됨
 	int      			t_n_bins;				// 700/0.1492 = 4691 (0.1492us = bin width)
@@ -39,39 +126,38 @@ private:
 	int     			E_n_bins;				// 30 = (2010/67)   
 	int      			E_bin_width;			// 67 MeV	
 
-	int 				prev_runIndexS_;		// runIndex in singlefill function
-	int 				prev_runIndexD_;		// runIndex in doublefill function
-	int 				prev_runIndexH_;		// runIndex in higherfill function
+	int 				prev_runIndexS_;		// runIndex of the ET row being written
+	int 				prev_subrunIndexS_;		// subrunIndex of the ET row being written
 
-	int 				prev_subrunIndexS_;		// subrunIndex in singlefill function
-	int 				prev_subrunIndexD_;		// subrunIndex in doublefill function
-	int 				prev_subrunIndexH_;		// subrunIndex in higherfill function
+	std::unique_ptr<SubrunAccumulator<Byu2Grid>>			accumulator_S_;		// raw ET spectrum per (run, subrun)
+	std::unique_ptr<SubrunAccumulator<Byu2WeightedGrid>>	accumulator_PU_;	// total PU spectrum per (run, subrun): double PU (PileupIndex == 2) + higher PU (pu3), +-0.5 weights
 
-    TH2F*    			EvsT_;					// raw ET histogram
-	TH2F*    			EvsT_D_;				// double PU histogram : PileupIndex == 2    (+0.5 weight for PU | -0.5 weight for PC)
-	TH2F*    			EvsT_H_;				// higher PU histogram : PileupIndex == pu3  (+0.5 weight for PU | -0.5 weight for PC)
-	TH2F*				EvsT_PU_;				// total  PU histogram
+	std::vector<std::unique_ptr<SubrunSnapshot>>	spareSnapshots_;	// snapshots not in use, shared with the writer thread
+	std::mutex			snapshotMutex_;
+
+    TH2F*    			EvsT_;					// raw ET histogram (copied from a snapshot when a row is written)
+	TH2F*				EvsT_PU_;				// total  PU histogram (copied from a snapshot when a row is written)
 
-	TTree*				TREE_ET_aux_;	 		// Tree for subrun level information
 	TTree*				TREE_ET_;	    		// Tree for subrun level information
-	
-	TBranch* 			prev_runindex_S;		// runIndex Branch in singlefill function
-	TBranch* 			prev_runindex_D;		// runIndex Branch in doublefill function
-	TBranch* 			prev_runindex_H;		// runIndex Branch in higherfill function
-
-	TBranch* 			prev_index_S;			// subrunIndex Branch in singlefill function
-	TBranch* 			prev_index_D;			// subrunIndex Branch in doublefill function
-	TBranch* 			prev_index_H;			// subrunIndex Branch in higherfill function
-
-	TBranch* 			EvsT_branch;			// singlefill ET histogram
-	TBranch* 			EvsT_D_branch;			// doublefill ET histogram	
-	TBranch* 			EvsT_H_branch;			// higherfill ET histogram
-	TBranch* 			EvsT_PU_branch;			// pileupfill ET histogram
-
-	double				subruntimeindex_;
-	TBranch*			subruntime_;
-	std::vector<unsigned int>	timestamps_;			// Unixtimestamp vector
-	std::vector<double>	ave_time_vec_;			// subrun average time vector
+
+	double				subruntimeindex_;		// average gps time of the row being written
+	std::map<SubrunKey, std::pair<double, long long>>	timestamps_;	// sum and number of singles gps times per subrun
+
+	ThreadPool*			threadPool_;			// pool for intra-seed segment filling (nullptr -> serial)
+
+	OutputOptions		outputOptions_;
+	std::unique_ptr<SubrunSpectrumWriter<Byu2Grid>>			columns_S_;		// columnar mode: singles spectrum per subrun ("ET")
+	std::unique_ptr<SubrunSpectrumWriter<Byu2WeightedGrid>>	columns_PU_;	// columnar mode: total PU spectrum per subrun ("ET_PU")
+
+	CaloMask			caloMask_;				// calorimeters whose clusters are filled
+	std::unique_ptr<SubrunAccumulator<Byu2CaloGrid>>			caloAccumulator_S_;		// per-calorimeter output: raw ET spectra per (run, subrun)
+	std::unique_ptr<SubrunAccumulator<Byu2CaloWeightedGrid>>	caloAccumulator_PU_;	// per-calorimeter output: total PU spectra per (run, subrun)
+	std::unique_ptr<SubrunSpectrumWriter<Byu2CaloGrid>>			caloColumns_S_;		// "ET_calo"
+	std::unique_ptr<SubrunSpectrumWriter<Byu2CaloWeightedGrid>>	caloColumns_PU_;	// "ET_PU_calo"
+
+	std::unique_ptr<SpectrumViews<Byu2Grid>>			views_S_;		// projections of the row being written
+	std::unique_ptr<SpectrumViews<Byu2WeightedGrid>>	views_PU_;
+	std::vector<std::unique_ptr<ProjectionTree>>		projectionTrees_;	// one per projection ("W_<name>")
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef CALO_GRID_3D_HH
+#define CALO_GRID_3D_HH
+
+#include "CaloMask.hh"
+#include "UniformGrid2D.hh"
+
+#include "TH2F.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// =================================================================================================
+
+// per-calorimeter version of UniformGrid2D: one time-energy spectrum for each of the 24 calorimeters in a single dense array,
+// with the same Binning, under/overflow bins and interface (so that SubrunAccumulator and SubrunSpectrumWriter take it as is)
+// the cells are blocked along time so that the hot early time bins of all calorimeters stay cache-resident: the ROOT time
+// bins 0..nx+1 are cut into blocks of timeBlock bins, and each block holds, calorimeter after calorimeter and energy bin after
+// energy bin, timeBlock consecutive time bins (one 64-byte cache line of floats)
+//   cell = ((binx / timeBlock * nCalos + caloIndex - 1) * nCellsY + biny) * timeBlock + binx % timeBlock
+// the decay curve puts most entries in the first blocks, which for all calorimeters together form one contiguous region
+// of nCalos * nCellsY * timeBlock cells (48 KiB of floats) per block instead of 24 regions 600 KiB apart
+template <typename Binning, bool Weighted>
+class CaloGrid3D {
+
+  public:
+
+    // the grid of one calorimeter, whose bin lookup and cell kernel geometry are shared
+    typedef UniformGrid2D<Binning, Weighted> Plane;
+
+    static constexpr int nx = Binning::nx;
+    static constexpr int ny = Binning::ny;
+    static constexpr double xMin = Binning::xMin;
+    static constexpr double xMax = Binning::xMax;
+    static constexpr double yMin = Binning::yMin;
+    static constexpr double yMax = Binning::yMax;
+
+    static constexpr bool weighted = Weighted;
+
+    static constexpr int nCalos = CaloMask::nCalos;
+    static constexpr int timeBlock = 16;
+
+    static constexpr int nCellsX = nx + 2;
+    static constexpr int nCellsY = ny + 2;
+    static constexpr int nBlocks = (nCellsX + timeBlock - 1) / timeBlock;
+    static constexpr int nCells = nBlocks * nCalos * nCellsY * timeBlock; // the last block is padded with cells that stay empty
+
+    static constexpr double invWidthX = nx / (xMax - xMin);
+    static constexpr double invWidthY = ny / (yMax - yMin);
+
+    CaloGrid3D() : sumw_(nCells, 0), sumw2_(Weighted ? nCells : 0, 0), entries_(0) {}
+
+    // cell of ROOT bins (binx, biny) of calorimeter caloIndex (1..nCalos)
+    static int cell(int caloIndex, int binx, int biny) {
+      return ((binx / timeBlock * nCalos + caloIndex - 1) * nCellsY + biny) * timeBlock + binx % timeBlock;
+    }
+
+    // clusters outside 1..nCalos have no spectrum of their own, and are dropped
+    void fill(double x, double y, int caloIndex) {
+      fill(x, y, caloIndex, 1.0);
+    }
+
+    void fill(double x, double y, int caloIndex, double w) {
+      if (caloIndex < 1 || caloIndex > nCalos) {
+        return;
+      }
+      const int binx = Plane::bin((x - xMin) * invWidthX, nx);
+      const int biny = Plane::bin((y - yMin) * invWidthY, ny);
+      fillCell(cell(caloIndex, binx, biny), w);
+      entries_++;
+    }
+
+    // fill n points with x = xRaw[i] * xScale + xShift[i] (xShift == nullptr -> 0) into the spectra of calorimeters caloIndex[i],
+    // skipping calorimeters outside 'calos' (w == nullptr -> unit weights); the 2D cells come from the SIMD cell kernel, a block
+    // at a time, and are then moved into the blocked layout
+    void fillScaled(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, const int* caloIndex,
+                    const double* w, const CaloMask& calos) {
+      static const CellGeometry grid = Plane::geometry();
+      const CellKernelFunction kernel = cellKernel();
+      int cells[blockSize];
+      for (std::size_t first = 0; first < n; first += blockSize) {
+        const std::size_t count = std::min<std::size_t>(blockSize, n - first);
+        kernel(count, xRaw + first, xScale, xShift ? xShift + first : nullptr, y + first, cells, grid);
+        for (std::size_t i = 0; i < count; i++) {
+          const int calo = caloIndex[first + i];
+          if (calo < 1 || calo > nCalos || !calos.contains(calo)) {
+            continue;
+          }
+          // nCellsX is a compile-time constant, so the division is a multiply and a shift
+          const int binx = cells[i] % nCellsX;
+          const int biny = cells[i] / nCellsX;
+          fillCell(cell(calo, binx, biny), w ? w[first + i] : 1.0);
+          entries_++;
+        }
+      }
+    }
+
+    void addCell(int cell, double sumw, double sumw2) {
+      sumw_[cell] += sumw;
+      if (Weighted) {
+        sumw2_[cell] += sumw2;
+      }
+    }
+
+    void addEntries(long long n) {
+      entries_ += n;
+    }
+
+    void add(const CaloGrid3D& other) {
+      for (int i = 0; i < nCells; i++) {
+        sumw_[i] += other.sumw_[i];
+      }
+      for (std::size_t i = 0; i < sumw2_.size(); i++) {
+        sumw2_[i] += other.sumw2_[i];
+      }
+      entries_ += other.entries_;
+    }
+
+    void reset() {
+      std::fill(sumw_.begin(), sumw_.end(), 0.0f);
+      std::fill(sumw2_.begin(), sumw2_.end(), 0.0);
+      entries_ = 0;
+    }
+
+    // overwrite a TH2F with the same binning by the spectrum of one calorimeter; its entry count is not kept per calorimeter,
+    // so the histogram's is the sum of its bin contents
+    void copyTo(int caloIndex, TH2F* hist) const {
+      hist -> Reset();
+      if (Weighted && hist -> GetSumw2N() == 0) {
+        hist -> Sumw2();
+      }
+      float* contents = hist -> GetArray();
+      for (int biny = 0; biny < nCellsY; biny++) {
+        for (int binx = 0; binx < nCellsX; binx++) {
+          const int source = cell(caloIndex, binx, biny);
+          contents[binx + nCellsX * biny] = sumw_[source];
+          if (Weighted) {
+            hist -> GetSumw2() -> GetArray()[binx + nCellsX * biny] = sumw2_[source];
+          }
+        }
+      }
+      hist -> ResetStats();
+    }
+
+    const float* contents() const { return sumw_.data(); }
+    const double* sumw2() const { return Weighted ? sumw2_.data() : nullptr; }
+    long long entries() const { return entries_; }
+
+  private:
+
+    static constexpr std::size_t blockSize = 256;
+
+    void fillCell(int cell, double w) {
+      sumw_[cell] += w;
+      if (Weighted) {
+        sumw2_[cell] += w * w;
+      }
+    }
+
+    std::vector<float> sumw_;
+    std::vector<double> sumw2_;
+    long long entries_;
+
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CALO_MASK_HH
+#define CALO_MASK_HH
+
+// =================================================================================================
+
+// set of calorimeters (caloIndex 1..24) whose clusters are histogrammed, e.g. everything but calorimeter 18 for Run2F
+// clusters with a caloIndex outside 1..24 belong to no calorimeter: they are kept only while nothing is excluded (all()),
+// so that a narrowed selection means the same clusters for the calorimeter sums and the per-calorimeter spectra (CaloGrid3D),
+// which have no place for them at all
+class CaloMask {
+
+  public:
+
+    static constexpr int nCalos = 24;
+    static constexpr unsigned int allBits = (1u << nCalos) - 1;
+
+    // all calorimeters
+    CaloMask() : bits_(allBits) {}
+
+    static CaloMask none() {
+      CaloMask mask;
+      mask.bits_ = 0;
+      return mask;
+    }
+
+    void include(int caloIndex) {
+      if (caloIndex >= 1 && caloIndex <= nCalos) {
+        bits_ |= 1u << (caloIndex - 1);
+      }
+    }
+
+    void exclude(int caloIndex) {
+      if (caloIndex >= 1 && caloIndex <= nCalos) {
+        bits_ &= ~(1u << (caloIndex - 1));
+      }
+    }
+
+    bool contains(int caloIndex) const {
+      if (caloIndex < 1 || caloIndex > nCalos) {
+        return all();
+      }
+      return (bits_ >> (caloIndex - 1)) & 1u;
+    }
+
+    // true when nothing is excluded, so that fills can skip the per-cluster test
+    bool all() const { return bits_ == allBits; }
+
+    unsigned int bits() const { return bits_; }
+
+  private:
+
+    unsigned int bits_; // bit k: caloIndex k + 1
+
+};
+
+#endif
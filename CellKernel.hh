@@ -0,0 +1,186 @@
+#ifndef CELL_KERNEL_HH
+#define CELL_KERNEL_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CELL_KERNEL_X86 1
+#endif
+
+// =================================================================================================
+
+// uniform 2D grid as seen by the cell kernels (see UniformGrid2D for the cell layout)
+class CellGeometry {
+
+  public:
+
+    double xMin;
+    double invWidthX;
+    int nx;
+
+    double yMin;
+    double invWidthY;
+    int ny;
+
+    int nCellsX; // nx + 2
+
+};
+
+// NaN test on the bit pattern (all exponent bits set, nonzero mantissa), since the code is built with -ffast-math,
+// under which the compiler may assume that no value is NaN and drop std::isnan() or fold comparisons that rely on it
+inline bool isNaNBits(double value) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return (bits & 0x7fffffffffffffffull) > 0x7ff0000000000000ull;
+}
+
+// signature shared by all kernels: for i in [0, n), with x = xRaw[i] * xScale + xShift[i] (xShift == nullptr -> 0),
+// cells[i] = binx + nCellsX * biny, where underflow and NaN go to bin 0 and overflow to bin n + 1 like UniformGrid2D::bin()
+typedef void (*CellKernelFunction)(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, int* cells, const CellGeometry& geometry);
+
+// =================================================================================================
+
+// portable kernel, and the tail loop of the vector kernels
+inline void computeCellsScalar(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, int* cells, const CellGeometry& geometry) {
+  for (std::size_t i = 0; i < n; i++) {
+    double x = xRaw[i] * xScale + (xShift ? xShift[i] : 0.0);
+    double u = (x - geometry.xMin) * geometry.invWidthX;
+    double v = (y[i] - geometry.yMin) * geometry.invWidthY;
+    u = (u >= 0 && !isNaNBits(u)) ? u : -1.0;
+    u = (u < geometry.nx) ? u : geometry.nx;
+    v = (v >= 0 && !isNaNBits(v)) ? v : -1.0;
+    v = (v < geometry.ny) ? v : geometry.ny;
+    cells[i] = (int(u) + 1) + geometry.nCellsX * (int(v) + 1);
+  }
+}
+
+#ifdef CELL_KERNEL_X86
+
+// 4 lanes of doubles per iteration
+__attribute__((target("avx2")))
+inline void computeCellsAVX2(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, int* cells, const CellGeometry& geometry) {
+
+  const __m256d scale = _mm256_set1_pd(xScale);
+  const __m256d xMin = _mm256_set1_pd(geometry.xMin);
+  const __m256d invWidthX = _mm256_set1_pd(geometry.invWidthX);
+  const __m256d nx = _mm256_set1_pd(geometry.nx);
+  const __m256d yMin = _mm256_set1_pd(geometry.yMin);
+  const __m256d invWidthY = _mm256_set1_pd(geometry.invWidthY);
+  const __m256d ny = _mm256_set1_pd(geometry.ny);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d minusOne = _mm256_set1_pd(-1.0);
+  const __m256i absMask = _mm256_set1_epi64x(0x7fffffffffffffffll);
+  const __m256i infinity = _mm256_set1_epi64x(0x7ff0000000000000ll);
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i nCellsX = _mm_set1_epi32(geometry.nCellsX);
+
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_mul_pd(_mm256_loadu_pd(xRaw + i), scale);
+    if (xShift) {
+      x = _mm256_add_pd(x, _mm256_loadu_pd(xShift + i));
+    }
+    __m256d u = _mm256_mul_pd(_mm256_sub_pd(x, xMin), invWidthX);
+    __m256d v = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(y + i), yMin), invWidthY);
+    // NaN is detected on the bit patterns like isNaNBits() and sent to the underflow bin before clamping
+    u = _mm256_blendv_pd(u, minusOne, _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_and_si256(_mm256_castpd_si256(u), absMask), infinity)));
+    v = _mm256_blendv_pd(v, minusOne, _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_and_si256(_mm256_castpd_si256(v), absMask), infinity)));
+    u = _mm256_blendv_pd(minusOne, u, _mm256_cmp_pd(u, zero, _CMP_GE_OQ));
+    u = _mm256_blendv_pd(nx, u, _mm256_cmp_pd(u, nx, _CMP_LT_OQ));
+    v = _mm256_blendv_pd(minusOne, v, _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+    v = _mm256_blendv_pd(ny, v, _mm256_cmp_pd(v, ny, _CMP_LT_OQ));
+    __m128i binx = _mm_add_epi32(_mm256_cvttpd_epi32(u), one);
+    __m128i biny = _mm_add_epi32(_mm256_cvttpd_epi32(v), one);
+    _mm_storeu_si128((__m128i*) (cells + i), _mm_add_epi32(binx, _mm_mullo_epi32(biny, nCellsX)));
+  }
+
+  computeCellsScalar(n - i, xRaw + i, xScale, xShift ? xShift + i : nullptr, y + i, cells + i, geometry);
+
+}
+
+// 8 lanes of doubles per iteration
+__attribute__((target("avx512f")))
+inline void computeCellsAVX512(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, int* cells, const CellGeometry& geometry) {
+
+  const __m512d scale = _mm512_set1_pd(xScale);
+  const __m512d xMin = _mm512_set1_pd(geometry.xMin);
+  const __m512d invWidthX = _mm512_set1_pd(geometry.invWidthX);
+  const __m512d nx = _mm512_set1_pd(geometry.nx);
+  const __m512d yMin = _mm512_set1_pd(geometry.yMin);
+  const __m512d invWidthY = _mm512_set1_pd(geometry.invWidthY);
+  const __m512d ny = _mm512_set1_pd(geometry.ny);
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d minusOne = _mm512_set1_pd(-1.0);
+  const __m512i absMask = _mm512_set1_epi64(0x7fffffffffffffffll);
+  const __m512i infinity = _mm512_set1_epi64(0x7ff0000000000000ll);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i nCellsX = _mm256_set1_epi32(geometry.nCellsX);
+
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d x = _mm512_mul_pd(_mm512_loadu_pd(xRaw + i), scale);
+    if (xShift) {
+      x = _mm512_add_pd(x, _mm512_loadu_pd(xShift + i));
+    }
+    __m512d u = _mm512_mul_pd(_mm512_sub_pd(x, xMin), invWidthX);
+    __m512d v = _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(y + i), yMin), invWidthY);
+    u = _mm512_mask_blend_pd(_mm512_cmpgt_epi64_mask(_mm512_and_epi64(_mm512_castpd_si512(u), absMask), infinity), u, minusOne);
+    v = _mm512_mask_blend_pd(_mm512_cmpgt_epi64_mask(_mm512_and_epi64(_mm512_castpd_si512(v), absMask), infinity), v, minusOne);
+    u = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(u, zero, _CMP_GE_OQ), minusOne, u);
+    u = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(u, nx, _CMP_LT_OQ), nx, u);
+    v = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, zero, _CMP_GE_OQ), minusOne, v);
+    v = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, ny, _CMP_LT_OQ), ny, v);
+    __m256i binx = _mm256_add_epi32(_mm512_cvttpd_epi32(u), one);
+    __m256i biny = _mm256_add_epi32(_mm512_cvttpd_epi32(v), one);
+    _mm256_storeu_si256((__m256i*) (cells + i), _mm256_add_epi32(binx, _mm256_mullo_epi32(biny, nCellsX)));
+  }
+
+  computeCellsScalar(n - i, xRaw + i, xScale, xShift ? xShift + i : nullptr, y + i, cells + i, geometry);
+
+}
+
+#endif
+
+// =================================================================================================
+
+// name of the kernel chosen for this process: the widest one the CPU supports,
+// unless the HISTOGRAMMING_KERNEL environment variable asks for a narrower one ("scalar", "avx2", "avx512")
+inline const char* cellKernelName() {
+  static const char* name = [] {
+    const char* requested = std::getenv("HISTOGRAMMING_KERNEL");
+    bool allowAVX512 = (requested == nullptr || std::strcmp(requested, "avx512") == 0);
+    bool allowAVX2 = allowAVX512 || std::strcmp(requested, "avx2") == 0;
+#ifdef CELL_KERNEL_X86
+    __builtin_cpu_init();
+    if (allowAVX512 && __builtin_cpu_supports("avx512f")) {
+      return "avx512";
+    }
+    if (allowAVX2 && __builtin_cpu_supports("avx2")) {
+      return "avx2";
+    }
+#endif
+    return "scalar";
+  }();
+  return name;
+}
+
+inline CellKernelFunction cellKernel() {
+  static const CellKernelFunction kernel = [] {
+#ifdef CELL_KERNEL_X86
+    if (std::strcmp(cellKernelName(), "avx512") == 0) {
+      return (CellKernelFunction) &computeCellsAVX512;
+    }
+    if (std::strcmp(cellKernelName(), "avx2") == 0) {
+      return (CellKernelFunction) &computeCellsAVX2;
+    }
+#endif
+    return (CellKernelFunction) &computeCellsScalar;
+  }();
+  return kernel;
+}
+
+#endif
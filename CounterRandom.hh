@@ -0,0 +1,53 @@
+#ifndef COUNTER_RANDOM_HH
+#define COUNTER_RANDOM_HH
+
+#include <cstdint>
+
+// =================================================================================================
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC11)
+// the output is a pure function of (key, counter), so any thread can draw any number without sharing generator state
+// matches the Random123 reference: key {0, 0}, counter {0, 0, 0, 0} gives {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}
+class Philox4x32 {
+
+  public:
+
+    static void generate(const std::uint32_t key[2], const std::uint32_t counter[4], std::uint32_t output[4]) {
+      std::uint32_t k0 = key[0];
+      std::uint32_t k1 = key[1];
+      std::uint32_t c0 = counter[0];
+      std::uint32_t c1 = counter[1];
+      std::uint32_t c2 = counter[2];
+      std::uint32_t c3 = counter[3];
+      for (int round = 0; round < 10; round++) {
+        const std::uint64_t product0 = std::uint64_t(multiplier0) * c0;
+        const std::uint64_t product1 = std::uint64_t(multiplier1) * c2;
+        c0 = std::uint32_t(product1 >> 32) ^ c1 ^ k0;
+        c1 = std::uint32_t(product1);
+        c2 = std::uint32_t(product0 >> 32) ^ c3 ^ k1;
+        c3 = std::uint32_t(product0);
+        k0 += weyl0;
+        k1 += weyl1;
+      }
+      output[0] = c0;
+      output[1] = c1;
+      output[2] = c2;
+      output[3] = c3;
+    }
+
+    // uniform double in (0, 1) from two 32-bit words, with 53 random bits like TRandom3::Rndm() never returning 0
+    static double uniform(std::uint32_t high, std::uint32_t low) {
+      const std::uint64_t bits = ((std::uint64_t(high) << 32) | low) >> 11;
+      return (bits + 0.5) * (1.0 / 9007199254740992.0); // 2^-53
+    }
+
+  private:
+
+    static constexpr std::uint32_t multiplier0 = 0xD2511F53;
+    static constexpr std::uint32_t multiplier1 = 0xCD9E8D57;
+    static constexpr std::uint32_t weyl0 = 0x9E3779B9;
+    static constexpr std::uint32_t weyl1 = 0xBB67AE85;
+
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef FILL_RANDOMIZATION_HH
+#define FILL_RANDOMIZATION_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// =================================================================================================
+
+// fast rotation and vertical waist randomization amounts of one fill, kept together since they are always looked up together
+class FillRandomization {
+
+  public:
+
+    double fr;
+    double vw;
+
+};
+
+// =================================================================================================
+
+// open-addressing hash from unique fill index to a dense slot number, assigned in order of first appearance
+// the table is shared by all seeds: slots are added from one thread between fills, and only looked up while filling,
+// so each seed can keep its randomization amounts in a plain vector indexed by slot
+class FillSlotIndex {
+
+  public:
+
+    FillSlotIndex() : keys_(initialCapacity, emptyKey), slots_(initialCapacity, -1), size_(0) {}
+
+    std::size_t size() const { return size_; }
+
+    // unique fill index of a slot
+    long long uniqueFillIndex(long slot) const { return fills_[slot]; }
+
+    // slot of the fill, or -1 if the fill has not been added (unique fill indices are never negative)
+    long find(long long uniqueFillIndex) const {
+      for (std::size_t i = home(uniqueFillIndex); ; i = (i + 1) & mask()) {
+        if (keys_[i] == uniqueFillIndex) {
+          return slots_[i];
+        }
+        if (keys_[i] == emptyKey) {
+          return -1;
+        }
+      }
+    }
+
+    // add the fill if it is new, and return its slot
+    long add(long long uniqueFillIndex) {
+      std::size_t i = home(uniqueFillIndex);
+      for (; keys_[i] != emptyKey; i = (i + 1) & mask()) {
+        if (keys_[i] == uniqueFillIndex) {
+          return slots_[i];
+        }
+      }
+      keys_[i] = uniqueFillIndex;
+      slots_[i] = size_++;
+      fills_.push_back(uniqueFillIndex);
+      // keep the load factor at most 1/2, so that probe sequences stay short
+      if (2 * size_ > keys_.size()) {
+        grow();
+      }
+      return size_ - 1;
+    }
+
+  private:
+
+    static constexpr std::size_t initialCapacity = 1 << 12;
+    static constexpr long long emptyKey = -1;
+
+    std::size_t mask() const { return keys_.size() - 1; }
+
+    // Fibonacci hashing: consecutive fill indices are spread over the whole table
+    std::size_t home(long long uniqueFillIndex) const {
+      return (std::uint64_t(uniqueFillIndex) * 0x9E3779B97F4A7C15ULL >> 32) & mask();
+    }
+
+    void grow() {
+      std::vector<long long> keys(2 * keys_.size(), emptyKey);
+      std::vector<long> slots(2 * slots_.size(), -1);
+      keys.swap(keys_);
+      slots.swap(slots_);
+      for (std::size_t j = 0; j < keys.size(); j++) {
+        if (keys[j] == emptyKey) {
+          continue;
+        }
+        std::size_t i = home(keys[j]);
+        while (keys_[i] != emptyKey) {
+          i = (i + 1) & mask();
+        }
+        keys_[i] = keys[j];
+        slots_[i] = slots[j];
+      }
+    }
+
+    std::vector<long long> keys_;
+    std::vector<long> slots_;
+    std::vector<long long> fills_;
+    std::size_t size_;
+
+};
+
+#endif
@@ -4,9 +4,19 @@
 #include "TH2.h"
 #include "TH3.h"
 
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
 #ifndef HISTOGRAM_BASE
 #define HISTOGRAM_BASE
 
+#include "CaloMask.hh"
+
 // =================================================================================================
 
 // encapsulates a skim TTree entry with relevant branches as member variables for a single positron
@@ -62,6 +72,253 @@ class PileupData {
 
 // =================================================================================================
 
+// read-only view of a contiguous block of singles entries stored column-wise (see SinglesColumns)
+// element i of every column pointer belongs to the i-th entry of the block
+class SinglesBatch {
+
+  public:
+
+    std::size_t size;
+
+    const unsigned int* gpsInteger;
+    const double* time; // cluster times in clock ticks
+    const double* energy; // cluster energies in MeV
+
+    const double* x; // calorimeter x positions in crystal widths
+    const double* y; // calorimeter y positions in crystal widths
+
+    const int* caloIndex;
+    const int* runIndex;
+    const int* subrunIndex;
+    const int* fillIndex;
+    const int* bunchNumber;
+
+    // reassemble the i-th entry of the block as a single PositronData object
+    PositronData entry(std::size_t i) const {
+      PositronData positron;
+      positron.gpsInteger = gpsInteger[i];
+      positron.time = time[i];
+      positron.energy = energy[i];
+      positron.x = x[i];
+      positron.y = y[i];
+      positron.caloIndex = caloIndex[i];
+      positron.runIndex = runIndex[i];
+      positron.subrunIndex = subrunIndex[i];
+      positron.fillIndex = fillIndex[i];
+      positron.bunchNumber = bunchNumber[i];
+      positron.laserInFill = false;
+      return positron;
+    }
+
+};
+
+// structure-of-arrays storage for singles entries, with one contiguous column per PositronData member
+class SinglesColumns {
+
+  public:
+
+    std::vector<unsigned int> gpsInteger;
+    std::vector<double> time;
+    std::vector<double> energy;
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<int> caloIndex;
+    std::vector<int> runIndex;
+    std::vector<int> subrunIndex;
+    std::vector<int> fillIndex;
+    std::vector<int> bunchNumber;
+
+    std::size_t size() const { return time.size(); }
+
+    void reserve(std::size_t n) {
+      gpsInteger.reserve(n); time.reserve(n); energy.reserve(n); x.reserve(n); y.reserve(n);
+      caloIndex.reserve(n); runIndex.reserve(n); subrunIndex.reserve(n); fillIndex.reserve(n); bunchNumber.reserve(n);
+    }
+
+    void clear() {
+      gpsInteger.clear(); time.clear(); energy.clear(); x.clear(); y.clear();
+      caloIndex.clear(); runIndex.clear(); subrunIndex.clear(); fillIndex.clear(); bunchNumber.clear();
+    }
+
+    void push_back(const PositronData& entry) {
+      gpsInteger.push_back(entry.gpsInteger);
+      time.push_back(entry.time);
+      energy.push_back(entry.energy);
+      x.push_back(entry.x);
+      y.push_back(entry.y);
+      caloIndex.push_back(entry.caloIndex);
+      runIndex.push_back(entry.runIndex);
+      subrunIndex.push_back(entry.subrunIndex);
+      fillIndex.push_back(entry.fillIndex);
+      bunchNumber.push_back(entry.bunchNumber);
+    }
+
+    // view of the entries [first, last)
+    SinglesBatch batch(std::size_t first, std::size_t last) const {
+      SinglesBatch view;
+      view.size = last - first;
+      view.gpsInteger = gpsInteger.data() + first;
+      view.time = time.data() + first;
+      view.energy = energy.data() + first;
+      view.x = x.data() + first;
+      view.y = y.data() + first;
+      view.caloIndex = caloIndex.data() + first;
+      view.runIndex = runIndex.data() + first;
+      view.subrunIndex = subrunIndex.data() + first;
+      view.fillIndex = fillIndex.data() + first;
+      view.bunchNumber = bunchNumber.data() + first;
+      return view;
+    }
+
+    SinglesBatch batch() const { return batch(0, size()); }
+
+};
+
+// =================================================================================================
+
+// read-only view of a contiguous block of pileup events stored column-wise (see PileupColumns)
+// per-event columns are indexed by event i; the clusters of event i are [offset[i], offset[i + 1]) in the per-cluster columns
+class PileupBatch {
+
+  public:
+
+    std::size_t size; // number of events
+
+    const int* runIndex;
+    const int* subrunIndex;
+    const int* fillIndex;
+    const int* bunchNumber;
+    const std::size_t* offset; // size + 1 elements
+
+    const int* pileupIndex;
+    const char* pileupFlagged;
+    const double* pileupTime; // cluster times in clock ticks
+    const double* pileupEnergy; // cluster energies in MeV
+    const double* pileupX; // calorimeter x positions in crystal widths
+    const double* pileupY; // calorimeter y positions in crystal widths
+    const int* pileupCaloIndex;
+
+    // reassemble the i-th event of the block as a single PileupData object
+    PileupData entry(std::size_t i) const {
+      PileupData pileup;
+      pileup.laserInFill = false;
+      pileup.runIndex = runIndex[i];
+      pileup.subrunIndex = subrunIndex[i];
+      pileup.fillIndex = fillIndex[i];
+      pileup.bunchNumber = bunchNumber[i];
+      // columns of fields that were not read are null and leave the corresponding vectors empty
+      if (pileupIndex) pileup.pileupIndex.assign(pileupIndex + offset[i], pileupIndex + offset[i + 1]);
+      if (pileupFlagged) pileup.pileupFlagged.assign(pileupFlagged + offset[i], pileupFlagged + offset[i + 1]);
+      if (pileupTime) pileup.pileupTime.assign(pileupTime + offset[i], pileupTime + offset[i + 1]);
+      if (pileupEnergy) pileup.pileupEnergy.assign(pileupEnergy + offset[i], pileupEnergy + offset[i + 1]);
+      if (pileupX) pileup.pileupX.assign(pileupX + offset[i], pileupX + offset[i + 1]);
+      if (pileupY) pileup.pileupY.assign(pileupY + offset[i], pileupY + offset[i + 1]);
+      if (pileupCaloIndex) pileup.pileupCaloIndex.assign(pileupCaloIndex + offset[i], pileupCaloIndex + offset[i + 1]);
+      return pileup;
+    }
+
+};
+
+// structure-of-arrays storage for pileup events: per-event columns, plus the clusters of all events
+// flattened into contiguous per-cluster columns with CSR-style offsets (no per-event heap allocations)
+class PileupColumns {
+
+  public:
+
+    std::vector<int> runIndex;
+    std::vector<int> subrunIndex;
+    std::vector<int> fillIndex;
+    std::vector<int> bunchNumber;
+    std::vector<std::size_t> offset = {0}; // always one element more than the number of events
+
+    std::vector<int> pileupIndex;
+    std::vector<char> pileupFlagged; // char instead of bool, so that the column is contiguous
+    std::vector<double> pileupTime;
+    std::vector<double> pileupEnergy;
+    std::vector<double> pileupX;
+    std::vector<double> pileupY;
+    std::vector<int> pileupCaloIndex;
+
+    std::size_t size() const { return runIndex.size(); }
+    std::size_t clusters() const { return offset.back(); }
+
+    void reserve(std::size_t nEvents, std::size_t nClusters) {
+      runIndex.reserve(nEvents); subrunIndex.reserve(nEvents); fillIndex.reserve(nEvents); bunchNumber.reserve(nEvents); offset.reserve(nEvents + 1);
+      pileupIndex.reserve(nClusters); pileupFlagged.reserve(nClusters); pileupTime.reserve(nClusters); pileupEnergy.reserve(nClusters);
+      pileupX.reserve(nClusters); pileupY.reserve(nClusters); pileupCaloIndex.reserve(nClusters);
+    }
+
+    void clear() {
+      runIndex.clear(); subrunIndex.clear(); fillIndex.clear(); bunchNumber.clear(); offset.assign(1, 0);
+      pileupIndex.clear(); pileupFlagged.clear(); pileupTime.clear(); pileupEnergy.clear();
+      pileupX.clear(); pileupY.clear(); pileupCaloIndex.clear();
+    }
+
+    // drop everything after the first nEvents events (columns of fields that were not read stay empty)
+    void truncate(std::size_t nEvents) {
+      runIndex.resize(std::min(runIndex.size(), nEvents)); subrunIndex.resize(std::min(subrunIndex.size(), nEvents));
+      fillIndex.resize(std::min(fillIndex.size(), nEvents)); bunchNumber.resize(std::min(bunchNumber.size(), nEvents));
+      offset.resize(std::min(offset.size(), nEvents + 1));
+      const std::size_t nClusters = offset.back();
+      pileupIndex.resize(std::min(pileupIndex.size(), nClusters)); pileupFlagged.resize(std::min(pileupFlagged.size(), nClusters));
+      pileupTime.resize(std::min(pileupTime.size(), nClusters)); pileupEnergy.resize(std::min(pileupEnergy.size(), nClusters));
+      pileupX.resize(std::min(pileupX.size(), nClusters)); pileupY.resize(std::min(pileupY.size(), nClusters));
+      pileupCaloIndex.resize(std::min(pileupCaloIndex.size(), nClusters));
+    }
+
+    // append one event, taking the per-event members from 'header' and the clusters from the given vectors
+    void push_back(const PileupData& header, const std::vector<int>& index, const std::vector<bool>& flagged,
+                   const std::vector<double>& time, const std::vector<double>& energy,
+                   const std::vector<double>& xPosition, const std::vector<double>& yPosition, const std::vector<int>& calo) {
+      runIndex.push_back(header.runIndex);
+      subrunIndex.push_back(header.subrunIndex);
+      fillIndex.push_back(header.fillIndex);
+      bunchNumber.push_back(header.bunchNumber);
+      pileupIndex.insert(pileupIndex.end(), index.begin(), index.end());
+      pileupFlagged.insert(pileupFlagged.end(), flagged.begin(), flagged.end());
+      pileupTime.insert(pileupTime.end(), time.begin(), time.end());
+      pileupEnergy.insert(pileupEnergy.end(), energy.begin(), energy.end());
+      pileupX.insert(pileupX.end(), xPosition.begin(), xPosition.end());
+      pileupY.insert(pileupY.end(), yPosition.begin(), yPosition.end());
+      pileupCaloIndex.insert(pileupCaloIndex.end(), calo.begin(), calo.end());
+      // every read cluster column has the same length; fields that were not read are passed as empty vectors
+      offset.push_back(offset.back() + std::max({index.size(), flagged.size(), time.size(), energy.size(),
+                                                 xPosition.size(), yPosition.size(), calo.size()}));
+    }
+
+    // view of the events [first, last); per-cluster columns are not shifted, since the offsets are absolute
+    PileupBatch batch(std::size_t first, std::size_t last) const {
+      PileupBatch view;
+      view.size = last - first;
+      view.runIndex = runIndex.data() + first;
+      view.subrunIndex = subrunIndex.data() + first;
+      view.fillIndex = fillIndex.data() + first;
+      view.bunchNumber = bunchNumber.data() + first;
+      view.offset = offset.data() + first;
+      view.pileupIndex = column(pileupIndex);
+      view.pileupFlagged = column(pileupFlagged);
+      view.pileupTime = column(pileupTime);
+      view.pileupEnergy = column(pileupEnergy);
+      view.pileupX = column(pileupX);
+      view.pileupY = column(pileupY);
+      view.pileupCaloIndex = column(pileupCaloIndex);
+      return view;
+    }
+
+    PileupBatch batch() const { return batch(0, size()); }
+
+  private:
+
+    // data of a per-cluster column, or null if the field was not read (see SkimFields)
+    template <typename T>
+    const T* column(const std::vector<T>& values) const {
+      return values.size() == clusters() && !values.empty() ? values.data() : nullptr;
+    }
+
+};
+
+// =================================================================================================
+
 // encapsulates external inputs needed for constructing the lost muon histogram
 class LostMuonInput {
 
@@ -113,6 +370,97 @@ class LostMuonData {
 
 // =================================================================================================
 
+class ThreadPool;
+
+// serializes ROOT output (TTree/TBranch Fill, Write, directory changes) on the shared output files,
+// for when instances for several random seeds are filled concurrently; recursive so that nested locking is harmless
+inline std::recursive_mutex& outputMutex() {
+  static std::recursive_mutex mutex;
+  return mutex;
+}
+
+// =================================================================================================
+
+// storage format of skim inputs and of columnar outputs: ROOT TTrees, or RNTuples (ROOT 6.34 or later)
+enum class StorageFormat { tree, rntuple };
+
+// format named on the command line ("tree" or "rntuple"), exiting with a message for anything else
+inline StorageFormat parseStorageFormat(const std::string& name) {
+  if (name == "tree") {
+    return StorageFormat::tree;
+  } else if (name == "rntuple") {
+    return StorageFormat::rntuple;
+  }
+  printf("Storage format '%s' not recognized (tree or rntuple).\n", name.c_str());
+  std::exit(1);
+}
+
+// a time spectrum (wiggle plot) derived from an energy-time spectrum, as requested on the command line
+// energy bins whose centre lies in [eMin, eMax) are integrated, optionally weighted by the decay asymmetry A(E) of their centre
+// (A-weighted method); rebin consecutive time bins make one output bin (for Byu2Histograms, one time bin is one cyclotron period)
+class ProjectionSpec {
+
+  public:
+
+    ProjectionSpec() : name(""), eMin(0), eMax(0), rebin(1), asymmetryWeighted(false) {}
+
+    std::string name;
+    double eMin;
+    double eMax;
+    int rebin;
+    bool asymmetryWeighted;
+
+};
+
+// output layout requested on the command line
+// columnar: store per-subrun spectra as flat bin-content arrays in a TTree, with the axes written once, instead of one TH2F per subrun
+// zeroSuppressed: in columnar mode, store only the non-empty cells of each subrun together with their cell indices
+// format: container of the columnar per-subrun spectra (an RNTuple instead of a TTree implies columnar)
+// perCalo: also store per-subrun spectra of every calorimeter separately (always columnar and zero-suppressed, in 'format')
+// projections: wiggle plots to derive from the per-subrun spectra and store next to them
+class OutputOptions {
+
+  public:
+
+    OutputOptions() : columnar(false), zeroSuppressed(false), format(StorageFormat::tree), perCalo(false) {}
+
+    bool columnar;
+    bool zeroSuppressed;
+    StorageFormat format;
+    bool perCalo;
+    std::vector<ProjectionSpec> projections;
+
+};
+
+// =================================================================================================
+
+// bit mask of skim TTree fields, used by HistogramBase subclasses to declare which branches they read
+// time, energy, x, y and caloIndex stand for both the singles branches and their pileup counterparts (pileupTime, ...)
+// branches outside the combined mask of all subclasses and the driver are not read at all, and their columns hold
+// dummy values (singles) or stay empty (pileup clusters; the corresponding batch pointers are then null)
+class SkimFields {
+
+  public:
+
+    static constexpr unsigned int gpsInteger = 1u << 0;
+    static constexpr unsigned int time = 1u << 1;
+    static constexpr unsigned int energy = 1u << 2;
+    static constexpr unsigned int x = 1u << 3;
+    static constexpr unsigned int y = 1u << 4;
+    static constexpr unsigned int caloIndex = 1u << 5;
+    static constexpr unsigned int runIndex = 1u << 6;
+    static constexpr unsigned int subrunIndex = 1u << 7;
+    static constexpr unsigned int fillIndex = 1u << 8;
+    static constexpr unsigned int bunchNumber = 1u << 9;
+    static constexpr unsigned int pileupIndex = 1u << 10;
+    static constexpr unsigned int pileupFlagged = 1u << 11;
+
+    static constexpr unsigned int all = (1u << 12) - 1;
+
+};
+
+// =================================================================================================
+
 class HistogramBase {
 
   public:
@@ -137,12 +485,60 @@ class HistogramBase {
     // e.g. entry.pileupTime, entry.pileupEnergy, ...
     virtual void fillTriplesHistograms(PileupData& entry, double frRandomization, double vwRandomization, int seedIndex, int skimIndex) = 0;
 
+    // the batch methods below are called instead of the single-entry methods above when the driver holds entries column-wise
+    // frRandomization[i] and vwRandomization[i] are the randomization amounts for the i-th entry of the batch
+    // the default implementations reassemble each entry and forward it, so subclasses only override them to fill whole blocks at once
+    // all instances of a job (every class, every seed) are filled concurrently from the same read-only batch, so instances
+    // must not share mutable state other than through outputMutex()
+
+    virtual void fillSinglesBatch(const SinglesBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) {
+      for (std::size_t i = 0; i < batch.size; i++) {
+        PositronData entry = batch.entry(i);
+        fillSinglesHistograms(entry, frRandomization[i], vwRandomization[i], seedIndex, skimIndex);
+      }
+    }
+
+    virtual void fillDoublesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) {
+      for (std::size_t i = 0; i < batch.size; i++) {
+        PileupData entry = batch.entry(i);
+        fillDoublesHistograms(entry, frRandomization[i], vwRandomization[i], seedIndex, skimIndex);
+      }
+    }
+
+    virtual void fillTriplesBatch(const PileupBatch& batch, const double* frRandomization, const double* vwRandomization, int seedIndex, int skimIndex) {
+      for (std::size_t i = 0; i < batch.size; i++) {
+        PileupData entry = batch.entry(i);
+        fillTriplesHistograms(entry, frRandomization[i], vwRandomization[i], seedIndex, skimIndex);
+      }
+    }
+
+    // the driver hands over its thread pool when several threads are available, so that a subclass may split its own batch fills
+    // (the pool may be busy with other seeds, in which case nested parallel loops simply run on the calling thread)
+    virtual void setThreadPool(ThreadPool* /* threadPool */) {}
+
+    // in fused mode the driver calls this, in (run, subrun) order, once every entry of subrun (runIndex, subrunIndex) and of all
+    // subruns before it has been filled; subclasses with per-subrun output may write those subruns now and free them
+    // (locking outputMutex() themselves); writeHistograms() is still called at the end
+    virtual void finishSubrunsUpTo(int /* runIndex */, int /* subrunIndex */) {}
+
+    // the driver passes the requested output layout before bookHistograms(); subclasses without alternative layouts ignore it
+    virtual void setOutputOptions(const OutputOptions& /* options */) {}
+
+    // the driver passes the calorimeters selected on the command line before bookHistograms(); clusters of the other
+    // calorimeters should not be histogrammed (the default, for subclasses that ignore it, is to keep everything)
+    virtual void setCaloMask(const CaloMask& /* calos */) {}
+
+    // skim fields (SkimFields bits) this subclass reads from the entries it is given; called on a fresh instance before anything is read
+    // the default reads everything, so subclasses only override it to narrow the set of branches that are decompressed
+    virtual unsigned int requiredFields() const { return SkimFields::all; }
+
     // this method will be called once for every entry in the lost-muon-candidate TTree
     // LostMuonData object contains all relevant branches from the lost muon TTree entry as members
     // LostMuonInput object contains the expected lost muon times-of-flight per-calorimeter
     virtual void fillLostMuonHistograms(LostMuonData& entry, LostMuonInput& lmInput, double frRandomization, double vwRandomization, int seedIndex, int skimIndex) = 0;
 
     // use this method to call Write() on all histograms (and delete, if pointers)
+    // the driver calls it with outputMutex() held; anything that writes to an output file during filling must lock outputMutex() itself
     virtual void writeHistograms(TFile* outputFile, int seedIndex) = 0;
 
 };
@@ -0,0 +1,65 @@
+#ifndef HISTOGRAM_REGISTRY_HH
+#define HISTOGRAM_REGISTRY_HH
+
+#include "HistogramBase.hh"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+
+// factory of HistogramBase subclasses by class name, filled by the subclasses themselves (see REGISTER_HISTOGRAM_CLASS)
+// so that adding a class to the package means adding its .cc to the build, without touching the driver
+class HistogramRegistry {
+
+  public:
+
+    typedef std::function<HistogramBase*()> Factory;
+
+    // the registry shared by all translation units, created on first use (also during static initialization)
+    static HistogramRegistry& instance() {
+      static HistogramRegistry registry;
+      return registry;
+    }
+
+    // returns true, so that registration can initialize a static variable
+    bool add(const std::string& className, Factory factory) {
+      factories_[className] = factory;
+      return true;
+    }
+
+    bool contains(const std::string& className) const {
+      return factories_.find(className) != factories_.end();
+    }
+
+    // new instance of a registered class, or nullptr
+    HistogramBase* create(const std::string& className) const {
+      std::map<std::string, Factory>::const_iterator it = factories_.find(className);
+      return (it != factories_.end()) ? it -> second() : nullptr;
+    }
+
+    // registered class names, in alphabetical order
+    std::vector<std::string> classNames() const {
+      std::vector<std::string> names;
+      for (const auto& entry: factories_) {
+        names.push_back(entry.first);
+      }
+      return names;
+    }
+
+  private:
+
+    HistogramRegistry() {}
+
+    std::map<std::string, Factory> factories_;
+
+};
+
+// register a default-constructible HistogramBase subclass under its own name; put this in the class's .cc file
+// (the object file must be linked directly, not through a static library, or the linker may drop the registration)
+#define REGISTER_HISTOGRAM_CLASS(ClassName) \
+  static const bool ClassName##Registered = HistogramRegistry::instance().add(#ClassName, []() -> HistogramBase* { return new ClassName(); })
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef JOB_CHECKPOINT_HH
+#define JOB_CHECKPOINT_HH
+
+#include "SubrunAccumulator.hh"
+
+#include "TFile.h"
+#include "TNamed.h"
+#include "TRandom3.h"
+#include "TString.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+
+// progress of a checkpointed runHistogramming job (--checkpoint): the outputs of all subruns up to and including 'last' are
+// complete in part files 0 .. nParts - 1 of every class, and every seed's TRandom3 is saved in the state it had after the fills
+// of those subruns, so that a restarted job can skip them and continue with the same random numbers
+// stored next to the outputs as a small ROOT file with a TNamed "checkpoint", whose title holds one item per line, in this order:
+//   dataset 2F
+//   skim 12
+//   seeds firstSeed nSeeds
+//   classes Byu2Histograms,...
+//   counterRng 0|1
+//   parts nParts
+//   last runIndex subrunIndex
+// and, unless counterRng is set, one TRandom3 "generator_seed<N>" per seed
+class JobCheckpoint {
+
+  public:
+
+    JobCheckpoint() : dataset(""), skimIndex(-1), firstSeed(0), nSeeds(0), classList(""), counterRandom(false), nParts(0), last(-1, -1) {}
+
+    // job description: a checkpoint only resumes the job it was written by
+    std::string dataset;
+    int skimIndex;
+    int firstSeed;
+    int nSeeds;
+    std::string classList;
+    bool counterRandom;
+
+    // progress
+    int nParts;
+    SubrunKey last;
+
+    static std::string path(const std::string& outputPath, const std::string& dataset, int skimIndex) {
+      return Form("%s/checkpoint_dataset%s_skim%05d.root", outputPath.c_str(), dataset.c_str(), skimIndex);
+    }
+
+    // part 'part' of the output of one class, written between two checkpoints
+    static std::string partPath(const std::string& outputPath, const std::string& className, const std::string& dataset, int skimIndex, int part) {
+      return Form("%s/%s_dataset%s_skim%05d.part%03d.root", outputPath.c_str(), className.c_str(), dataset.c_str(), skimIndex, part);
+    }
+
+    bool sameJob(const JobCheckpoint& other) const {
+      return dataset == other.dataset && skimIndex == other.skimIndex && firstSeed == other.firstSeed && nSeeds == other.nSeeds
+          && classList == other.classList && counterRandom == other.counterRandom;
+    }
+
+    // write the checkpoint with the generators of seeds firstSeed, firstSeed + 1, ... (none for counter-based randomization)
+    // into a temporary file that is then renamed over 'path', so that a job killed while writing leaves the previous checkpoint intact
+    bool write(const std::string& path, const std::vector<TRandom3*>& generators) const {
+      const std::string temporaryPath = path + ".tmp";
+      TFile file(temporaryPath.c_str(), "RECREATE");
+      if (file.IsZombie()) {
+        return false;
+      }
+      TNamed description("checkpoint", describe().c_str());
+      bool written = description.Write() > 0;
+      for (std::size_t i = 0; i < generators.size(); i++) {
+        written = written && generators[i] -> Write(Form("generator_seed%d", firstSeed + int(i))) > 0;
+      }
+      file.Close();
+      return written && std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+    }
+
+    // read the checkpoint at 'path' and the saved generators, if there is one; exits with a message if it is unreadable
+    static bool read(const std::string& path, JobCheckpoint& checkpoint, std::vector<std::unique_ptr<TRandom3>>& generators) {
+      if (FILE* probe = fopen(path.c_str(), "r")) {
+        fclose(probe);
+      } else {
+        return false;
+      }
+      TFile file(path.c_str(), "READ");
+      std::unique_ptr<TNamed> description(file.IsZombie() ? nullptr : file.Get<TNamed>("checkpoint"));
+      if (!description || !checkpoint.parse(description -> GetTitle())) {
+        printf("Checkpoint '%s' could not be read; remove it to start the job over.\n", path.c_str());
+        std::exit(1);
+      }
+      generators.clear();
+      for (int i = 0; i < checkpoint.nSeeds && !checkpoint.counterRandom; i++) {
+        generators.emplace_back(file.Get<TRandom3>(Form("generator_seed%d", checkpoint.firstSeed + i)));
+        if (!generators.back()) {
+          printf("Checkpoint '%s' has no generator for seed %d; remove it to start the job over.\n", path.c_str(), checkpoint.firstSeed + i);
+          std::exit(1);
+        }
+      }
+      file.Close();
+      return true;
+    }
+
+  private:
+
+    std::string describe() const {
+      return Form("dataset %s\nskim %d\nseeds %d %d\nclasses %s\ncounterRng %d\nparts %d\nlast %d %d\n",
+                  dataset.c_str(), skimIndex, firstSeed, nSeeds, classList.c_str(), counterRandom ? 1 : 0, nParts, last.first, last.second);
+    }
+
+    bool parse(const std::string& text) {
+      std::stringstream lines(text);
+      std::string key;
+      int counterRng = 0;
+      lines >> key >> dataset;
+      bool valid = (key == "dataset");
+      lines >> key >> skimIndex;
+      valid = valid && key == "skim";
+      lines >> key >> firstSeed >> nSeeds;
+      valid = valid && key == "seeds";
+      lines >> key >> classList;
+      valid = valid && key == "classes";
+      lines >> key >> counterRng;
+      valid = valid && key == "counterRng";
+      lines >> key >> nParts;
+      valid = valid && key == "parts";
+      lines >> key >> last.first >> last.second;
+      valid = valid && key == "last";
+      counterRandom = (counterRng != 0);
+      return valid && !lines.fail() && nSeeds > 0 && nParts > 0;
+    }
+
+};
+
+#endif
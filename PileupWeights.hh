@@ -0,0 +1,67 @@
+#ifndef PILEUP_WEIGHTS_HH
+#define PILEUP_WEIGHTS_HH
+
+#include <initializer_list>
+
+// =================================================================================================
+
+// compile-time lookup from a pileup cluster's pileupIndex to its weight in the pileup-correction spectrum
+// indices listed with assign() get their own weight, every other index (including negative or out-of-range ones)
+// gets the default; a cluster whose weight is 0 is skipped
+// new schemes (e.g. quadruple pileup, or alternative weightings) are built the same way as the ones below
+class PileupWeightTable {
+
+  public:
+
+    static constexpr int nIndices = 64;
+
+    constexpr PileupWeightTable(double defaultWeight) : weights_(), defaultWeight_(defaultWeight) {
+      for (int i = 0; i < nIndices; i++) {
+        weights_[i] = defaultWeight;
+      }
+    }
+
+    constexpr PileupWeightTable& assign(std::initializer_list<int> indices, double weight) {
+      for (int index: indices) {
+        weights_[index] = weight;
+      }
+      return *this;
+    }
+
+    constexpr double weight(int pileupIndex) const {
+      return (pileupIndex >= 0 && pileupIndex < nIndices) ? weights_[pileupIndex] : defaultWeight_;
+    }
+
+    constexpr bool kept(int pileupIndex) const {
+      return weight(pileupIndex) != 0;
+    }
+
+  private:
+
+    double weights_[nIndices];
+    double defaultWeight_;
+
+};
+
+// =================================================================================================
+
+// double pileup: the pileup cluster (index 2) is added, the two singles it was built from are subtracted
+constexpr PileupWeightTable makeDoublesPileupWeights() {
+  PileupWeightTable table(-0.5);
+  table.assign({2}, 0.5);
+  return table;
+}
+
+// triple pileup: clusters analogous to doubles in double-pileup events are added, those analogous to singles
+// are subtracted, and the remaining indices are not used
+constexpr PileupWeightTable makeTriplesPileupWeights() {
+  PileupWeightTable table(0.0);
+  table.assign({0, 1, 2, 6, 9, 12}, 0.5);
+  table.assign({3, 4, 5, 7, 8, 10, 11}, -0.5);
+  return table;
+}
+
+constexpr PileupWeightTable doublesPileupWeights = makeDoublesPileupWeights();
+constexpr PileupWeightTable triplesPileupWeights = makeTriplesPileupWeights();
+
+#endif
@@ -0,0 +1,247 @@
+#include "Profiler.hh"
+
+#include "TFile.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// =================================================================================================
+
+// heap allocations are counted by replacing the global operator new (the array and nothrow forms call it by default)
+// the per-thread count is what ScopedTimer attributes to a phase; the job total is shared by all threads, so it is only
+// updated while the profiler is enabled
+
+static std::atomic<bool> countAllocations(false);
+static std::atomic<long long> totalAllocations(0);
+static thread_local long long allocationsOfThread = 0;
+
+void* operator new(std::size_t size) {
+  if (countAllocations.load(std::memory_order_relaxed)) {
+    allocationsOfThread++;
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* memory = std::malloc(size > 0 ? size : 1);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t /* size */) noexcept {
+  std::free(memory);
+}
+
+long long threadAllocations() {
+  return allocationsOfThread;
+}
+
+// =================================================================================================
+
+Profiler& profiler() {
+  static Profiler instance;
+  return instance;
+}
+
+Profiler::Profiler() : enabled_(false), start_(std::chrono::steady_clock::now()) {}
+
+Profiler::~Profiler() {
+#ifdef __linux__
+  for (const std::pair<const char*, int>& counter: hardwareCounters_) {
+    close(counter.second);
+  }
+#endif
+}
+
+void Profiler::enable(bool hardwareCounters) {
+
+  enabled_ = true;
+  start_ = std::chrono::steady_clock::now();
+  countAllocations = true;
+
+  if (!hardwareCounters) {
+    return;
+  }
+
+#ifdef __linux__
+  // user-space counts of this process, including the threads it starts from now on (inherit), one counter per event
+  // (inherited counters cannot be read as a group); multiplexed counts are scaled to the full running time
+  const std::pair<const char*, std::uint64_t> events[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+    {"cacheReferences", PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cacheMisses", PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branchMisses", PERF_COUNT_HW_BRANCH_MISSES}
+  };
+  for (const auto& event: events) {
+    perf_event_attr attributes;
+    std::memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = event.second;
+    attributes.inherit = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    const int descriptor = syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+    if (descriptor < 0) {
+      printf("Hardware counter '%s' not available (perf_event_open: %s), skipped.\n", event.first, std::strerror(errno));
+      continue;
+    }
+    hardwareCounters_.push_back(std::make_pair(event.first, descriptor));
+  }
+#else
+  printf("Hardware counters need Linux perf_event, skipped.\n");
+#endif
+
+}
+
+ProfilePhase& Profiler::phase(const char* name, const char* detail) {
+  std::string fullName = name;
+  if (detail != nullptr) {
+    fullName += "/";
+    fullName += detail;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, ProfilePhase*>::iterator it = phaseIndex_.find(fullName);
+  if (it == phaseIndex_.end()) {
+    phases_.emplace_back(fullName);
+    it = phaseIndex_.insert(std::make_pair(fullName, &phases_.back())).first;
+  }
+  return *it -> second;
+}
+
+void Profiler::count(const char* name, long long amount) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::pair<std::string, long long>& counter: counters_) {
+    if (counter.first == name) {
+      counter.second += amount;
+      return;
+    }
+  }
+  counters_.push_back(std::make_pair(std::string(name), amount));
+}
+
+void Profiler::setInfo(const std::string& key, const std::string& value) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  info_.push_back(std::make_pair(key, value));
+}
+
+// =================================================================================================
+
+// JSON string literal
+static std::string quoted(const std::string& text) {
+  std::string result = "\"";
+  for (char c: text) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+// bytes this process made the storage layer fetch (Linux, -1 elsewhere)
+static long long storageBytesRead() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  long long value;
+  while (io >> key >> value) {
+    if (key == "read_bytes:") {
+      return value;
+    }
+  }
+  return -1;
+}
+
+bool Profiler::writeReport(const std::string& path) {
+
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(file, "{\n");
+
+  fprintf(file, "  \"info\": {");
+  for (std::size_t i = 0; i < info_.size(); i++) {
+    fprintf(file, "%s\n    %s: %s", (i > 0) ? "," : "", quoted(info_[i].first).c_str(), quoted(info_[i].second).c_str());
+  }
+  fprintf(file, "\n  },\n");
+
+  fprintf(file, "  \"job\": {\n");
+  fprintf(file, "    \"wallSeconds\": %.6f,\n", wallSeconds);
+  fprintf(file, "    \"userSeconds\": %.6f,\n", usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec);
+  fprintf(file, "    \"systemSeconds\": %.6f,\n", usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec);
+  fprintf(file, "    \"peakRssKiB\": %ld,\n", usage.ru_maxrss);
+  fprintf(file, "    \"rootBytesRead\": %lld,\n", (long long) TFile::GetFileBytesRead());
+  fprintf(file, "    \"storageBytesRead\": %lld,\n", storageBytesRead());
+  fprintf(file, "    \"allocations\": %lld\n", totalAllocations.load());
+  fprintf(file, "  },\n");
+
+  fprintf(file, "  \"phases\": [");
+  for (std::size_t i = 0; i < phases_.size(); i++) {
+    const ProfilePhase& phase = phases_[i];
+    const double seconds = 1e-9 * phase.nanoseconds;
+    fprintf(file, "%s\n    {\"name\": %s, \"calls\": %lld, \"seconds\": %.6f, \"entries\": %lld, \"entriesPerSecond\": %.1f, \"allocations\": %lld}",
+            (i > 0) ? "," : "", quoted(phase.name).c_str(), phase.calls.load(), seconds, phase.entries.load(),
+            (seconds > 0) ? phase.entries / seconds : 0.0, phase.allocations.load());
+  }
+  fprintf(file, "\n  ],\n");
+
+  fprintf(file, "  \"counters\": {");
+  for (std::size_t i = 0; i < counters_.size(); i++) {
+    fprintf(file, "%s\n    %s: %lld", (i > 0) ? "," : "", quoted(counters_[i].first).c_str(), counters_[i].second);
+  }
+  fprintf(file, "\n  },\n");
+
+  fprintf(file, "  \"hardware\": {");
+#ifdef __linux__
+  for (std::size_t i = 0; i < hardwareCounters_.size(); i++) {
+    // value, time enabled, time running
+    std::uint64_t values[3] = {0, 0, 0};
+    double count = -1;
+    if (read(hardwareCounters_[i].second, values, sizeof(values)) == sizeof(values)) {
+      count = (values[2] > 0) ? double(values[0]) * values[1] / values[2] : 0;
+    }
+    fprintf(file, "%s\n    %s: %.0f", (i > 0) ? "," : "", quoted(hardwareCounters_[i].first).c_str(), count);
+  }
+#endif
+  fprintf(file, "\n  }\n");
+
+  fprintf(file, "}\n");
+
+  return fclose(file) == 0;
+
+}
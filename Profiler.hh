@@ -0,0 +1,166 @@
+#ifndef PROFILER_HH
+#define PROFILER_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+
+// totals of one phase of the job, summed over every thread and every time the phase was entered
+class ProfilePhase {
+
+  public:
+
+    ProfilePhase(const std::string& name) : name(name), calls(0), nanoseconds(0), entries(0), allocations(0) {}
+
+    const std::string name;
+    std::atomic<long long> calls;
+    std::atomic<long long> nanoseconds;
+    std::atomic<long long> entries;
+    std::atomic<long long> allocations;
+
+};
+
+// =================================================================================================
+
+// job-wide instrumentation: phases timed with ScopedTimer, named event counters, heap allocation counts and, optionally,
+// Linux perf_event hardware counters, written as one JSON report per job (see ProfileSession)
+// everything is off until enable() is called; until then a timer or counter costs one branch
+class Profiler {
+
+  public:
+
+    Profiler();
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // start counting (before any other thread starts); hardwareCounters also opens the perf_event counters,
+    // which are skipped with a warning if the kernel does not allow them (see /proc/sys/kernel/perf_event_paranoid)
+    void enable(bool hardwareCounters);
+    bool enabled() const { return enabled_; }
+
+    // the phase called 'name', or 'name/detail' (e.g. per class), created on first use; phases are reported in that order
+    ProfilePhase& phase(const char* name, const char* detail = nullptr);
+
+    // add to the counter called 'name' (no-op while disabled)
+    void count(const char* name, long long amount = 1);
+
+    // job description reported alongside the measurements (dataset, mode, threads, ...)
+    void setInfo(const std::string& key, const std::string& value);
+
+    // write the JSON report; returns false if the file cannot be written
+    bool writeReport(const std::string& path);
+
+  private:
+
+    bool enabled_;
+
+    std::mutex mutex_;
+    std::deque<ProfilePhase> phases_;
+    std::map<std::string, ProfilePhase*> phaseIndex_;
+    std::vector<std::pair<std::string, long long>> counters_;
+    std::vector<std::pair<std::string, std::string>> info_;
+
+    std::chrono::steady_clock::time_point start_;
+
+    // perf_event file descriptors, with the name of what each one counts
+    std::vector<std::pair<const char*, int>> hardwareCounters_;
+
+};
+
+// the profiler shared by the whole job
+Profiler& profiler();
+
+// heap allocations made by the calling thread so far (counted only while the profiler is enabled)
+long long threadAllocations();
+
+// =================================================================================================
+
+// adds the wall time of a scope, its entries and the heap allocations made in it by the calling thread to a phase
+class ScopedTimer {
+
+  public:
+
+    ScopedTimer(const char* name, const char* detail = nullptr) : phase_(nullptr), entries_(0), allocations_(0) {
+      if (profiler().enabled()) {
+        phase_ = &profiler().phase(name, detail);
+        allocations_ = threadAllocations();
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~ScopedTimer() { stop(); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    // entries processed in this scope, for the phase's entries per second
+    void addEntries(long long entries) { entries_ += entries; }
+
+    // end the scope early
+    void stop() {
+      if (phase_ == nullptr) {
+        return;
+      }
+      const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start_;
+      phase_ -> calls += 1;
+      phase_ -> nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+      phase_ -> entries += entries_;
+      phase_ -> allocations += threadAllocations() - allocations_;
+      phase_ = nullptr;
+    }
+
+  private:
+
+    ProfilePhase* phase_;
+    long long entries_;
+    long long allocations_;
+    std::chrono::steady_clock::time_point start_;
+
+};
+
+// =================================================================================================
+
+// profiles the enclosing scope as the phase "job" and writes the report to 'path' when it ends (nothing if path is empty)
+// declare it before the thread pool: hardware counts of a thread are only added to the job's once the thread has exited
+class ProfileSession {
+
+  public:
+
+    ProfileSession(const std::string& path, bool hardwareCounters) : path_(path) {
+      if (!path_.empty()) {
+        profiler().enable(hardwareCounters);
+        job_.reset(new ScopedTimer("job"));
+      }
+    }
+
+    ~ProfileSession() {
+      if (!path_.empty()) {
+        job_.reset();
+        if (!profiler().writeReport(path_)) {
+          printf("Cannot write profile report '%s'.\n", path_.c_str());
+        }
+      }
+    }
+
+    ProfileSession(const ProfileSession&) = delete;
+    ProfileSession& operator=(const ProfileSession&) = delete;
+
+  private:
+
+    std::string path_;
+    std::unique_ptr<ScopedTimer> job_;
+
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include "RNTupleSkimReader.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// =================================================================================================
+
+#ifdef HISTOGRAMMING_RNTUPLE
+
+// append field 'name' of the local entries [first, last) to a column, or zeros if the field is not selected
+template <typename Value, typename Column>
+static void readValues(rntuple::RNTupleReader& reader, const char* name, bool selected, Long64_t first, Long64_t last, std::vector<Column>& column) {
+  if (!selected) {
+    column.resize(column.size() + (last - first), Column());
+    return;
+  }
+  auto view = reader.GetView<Value>(name);
+  column.reserve(column.size() + (last - first));
+  for (Long64_t i = first; i < last; i++) {
+    column.push_back(view(i));
+  }
+}
+
+// append the elements of collection field 'name' of the local entries [first, last) to a flat column,
+// and the number of elements of each entry to 'counts' (if not null)
+template <typename Value, typename Column>
+static void readCollections(rntuple::RNTupleReader& reader, const char* name, Long64_t first, Long64_t last, std::vector<Column>& column, std::vector<std::size_t>* counts) {
+  auto collection = reader.GetCollectionView(name);
+  auto items = collection.template GetView<Value>("_0");
+  for (Long64_t i = first; i < last; i++) {
+    auto range = collection.GetCollectionRange(i);
+    if (counts != nullptr) {
+      counts -> push_back(range.size());
+    }
+    for (auto index: range) {
+      column.push_back(items(index));
+    }
+  }
+}
+
+// =================================================================================================
+
+RNTupleSkimReader::RNTupleSkimReader(const std::vector<std::string>& skimFilePaths) : fields_(SkimFields::all) {
+
+  const std::pair<Stream*, const char*> streams[] = {
+    {&singles_, "crystalTreeMaker1EP/ntuple"}, {&doubles_, "crystalTreeMaker2EP/ntuple"}, {&triples_, "crystalTreeMaker3EP/ntuple"}
+  };
+
+  for (const std::string& path: skimFilePaths) {
+    files_.emplace_back(TFile::Open(path.c_str(), "READ"));
+    TFile* file = files_.back().get();
+    if (file == nullptr || file -> IsZombie()) {
+      printf("Cannot open skim file '%s'.\n", path.c_str());
+      std::exit(1);
+    }
+    for (const auto& entry: streams) {
+      ROOT::RNTuple* anchor = file -> Get<ROOT::RNTuple>(entry.second);
+      if (anchor == nullptr) {
+        printf("Skim file '%s' has no RNTuple '%s'.\n", path.c_str(), entry.second);
+        std::exit(1);
+      }
+      Stream& stream = *entry.first;
+      stream.readers.push_back(rntuple::RNTupleReader::Open(*anchor));
+      stream.offsets.push_back(stream.entries);
+      stream.entries += stream.readers.back() -> GetNEntries();
+    }
+  }
+
+}
+
+RNTupleSkimReader::~RNTupleSkimReader() {}
+
+RNTupleSkimReader::Stream& RNTupleSkimReader::stream(SkimStream stream) {
+  switch (stream) {
+    case SkimStream::singles: return singles_;
+    case SkimStream::doubles: return doubles_;
+    default: return triples_;
+  }
+}
+
+// =================================================================================================
+
+void RNTupleSkimReader::selectFields(unsigned int fields, Long64_t /* cacheBytes */) {
+  fields_ = fields;
+}
+
+Long64_t RNTupleSkimReader::entries(SkimStream skimStream) {
+  return stream(skimStream).entries;
+}
+
+std::vector<EntryRange> RNTupleSkimReader::clusterRanges(SkimStream skimStream, Long64_t minEntries) {
+
+  std::vector<EntryRange> ranges;
+
+  Stream& entries = stream(skimStream);
+  for (unsigned int file = 0; file < entries.readers.size(); file++) {
+    // the cluster descriptors are not ordered by entry number
+    std::vector<EntryRange> clusters;
+    for (const auto& cluster: entries.readers[file] -> GetDescriptor().GetClusterIterable()) {
+      const Long64_t first = cluster.GetFirstEntryIndex();
+      clusters.push_back(EntryRange(first, first + cluster.GetNEntries()));
+    }
+    std::sort(clusters.begin(), clusters.end());
+
+    // merge neighbouring clusters, as for TTree clusters
+    const Long64_t offset = entries.offsets[file];
+    Long64_t first = 0;
+    for (const EntryRange& cluster: clusters) {
+      if (cluster.second - first >= minEntries) {
+        ranges.push_back(EntryRange(offset + first, offset + cluster.second));
+        first = cluster.second;
+      }
+    }
+    const Long64_t nEntries = entries.readers[file] -> GetNEntries();
+    if (first < nEntries) {
+      ranges.push_back(EntryRange(offset + first, offset + nEntries));
+    }
+  }
+
+  return ranges;
+
+}
+
+// =================================================================================================
+
+template <typename Read>
+void RNTupleSkimReader::forEachFile(Stream& stream, EntryRange range, Read read) {
+  Long64_t first = range.first;
+  while (first < range.second) {
+    const int file = int(std::upper_bound(stream.offsets.begin(), stream.offsets.end(), first) - stream.offsets.begin()) - 1;
+    const Long64_t offset = stream.offsets[file];
+    const Long64_t last = std::min(range.second, offset + Long64_t(stream.readers[file] -> GetNEntries()));
+    read(*stream.readers[file], first - offset, last - offset);
+    first = last;
+  }
+}
+
+void RNTupleSkimReader::readSingles(EntryRange range, SinglesColumns& entries) {
+
+  entries.reserve(entries.size() + (range.second - range.first));
+  forEachFile(singles_, range, [this, &entries](rntuple::RNTupleReader& reader, Long64_t first, Long64_t last) {
+    readValues<unsigned int>(reader, "gpsInteger", fields_ & SkimFields::gpsInteger, first, last, entries.gpsInteger);
+    readValues<double>(reader, "time", fields_ & SkimFields::time, first, last, entries.time);
+    readValues<double>(reader, "energy", fields_ & SkimFields::energy, first, last, entries.energy);
+    readValues<double>(reader, "x", fields_ & SkimFields::x, first, last, entries.x);
+    readValues<double>(reader, "y", fields_ & SkimFields::y, first, last, entries.y);
+    readValues<int>(reader, "caloIndex", fields_ & SkimFields::caloIndex, first, last, entries.caloIndex);
+    readValues<int>(reader, "runIndex", fields_ & SkimFields::runIndex, first, last, entries.runIndex);
+    readValues<int>(reader, "subrunIndex", fields_ & SkimFields::subrunIndex, first, last, entries.subrunIndex);
+    readValues<int>(reader, "fillIndex", fields_ & SkimFields::fillIndex, first, last, entries.fillIndex);
+    readValues<int>(reader, "bunchNumber", fields_ & SkimFields::bunchNumber, first, last, entries.bunchNumber);
+  });
+
+}
+
+void RNTupleSkimReader::readDoubles(EntryRange range, PileupColumns& entries) {
+  readPileup(doubles_, range, entries);
+}
+
+void RNTupleSkimReader::readTriples(EntryRange range, PileupColumns& entries) {
+  readPileup(triples_, range, entries);
+}
+
+void RNTupleSkimReader::readPileup(Stream& stream, EntryRange range, PileupColumns& entries) {
+
+  forEachFile(stream, range, [this, &entries](rntuple::RNTupleReader& reader, Long64_t first, Long64_t last) {
+    readValues<int>(reader, "runIndex", fields_ & SkimFields::runIndex, first, last, entries.runIndex);
+    readValues<int>(reader, "subrunIndex", fields_ & SkimFields::subrunIndex, first, last, entries.subrunIndex);
+    readValues<int>(reader, "fillIndex", fields_ & SkimFields::fillIndex, first, last, entries.fillIndex);
+    readValues<int>(reader, "bunchNumber", fields_ & SkimFields::bunchNumber, first, last, entries.bunchNumber);
+
+    // the first selected collection gives the number of clusters of each event; unselected collections stay empty
+    std::vector<std::size_t> counts;
+    bool counted = false;
+    auto readColumn = [&](const char* name, unsigned int field, auto& column, auto value) {
+      if (fields_ & field) {
+        readCollections<decltype(value)>(reader, name, first, last, column, counted ? nullptr : &counts);
+        counted = true;
+      }
+    };
+    readColumn("pileupIndex", SkimFields::pileupIndex, entries.pileupIndex, int());
+    readColumn("pileupFlagged", SkimFields::pileupFlagged, entries.pileupFlagged, bool());
+    readColumn("pileupTime", SkimFields::time, entries.pileupTime, double());
+    readColumn("pileupEnergy", SkimFields::energy, entries.pileupEnergy, double());
+    readColumn("pileupX", SkimFields::x, entries.pileupX, double());
+    readColumn("pileupY", SkimFields::y, entries.pileupY, double());
+    readColumn("pileupCaloIndex", SkimFields::caloIndex, entries.pileupCaloIndex, int());
+
+    if (!counted) {
+      counts.assign(last - first, 0);
+    }
+    entries.offset.reserve(entries.offset.size() + counts.size());
+    for (std::size_t n: counts) {
+      entries.offset.push_back(entries.offset.back() + n);
+    }
+  });
+
+}
+
+// =================================================================================================
+
+#else
+
+RNTupleSkimReader::RNTupleSkimReader(const std::vector<std::string>& /* skimFilePaths */) : fields_(SkimFields::all) {
+  printf("RNTuple skims need ROOT 6.34 or later.\n");
+  std::exit(1);
+}
+
+RNTupleSkimReader::~RNTupleSkimReader() {}
+
+void RNTupleSkimReader::selectFields(unsigned int fields, Long64_t /* cacheBytes */) { fields_ = fields; }
+Long64_t RNTupleSkimReader::entries(SkimStream /* stream */) { return 0; }
+std::vector<EntryRange> RNTupleSkimReader::clusterRanges(SkimStream /* stream */, Long64_t /* minEntries */) { return std::vector<EntryRange>(); }
+void RNTupleSkimReader::readSingles(EntryRange /* range */, SinglesColumns& /* entries */) {}
+void RNTupleSkimReader::readDoubles(EntryRange /* range */, PileupColumns& /* entries */) {}
+void RNTupleSkimReader::readTriples(EntryRange /* range */, PileupColumns& /* entries */) {}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef RNTUPLE_SKIM_READER_HH
+#define RNTUPLE_SKIM_READER_HH
+
+#include "RNTupleSupport.hh"
+#include "SkimReader.hh"
+
+#include "TFile.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+
+// SkimReader for skims stored as RNTuples, with the same names ("crystalTreeMaker1EP/ntuple", ...) and fields as the TTree skims
+// (vector branches become collection fields); only the pages of selected fields are read, straight into the columns
+class RNTupleSkimReader : public SkimReader {
+
+  public:
+
+    RNTupleSkimReader(const std::vector<std::string>& skimFilePaths);
+    ~RNTupleSkimReader() override;
+
+    RNTupleSkimReader(const RNTupleSkimReader&) = delete;
+    RNTupleSkimReader& operator=(const RNTupleSkimReader&) = delete;
+
+    // fields that are not selected are never viewed, so their pages are not read; RNTuple prefetches whole clusters
+    // of the viewed fields by itself, so cacheBytes is not used
+    void selectFields(unsigned int fields, Long64_t cacheBytes) override;
+
+    Long64_t entries(SkimStream stream) override;
+
+    // RNTuple cluster boundaries of each file
+    std::vector<EntryRange> clusterRanges(SkimStream stream, Long64_t minEntries) override;
+
+    void readSingles(EntryRange range, SinglesColumns& entries) override;
+    void readDoubles(EntryRange range, PileupColumns& entries) override;
+    void readTriples(EntryRange range, PileupColumns& entries) override;
+
+  private:
+
+    unsigned int fields_;
+
+    // the skim files stay open while their readers use them
+    std::vector<std::unique_ptr<TFile>> files_;
+
+#ifdef HISTOGRAMMING_RNTUPLE
+
+    // the readers of one stream, one per file, and the global entry number of each file's first entry
+    class Stream {
+      public:
+        std::vector<std::unique_ptr<rntuple::RNTupleReader>> readers;
+        std::vector<Long64_t> offsets;
+        Long64_t entries = 0;
+    };
+
+    Stream& stream(SkimStream stream);
+
+    // call read(reader, localFirst, localLast) for the part of 'range' in each file
+    template <typename Read>
+    void forEachFile(Stream& stream, EntryRange range, Read read);
+
+    void readPileup(Stream& stream, EntryRange range, PileupColumns& entries);
+
+    Stream singles_;
+    Stream doubles_;
+    Stream triples_;
+
+#endif
+
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RNTUPLE_SUPPORT_HH
+#define RNTUPLE_SUPPORT_HH
+
+#include "RVersion.h"
+
+// RNTuple input and output need the stable on-disk format of ROOT 6.34; with older ROOT versions the RNTuple backends
+// still compile, but exit with an error when they are selected
+// the reader, writer and model classes moved from ROOT::Experimental to ROOT in 6.36, hence the namespace alias
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 34, 0)
+
+#define HISTOGRAMMING_RNTUPLE 1
+
+#include <ROOT/RNTuple.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleReader.hxx>
+#include <ROOT/RNTupleView.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 36, 0)
+namespace rntuple = ROOT;
+#else
+namespace rntuple = ROOT::Experimental;
+#endif
+
+#endif
+
+#endif
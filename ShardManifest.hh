@@ -0,0 +1,146 @@
+#ifndef SHARD_MANIFEST_HH
+#define SHARD_MANIFEST_HH
+
+#include "TString.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+
+// one unit of work of a distributed job: seeds [firstSeed, firstSeed + nSeeds) of one skim file
+class Shard {
+
+  public:
+
+    Shard() : index(-1), skimIndex(-1), firstSeed(0), nSeeds(0), inputPath("") {}
+
+    int index;
+    int skimIndex;
+    int firstSeed;
+    int nSeeds;
+    std::string inputPath;
+
+};
+
+// =================================================================================================
+
+// description of a distributed job, written by "runDistributed plan" and read by its workers and its reducer
+// a text file with one item per line, in this order:
+//   dataset 2F
+//   classes Byu2Histograms,...
+//   output /path/to/job                                        (shard outputs in shards/shardNNNNN/, final outputs here)
+//   workerArg --fused                                          (zero or more, one runHistogramming argument each, in order)
+//   shard index skimIndex firstSeed nSeeds /path/to/skim.root  (one per shard, indices 0, 1, ... in order)
+// blank lines and lines starting with '#' are ignored
+class ShardManifest {
+
+  public:
+
+    std::string dataset;
+    std::vector<std::string> classNames;
+    std::string outputDir;
+    std::vector<std::string> workerArgs;
+    std::vector<Shard> shards;
+
+    // directory a shard's worker writes to, and the marker it leaves there once the worker has succeeded
+    std::string shardDir(const Shard& shard) const {
+      return Form("%s/shards/shard%05d", outputDir.c_str(), shard.index);
+    }
+
+    std::string doneMarker(const Shard& shard) const {
+      return shardDir(shard) + "/done";
+    }
+
+    // output of one class for one shard, as named by runHistogramming
+    std::string shardOutput(const Shard& shard, const std::string& className) const {
+      return Form("%s/%s_dataset%s_skim%05d.root", shardDir(shard).c_str(), className.c_str(), dataset.c_str(), shard.skimIndex);
+    }
+
+    // reduced output of one class for the whole dataset
+    std::string finalOutput(const std::string& className) const {
+      return Form("%s/%s_dataset%s.root", outputDir.c_str(), className.c_str(), dataset.c_str());
+    }
+
+    bool write(const std::string& path) const {
+      FILE* file = fopen(path.c_str(), "w");
+      if (file == nullptr) {
+        return false;
+      }
+      fprintf(file, "# runHistogramming shard manifest\n");
+      fprintf(file, "dataset %s\n", dataset.c_str());
+      std::string classList;
+      for (const std::string& className: classNames) {
+        classList += (classList.empty() ? "" : ",") + className;
+      }
+      fprintf(file, "classes %s\n", classList.c_str());
+      fprintf(file, "output %s\n", outputDir.c_str());
+      for (const std::string& workerArg: workerArgs) {
+        fprintf(file, "workerArg %s\n", workerArg.c_str());
+      }
+      for (const Shard& shard: shards) {
+        fprintf(file, "shard %d %d %d %d %s\n", shard.index, shard.skimIndex, shard.firstSeed, shard.nSeeds, shard.inputPath.c_str());
+      }
+      return fclose(file) == 0;
+    }
+
+    // read a manifest, exiting with a message if it is missing or malformed
+    static ShardManifest read(const std::string& path) {
+      std::ifstream file(path);
+      if (!file) {
+        printf("Shard manifest '%s' could not be opened.\n", path.c_str());
+        std::exit(1);
+      }
+      ShardManifest manifest;
+      std::string line;
+      int lineNumber = 0;
+      while (std::getline(file, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+          continue;
+        }
+        const std::size_t space = line.find(' ');
+        const std::string key = line.substr(0, space);
+        const std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+        bool valid = !value.empty();
+        if (key == "dataset") {
+          manifest.dataset = value;
+        } else if (key == "classes") {
+          std::stringstream classList(value);
+          std::string className;
+          while (std::getline(classList, className, ',')) {
+            manifest.classNames.push_back(className);
+          }
+        } else if (key == "output") {
+          manifest.outputDir = value;
+        } else if (key == "workerArg") {
+          manifest.workerArgs.push_back(value);
+        } else if (key == "shard") {
+          Shard shard;
+          std::stringstream fields(value);
+          fields >> shard.index >> shard.skimIndex >> shard.firstSeed >> shard.nSeeds;
+          std::getline(fields >> std::ws, shard.inputPath);
+          valid = !fields.fail() && shard.index == int(manifest.shards.size()) && shard.nSeeds > 0 && !shard.inputPath.empty();
+          manifest.shards.push_back(shard);
+        } else {
+          valid = false;
+        }
+        if (!valid) {
+          printf("Shard manifest '%s', line %d not recognized: %s\n", path.c_str(), lineNumber, line.c_str());
+          std::exit(1);
+        }
+      }
+      if (manifest.dataset.empty() || manifest.classNames.empty() || manifest.outputDir.empty() || manifest.shards.empty()) {
+        printf("Shard manifest '%s' needs a dataset, classes, an output directory and at least one shard.\n", path.c_str());
+        std::exit(1);
+      }
+      return manifest;
+    }
+
+};
+
+#endif
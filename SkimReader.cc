@@ -0,0 +1,66 @@
+#include "SkimReader.hh"
+#include "RNTupleSkimReader.hh"
+#include "TreeSkimReader.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include <glob.h>
+
+// =================================================================================================
+
+std::unique_ptr<SkimReader> SkimReader::open(StorageFormat format, const std::vector<std::string>& skimFilePaths) {
+  if (format == StorageFormat::rntuple) {
+    return std::unique_ptr<SkimReader>(new RNTupleSkimReader(skimFilePaths));
+  }
+  return std::unique_ptr<SkimReader>(new TreeSkimReader(skimFilePaths));
+}
+
+// =================================================================================================
+
+std::vector<std::string> SkimReader::listInputFiles(const std::string& pathOrPattern, const std::string& listPath) {
+
+  std::vector<std::string> patterns;
+  if (!listPath.empty()) {
+    std::ifstream list(listPath.c_str());
+    if (!list) {
+      printf("Cannot open input file list '%s'.\n", listPath.c_str());
+      std::exit(1);
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+      line.erase(0, line.find_first_not_of(" \t"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (!line.empty() && line[0] != '#') {
+        patterns.push_back(line);
+      }
+    }
+  } else {
+    patterns.push_back(pathOrPattern);
+  }
+
+  // expand glob patterns in sorted order; paths without wildcards (including remote URLs) are passed through unchanged
+  std::vector<std::string> paths;
+  for (const std::string& pattern: patterns) {
+    if (pattern.find_first_of("*?[") == std::string::npos) {
+      paths.push_back(pattern);
+      continue;
+    }
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+      for (std::size_t i = 0; i < matches.gl_pathc; i++) {
+        paths.push_back(matches.gl_pathv[i]);
+      }
+    }
+    globfree(&matches);
+  }
+
+  if (paths.empty()) {
+    printf("No input skim files found.\n");
+    std::exit(1);
+  }
+
+  return paths;
+
+}
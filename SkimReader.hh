@@ -0,0 +1,55 @@
+#ifndef SKIM_READER_HH
+#define SKIM_READER_HH
+
+#include "HistogramBase.hh"
+
+#include "Rtypes.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+
+// =================================================================================================
+
+// half-open range of skim entries [first, last)
+typedef std::pair<Long64_t, Long64_t> EntryRange;
+
+// the three skim streams: singles (crystalTreeMaker1EP), double pileup (crystalTreeMaker2EP) and triple pileup (crystalTreeMaker3EP)
+enum class SkimStream { singles, doubles, triples };
+
+// =================================================================================================
+
+// reads the singles, double-pileup and triple-pileup entries of one or more skim files into SinglesColumns / PileupColumns,
+// independently of how the skims are stored (see StorageFormat); entry numbers are global across the files
+class SkimReader {
+
+  public:
+
+    virtual ~SkimReader() {}
+
+    // reader for skim files in the given format
+    static std::unique_ptr<SkimReader> open(StorageFormat format, const std::vector<std::string>& skimFilePaths);
+
+    // input files from a path, a glob pattern (e.g. "skims/skim*.root") or, if listPath is not empty, a text file
+    // with one path or pattern per line (blank lines and lines starting with '#' are skipped); exits if nothing matches
+    static std::vector<std::string> listInputFiles(const std::string& pathOrPattern, const std::string& listPath);
+
+    // read only the given fields (SkimFields bits) from now on; columns of the other fields are filled as described at SkimFields
+    // cacheBytes is the read cache size per stream, for formats that have one
+    virtual void selectFields(unsigned int fields, Long64_t cacheBytes) = 0;
+
+    virtual Long64_t entries(SkimStream stream) = 0;
+
+    // split a stream into consecutive entry ranges aligned to its storage clusters, merging neighbouring clusters
+    // until each range holds at least minEntries entries (0 -> one cluster per range); ranges never span two files
+    virtual std::vector<EntryRange> clusterRanges(SkimStream stream, Long64_t minEntries) = 0;
+
+    // read the entries in 'range' and append them to the columns
+    virtual void readSingles(EntryRange range, SinglesColumns& entries) = 0;
+    virtual void readDoubles(EntryRange range, PileupColumns& entries) = 0;
+    virtual void readTriples(EntryRange range, PileupColumns& entries) = 0;
+
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef SPECTRUM_VIEWS_HH
+#define SPECTRUM_VIEWS_HH
+
+#include "HistogramBase.hh"
+
+#include "TH1D.h"
+#include "TString.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+
+// contents and sums of squared weights of one projection, one element per output time bin
+class Projection {
+
+  public:
+
+    std::vector<double> sumw;
+    std::vector<double> sumw2;
+
+};
+
+// =================================================================================================
+
+// projections of one energy-time spectrum at a time (a UniformGrid2D, see setSpectrum()), computed lazily and cached:
+// the first projection that needs a given energy weighting builds prefix sums over the energy axis for every time bin,
+// after which the integral of any energy range is a difference of two prefix sums, and every projection is computed once
+// output bins cover time bins 1 .. nBins * rebin of the grid; time bins left over at the end and the under/overflow bins are dropped
+template <typename Grid>
+class SpectrumViews {
+
+  public:
+
+    // positron endpoint energy in the lab frame (MeV), for the asymmetry weights
+    static constexpr double maxEnergy = 3095.0;
+
+    // decay asymmetry at positron energy E, A(y) = (-8y^2 + y + 1) / (4y^2 - 5y - 5) with y = E / maxEnergy
+    static double asymmetry(double energy) {
+      const double y = std::min(energy / maxEnergy, 1.0);
+      return (-8 * y * y + y + 1) / (4 * y * y - 5 * y - 5);
+    }
+
+    SpectrumViews(const std::vector<ProjectionSpec>& specs)
+      : specs_(specs), grid_(nullptr), projections_(specs.size()), computed_(specs.size(), false) {}
+
+    const std::vector<ProjectionSpec>& specs() const { return specs_; }
+
+    // output binning of projection k
+    int nBins(std::size_t k) const { return Grid::nx / specs_[k].rebin; }
+    double low(std::size_t /* k */) const { return Grid::xMin; }
+    double high(std::size_t k) const { return Grid::xMin + nBins(k) * specs_[k].rebin / Grid::invWidthX; }
+
+    // project 'grid' from now on (it must stay unchanged while its projections are used); drops everything cached
+    void setSpectrum(const Grid& grid) {
+      grid_ = &grid;
+      std::fill(computed_.begin(), computed_.end(), false);
+      for (std::unique_ptr<PrefixSums>& prefixSums: prefixSums_) {
+        prefixSums.reset();
+      }
+    }
+
+    // projection k of the current spectrum
+    const Projection& projection(std::size_t k) {
+      if (!computed_[k]) {
+        compute(k);
+        computed_[k] = true;
+      }
+      return projections_[k];
+    }
+
+  private:
+
+    static constexpr int nCellsX = Grid::nCellsX;
+    static constexpr int ny = Grid::ny;
+
+    // for energy weights w(biny): sumw[b * nCellsX + binx] = sum over energy bins 1 .. b - 1 of w * contents, and sumw2 likewise
+    // with w^2 * sumw2 (unweighted grids: w^2 * contents)
+    class PrefixSums {
+      public:
+        std::vector<double> sumw;
+        std::vector<double> sumw2;
+    };
+
+    enum Weighting { unit = 0, asymmetryWeights = 1, nWeightings = 2 };
+
+    const PrefixSums& prefixSums(Weighting weighting) {
+      std::unique_ptr<PrefixSums>& prefixSums = prefixSums_[weighting];
+      if (prefixSums) {
+        return *prefixSums;
+      }
+      prefixSums.reset(new PrefixSums());
+      prefixSums -> sumw.assign((ny + 2) * nCellsX, 0.0);
+      prefixSums -> sumw2.assign((ny + 2) * nCellsX, 0.0);
+      const float* contents = grid_ -> contents();
+      const double* sumw2 = grid_ -> sumw2();
+      for (int biny = 1; biny <= ny; biny++) {
+        const double energy = Grid::yMin + (biny - 0.5) / Grid::invWidthY;
+        const double w = (weighting == asymmetryWeights) ? asymmetry(energy) : 1.0;
+        const double* previous = &prefixSums -> sumw[biny * nCellsX];
+        const double* previous2 = &prefixSums -> sumw2[biny * nCellsX];
+        double* next = &prefixSums -> sumw[(biny + 1) * nCellsX];
+        double* next2 = &prefixSums -> sumw2[(biny + 1) * nCellsX];
+        const int row = biny * nCellsX;
+        for (int binx = 0; binx < nCellsX; binx++) {
+          next[binx] = previous[binx] + w * contents[row + binx];
+          next2[binx] = previous2[binx] + w * w * (sumw2 ? sumw2[row + binx] : contents[row + binx]);
+        }
+      }
+      return *prefixSums;
+    }
+
+    void compute(std::size_t k) {
+      const ProjectionSpec& spec = specs_[k];
+
+      // energy bins [first, last] with their centre in [eMin, eMax)
+      const int first = std::max(1, int(std::ceil((spec.eMin - Grid::yMin) * Grid::invWidthY - 0.5)) + 1);
+      const int last = std::min(ny, int(std::ceil((spec.eMax - Grid::yMin) * Grid::invWidthY - 0.5)));
+
+      Projection& projection = projections_[k];
+      projection.sumw.assign(nBins(k), 0.0);
+      projection.sumw2.assign(nBins(k), 0.0);
+      if (first > last) {
+        return;
+      }
+
+      const PrefixSums& sums = prefixSums(spec.asymmetryWeighted ? asymmetryWeights : unit);
+      const double* upper = &sums.sumw[(last + 1) * nCellsX];
+      const double* lower = &sums.sumw[first * nCellsX];
+      const double* upper2 = &sums.sumw2[(last + 1) * nCellsX];
+      const double* lower2 = &sums.sumw2[first * nCellsX];
+      for (int bin = 0; bin < nBins(k); bin++) {
+        for (int binx = 1 + bin * spec.rebin; binx <= (bin + 1) * spec.rebin; binx++) {
+          projection.sumw[bin] += upper[binx] - lower[binx];
+          projection.sumw2[bin] += upper2[binx] - lower2[binx];
+        }
+      }
+    }
+
+    std::vector<ProjectionSpec> specs_;
+    const Grid* grid_;
+    std::unique_ptr<PrefixSums> prefixSums_[nWeightings];
+    std::vector<Projection> projections_;
+    std::vector<bool> computed_;
+
+};
+
+// =================================================================================================
+
+// per-subrun rows of one projection of the singles and pileup spectra: a TTree 'name' with runIndex/I, subrunIndex/I, nBins/I,
+// wiggle[nBins]/D, wiggleSumw2[nBins]/D, pileup[nBins]/D and pileupSumw2[nBins]/D, plus the sums over all rows written
+// as TH1D 'name'_total and 'name'_PU_total, which also describe the time axis; the tree is created in the current directory
+class ProjectionTree {
+
+  public:
+
+    ProjectionTree(const std::string& name, const char* title, int nBins, double low, double high)
+      : name_(name), nBins_(nBins), low_(low), high_(high), runIndex_(-1), subrunIndex_(-1),
+        wiggle_(nBins), wiggleSumw2_(nBins), pileup_(nBins), pileupSumw2_(nBins),
+        totalWiggle_(nBins, 0.0), totalWiggleSumw2_(nBins, 0.0), totalPileup_(nBins, 0.0), totalPileupSumw2_(nBins, 0.0) {
+      tree_ = new TTree(name.c_str(), title);
+      tree_ -> Branch("runIndex", &runIndex_, "runIndex/I");
+      tree_ -> Branch("subrunIndex", &subrunIndex_, "subrunIndex/I");
+      tree_ -> Branch("nBins", &nBins_, "nBins/I");
+      tree_ -> Branch("wiggle", wiggle_.data(), "wiggle[nBins]/D");
+      tree_ -> Branch("wiggleSumw2", wiggleSumw2_.data(), "wiggleSumw2[nBins]/D");
+      tree_ -> Branch("pileup", pileup_.data(), "pileup[nBins]/D");
+      tree_ -> Branch("pileupSumw2", pileupSumw2_.data(), "pileupSumw2[nBins]/D");
+    }
+
+    ~ProjectionTree() {
+      delete tree_;
+    }
+
+    ProjectionTree(const ProjectionTree&) = delete;
+    ProjectionTree& operator=(const ProjectionTree&) = delete;
+
+    void fill(int runIndex, int subrunIndex, const Projection& wiggle, const Projection& pileup) {
+      runIndex_ = runIndex;
+      subrunIndex_ = subrunIndex;
+      for (int bin = 0; bin < nBins_; bin++) {
+        wiggle_[bin] = wiggle.sumw[bin];
+        wiggleSumw2_[bin] = wiggle.sumw2[bin];
+        pileup_[bin] = pileup.sumw[bin];
+        pileupSumw2_[bin] = pileup.sumw2[bin];
+        totalWiggle_[bin] += wiggle.sumw[bin];
+        totalWiggleSumw2_[bin] += wiggle.sumw2[bin];
+        totalPileup_[bin] += pileup.sumw[bin];
+        totalPileupSumw2_[bin] += pileup.sumw2[bin];
+      }
+      tree_ -> Fill();
+    }
+
+    void write() {
+      tree_ -> Write();
+      writeTotal((name_ + "_total").c_str(), totalWiggle_, totalWiggleSumw2_);
+      writeTotal((name_ + "_PU_total").c_str(), totalPileup_, totalPileupSumw2_);
+    }
+
+  private:
+
+    void writeTotal(const char* name, const std::vector<double>& sumw, const std::vector<double>& sumw2) const {
+      TH1D total(name, Form("%s;Time [us];Entries", name), nBins_, low_, high_);
+      total.Sumw2();
+      for (int bin = 0; bin < nBins_; bin++) {
+        total.SetBinContent(bin + 1, sumw[bin]);
+        total.SetBinError(bin + 1, std::sqrt(sumw2[bin]));
+      }
+      total.ResetStats();
+      total.Write();
+    }
+
+    TTree* tree_;
+    std::string name_;
+    int nBins_;
+    double low_;
+    double high_;
+
+    // row buffers the branches point to
+    int runIndex_;
+    int subrunIndex_;
+    std::vector<double> wiggle_;
+    std::vector<double> wiggleSumw2_;
+    std::vector<double> pileup_;
+    std::vector<double> pileupSumw2_;
+
+    std::vector<double> totalWiggle_;
+    std::vector<double> totalWiggleSumw2_;
+    std::vector<double> totalPileup_;
+    std::vector<double> totalPileupSumw2_;
+
+};
+
+#endif
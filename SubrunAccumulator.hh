@@ -0,0 +1,182 @@
+#ifndef SUBRUN_ACCUMULATOR_HH
+#define SUBRUN_ACCUMULATOR_HH
+
+#include "HistogramBase.hh"
+#include "Profiler.hh"
+#include "SubrunSpectrumTree.hh"
+
+#include "TDirectory.h"
+#include "TFile.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+// =================================================================================================
+
+// (runIndex, subrunIndex), ordered by run and then subrun
+typedef std::pair<int, int> SubrunKey;
+
+// per-subrun spectra keyed by (run, subrun), for entries that arrive in any order and from any number of sources
+// a few recently used subruns are kept open as grids; when more are needed, the least recently used one is staged
+// as a partial spectrum (a zero-suppressed row in a SubrunSpectrumTree)
+// a subrun that is revisited later simply gets another partial, and addTo() sums all partials of a key at write time
+// the staging tree lives in a scratch file of its own ($TMPDIR, or /tmp), opened on the first staged partial and unlinked right away,
+// so its baskets never end up in the output file, its I/O needs no outputMutex(), and nothing is left behind if the job is killed
+// (sorted input never stages, and never opens it); an accumulator must only be used by one thread at a time
+template <typename Grid>
+class SubrunAccumulator {
+
+  public:
+
+    SubrunAccumulator(const char* stagingName, std::size_t maxOpen)
+      : stagingName_(stagingName), maxOpen_(maxOpen), useCounter_(0), current_(nullptr) {}
+
+    ~SubrunAccumulator() {
+      staged_.reset();
+      if (scratch_) {
+        scratch_ -> Close();
+      }
+    }
+
+    SubrunAccumulator(const SubrunAccumulator&) = delete;
+    SubrunAccumulator& operator=(const SubrunAccumulator&) = delete;
+
+    // the open grid of a subrun, opened (and possibly staging another subrun) if necessary
+    // consecutive calls for the same subrun are cheap, so sorted input pays one comparison per call
+    Grid& grid(int runIndex, int subrunIndex) {
+      const SubrunKey key(runIndex, subrunIndex);
+      if (current_ != nullptr && currentKey_ == key) {
+        return *current_ -> grid;
+      }
+      typename std::map<SubrunKey, Open>::iterator it = open_.find(key);
+      if (it == open_.end()) {
+        if (open_.size() >= maxOpen_) {
+          stageLeastRecentlyUsed();
+        }
+        it = open_.insert(std::make_pair(key, Open())).first;
+        it -> second.grid.reset(new Grid());
+      }
+      it -> second.lastUse = ++useCounter_;
+      current_ = &it -> second;
+      currentKey_ = key;
+      return *current_ -> grid;
+    }
+
+    // stage every open subrun, e.g. before addTo()
+    void closeAll() {
+      while (!open_.empty()) {
+        stageLeastRecentlyUsed();
+      }
+    }
+
+    // keys of all subruns seen so far (open or staged)
+    std::set<SubrunKey> keys() const {
+      std::set<SubrunKey> keys;
+      for (const auto& entry: open_) {
+        keys.insert(entry.first);
+      }
+      for (const auto& entry: stagedRows_) {
+        keys.insert(entry.first);
+      }
+      return keys;
+    }
+
+    // add all staged partials of a subrun to 'grid' (call closeAll() first, so that nothing is left open)
+    void addTo(const SubrunKey& key, Grid& grid) {
+      typename std::map<SubrunKey, std::vector<Long64_t>>::const_iterator it = stagedRows_.find(key);
+      if (it == stagedRows_.end()) {
+        return;
+      }
+      int runIndex;
+      int subrunIndex;
+      for (Long64_t row: it -> second) {
+        staged_ -> addTo(row, grid, runIndex, subrunIndex);
+      }
+    }
+
+    // add everything accumulated for a subrun (open or staged) to 'grid', and forget the subrun, e.g. once it is complete and written
+    // its staged rows stay in the scratch file, but are never read again
+    void take(const SubrunKey& key, Grid& grid) {
+      addTo(key, grid);
+      stagedRows_.erase(key);
+      typename std::map<SubrunKey, Open>::iterator it = open_.find(key);
+      if (it != open_.end()) {
+        grid.add(*it -> second.grid);
+        if (current_ == &it -> second) {
+          current_ = nullptr;
+        }
+        open_.erase(it);
+      }
+    }
+
+  private:
+
+    class Open {
+      public:
+        std::unique_ptr<Grid> grid;
+        unsigned long long lastUse;
+    };
+
+    void stageLeastRecentlyUsed() {
+      typename std::map<SubrunKey, Open>::iterator oldest = open_.begin();
+      for (typename std::map<SubrunKey, Open>::iterator it = open_.begin(); it != open_.end(); ++it) {
+        if (it -> second.lastUse < oldest -> second.lastUse) {
+          oldest = it;
+        }
+      }
+      if (!staged_) {
+        openScratch();
+      }
+      stagedRows_[oldest -> first].push_back(staged_ -> rows());
+      staged_ -> fill(oldest -> first.first, oldest -> first.second, *oldest -> second.grid);
+      profiler().count("subrun partials staged");
+      if (current_ == &oldest -> second) {
+        current_ = nullptr;
+      }
+      open_.erase(oldest);
+    }
+
+    void openScratch() {
+      const char* tmpdir = std::getenv("TMPDIR");
+      std::string path = std::string((tmpdir && *tmpdir) ? tmpdir : "/tmp") + "/" + stagingName_ + "_XXXXXX";
+      const int descriptor = mkstemp(&path[0]);
+      if (descriptor < 0) {
+        printf("Scratch file for staging subrun spectra could not be created in '%s'.\n", path.c_str());
+        std::exit(1);
+      }
+      close(descriptor);
+      // the staging tree is created in the scratch file, and the caller's current directory is restored afterwards
+      TDirectory::TContext context;
+      scratch_.reset(new TFile(path.c_str(), "RECREATE"));
+      std::remove(path.c_str());
+      if (scratch_ -> IsZombie()) {
+        printf("Scratch file '%s' for staging subrun spectra could not be opened.\n", path.c_str());
+        std::exit(1);
+      }
+      staged_.reset(new SubrunSpectrumTree<Grid>(stagingName_.c_str(), stagingName_.c_str(), true));
+    }
+
+    std::string stagingName_;
+    std::unique_ptr<TFile> scratch_;
+    std::unique_ptr<SubrunSpectrumTree<Grid>> staged_;
+    std::map<SubrunKey, std::vector<Long64_t>> stagedRows_;
+
+    std::map<SubrunKey, Open> open_;
+    std::size_t maxOpen_;
+    unsigned long long useCounter_;
+
+    // last subrun returned by grid()
+    Open* current_;
+    SubrunKey currentKey_;
+
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef SUBRUN_SPECTRUM_NTUPLE_HH
+#define SUBRUN_SPECTRUM_NTUPLE_HH
+
+#include "RNTupleSupport.hh"
+#include "SubrunSpectrumWriter.hh"
+
+#include "TDirectory.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+
+// SubrunSpectrumWriter storing the rows as an RNTuple with fields runIndex (int), subrunIndex (int), entries (long long),
+// contents (std::vector<float>, all cells or only the non-empty ones), cells (std::vector<int>, zero-suppressed only),
+// sumw2 (std::vector<float>, weighted grids only) and any scalars added with addScalar()
+// the RNTuple is attached to the current directory when the first row is filled, and committed by write()
+template <typename Grid>
+class SubrunSpectrumNTuple : public SubrunSpectrumWriter<Grid> {
+
+#ifdef HISTOGRAMMING_RNTUPLE
+
+  public:
+
+    SubrunSpectrumNTuple(const char* name, const char* title, bool zeroSuppressed)
+      : name_(name), zeroSuppressed_(zeroSuppressed), directory_(gDirectory), model_(rntuple::RNTupleModel::Create()) {
+      model_ -> SetDescription(title);
+      runIndex_ = model_ -> template MakeField<int>("runIndex");
+      subrunIndex_ = model_ -> template MakeField<int>("subrunIndex");
+      entries_ = model_ -> template MakeField<long long>("entries");
+      if (zeroSuppressed_) {
+        cells_ = model_ -> template MakeField<std::vector<int>>("cells");
+      }
+      contents_ = model_ -> template MakeField<std::vector<float>>("contents");
+      if (Grid::weighted) {
+        sumw2_ = model_ -> template MakeField<std::vector<float>>("sumw2");
+      }
+    }
+
+    SubrunSpectrumNTuple(const SubrunSpectrumNTuple&) = delete;
+    SubrunSpectrumNTuple& operator=(const SubrunSpectrumNTuple&) = delete;
+
+    void addScalar(const char* name, const double* value) override {
+      scalars_.push_back(std::make_pair(value, model_ -> template MakeField<double>(name)));
+    }
+
+    void fill(int runIndex, int subrunIndex, const Grid& grid) override {
+      if (!writer_) {
+        open();
+      }
+      *runIndex_ = runIndex;
+      *subrunIndex_ = subrunIndex;
+      *entries_ = grid.entries();
+      for (auto& scalar: scalars_) {
+        *scalar.second = *scalar.first;
+      }
+
+      const float* contents = grid.contents();
+      const double* sumw2 = grid.sumw2();
+      contents_ -> clear();
+      if (sumw2_) {
+        sumw2_ -> clear();
+      }
+      if (zeroSuppressed_) {
+        cells_ -> clear();
+        for (int cell = 0; cell < Grid::nCells; cell++) {
+          if (contents[cell] != 0 || (sumw2 && sumw2[cell] != 0)) {
+            cells_ -> push_back(cell);
+            contents_ -> push_back(contents[cell]);
+            if (sumw2) {
+              sumw2_ -> push_back(sumw2[cell]);
+            }
+          }
+        }
+      } else {
+        contents_ -> assign(contents, contents + Grid::nCells);
+        if (sumw2) {
+          sumw2_ -> assign(sumw2, sumw2 + Grid::nCells);
+        }
+      }
+      writer_ -> Fill();
+    }
+
+    void write() override {
+      if (!writer_) {
+        open();
+      }
+      writer_ -> CommitDataset();
+    }
+
+  private:
+
+    // the fields cannot change once the RNTuple has been created
+    void open() {
+      writer_ = rntuple::RNTupleWriter::Append(std::move(model_), name_, *directory_);
+    }
+
+    std::string name_;
+    bool zeroSuppressed_;
+    TDirectory* directory_;
+
+    std::unique_ptr<rntuple::RNTupleModel> model_;
+    std::unique_ptr<rntuple::RNTupleWriter> writer_;
+
+    // row values the fields point to
+    std::shared_ptr<int> runIndex_;
+    std::shared_ptr<int> subrunIndex_;
+    std::shared_ptr<long long> entries_;
+    std::shared_ptr<std::vector<int>> cells_;
+    std::shared_ptr<std::vector<float>> contents_;
+    std::shared_ptr<std::vector<float>> sumw2_;
+    std::vector<std::pair<const double*, std::shared_ptr<double>>> scalars_;
+
+#else
+
+  public:
+
+    SubrunSpectrumNTuple(const char* /* name */, const char* /* title */, bool /* zeroSuppressed */) {
+      printf("RNTuple output needs ROOT 6.34 or later.\n");
+      std::exit(1);
+    }
+
+    void addScalar(const char* /* name */, const double* /* value */) override {}
+    void fill(int /* runIndex */, int /* subrunIndex */, const Grid& /* grid */) override {}
+    void write() override {}
+
+#endif
+
+};
+
+#endif
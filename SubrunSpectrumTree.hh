@@ -0,0 +1,130 @@
+#ifndef SUBRUN_SPECTRUM_TREE_HH
+#define SUBRUN_SPECTRUM_TREE_HH
+
+#include "SubrunSpectrumWriter.hh"
+
+#include "TString.h"
+#include "TTree.h"
+
+#include <algorithm>
+#include <vector>
+
+// =================================================================================================
+
+// SubrunSpectrumWriter storing the rows in a TTree, also used to stage partial spectra (see SubrunAccumulator)
+// compact columnar storage of one UniformGrid2D spectrum per subrun: a TTree with one row per subrun holding
+// runIndex/I, subrunIndex/I, entries/L and the bin contents as a flat float array in the grid's cell layout
+// (ROOT global bins, cell = binx + (nx + 2) * biny), plus sumw2 for weighted grids
+// dense rows use fixed-size arrays contents[nCells]; zero-suppressed rows store nFilled/I, cells[nFilled]/I and contents[nFilled]
+// the axes are not repeated per row: write one empty TH2F with the grid's binning next to the tree to describe them
+// the tree is created in the current directory (gDirectory), like any TTree
+template <typename Grid>
+class SubrunSpectrumTree : public SubrunSpectrumWriter<Grid> {
+
+  public:
+
+    SubrunSpectrumTree(const char* name, const char* title, bool zeroSuppressed)
+      : zeroSuppressed_(zeroSuppressed), runIndex_(-1), subrunIndex_(-1), entries_(0), nFilled_(0),
+        cells_(zeroSuppressed ? Grid::nCells : 0), contents_(Grid::nCells), sumw2_(Grid::weighted ? Grid::nCells : 0) {
+
+      tree_ = new TTree(name, title);
+      tree_ -> Branch("runIndex", &runIndex_, "runIndex/I");
+      tree_ -> Branch("subrunIndex", &subrunIndex_, "subrunIndex/I");
+      tree_ -> Branch("entries", &entries_, "entries/L");
+      if (zeroSuppressed_) {
+        tree_ -> Branch("nFilled", &nFilled_, "nFilled/I");
+        tree_ -> Branch("cells", cells_.data(), "cells[nFilled]/I");
+        tree_ -> Branch("contents", contents_.data(), "contents[nFilled]/F");
+        if (Grid::weighted) {
+          tree_ -> Branch("sumw2", sumw2_.data(), "sumw2[nFilled]/F");
+        }
+      } else {
+        tree_ -> Branch("contents", contents_.data(), Form("contents[%d]/F", Grid::nCells));
+        if (Grid::weighted) {
+          tree_ -> Branch("sumw2", sumw2_.data(), Form("sumw2[%d]/F", Grid::nCells));
+        }
+      }
+
+    }
+
+    ~SubrunSpectrumTree() override {
+      delete tree_;
+    }
+
+    SubrunSpectrumTree(const SubrunSpectrumTree&) = delete;
+    SubrunSpectrumTree& operator=(const SubrunSpectrumTree&) = delete;
+
+    // the underlying tree, e.g. to add further per-subrun branches before the first fill()
+    TTree* tree() const { return tree_; }
+
+    void addScalar(const char* name, const double* value) override {
+      tree_ -> Branch(name, const_cast<double*>(value), Form("%s/D", name));
+    }
+
+    void write() override {
+      tree_ -> Write();
+    }
+
+    Long64_t rows() const { return tree_ -> GetEntries(); }
+
+    void fill(int runIndex, int subrunIndex, const Grid& grid) override {
+      runIndex_ = runIndex;
+      subrunIndex_ = subrunIndex;
+      entries_ = grid.entries();
+      const float* contents = grid.contents();
+      const double* sumw2 = grid.sumw2();
+      if (zeroSuppressed_) {
+        nFilled_ = 0;
+        for (int cell = 0; cell < Grid::nCells; cell++) {
+          if (contents[cell] != 0 || (sumw2 && sumw2[cell] != 0)) {
+            cells_[nFilled_] = cell;
+            contents_[nFilled_] = contents[cell];
+            if (sumw2) {
+              sumw2_[nFilled_] = sumw2[cell];
+            }
+            nFilled_++;
+          }
+        }
+      } else {
+        std::copy(contents, contents + Grid::nCells, contents_.begin());
+        if (sumw2) {
+          std::copy(sumw2, sumw2 + Grid::nCells, sumw2_.begin());
+        }
+      }
+      tree_ -> Fill();
+    }
+
+    // add the contents of row 'row' to 'grid' (used to combine stored spectra); returns the row's run and subrun indices
+    void addTo(Long64_t row, Grid& grid, int& runIndex, int& subrunIndex) {
+      tree_ -> GetEntry(row);
+      runIndex = runIndex_;
+      subrunIndex = subrunIndex_;
+      grid.addEntries(entries_);
+      if (zeroSuppressed_) {
+        for (int i = 0; i < nFilled_; i++) {
+          grid.addCell(cells_[i], contents_[i], Grid::weighted ? sumw2_[i] : 0.0);
+        }
+      } else {
+        for (int cell = 0; cell < Grid::nCells; cell++) {
+          grid.addCell(cell, contents_[cell], Grid::weighted ? sumw2_[cell] : 0.0);
+        }
+      }
+    }
+
+  private:
+
+    TTree* tree_;
+    bool zeroSuppressed_;
+
+    // row buffers the branches point to
+    int runIndex_;
+    int subrunIndex_;
+    Long64_t entries_;
+    int nFilled_;
+    std::vector<int> cells_;
+    std::vector<float> contents_;
+    std::vector<float> sumw2_;
+
+};
+
+#endif
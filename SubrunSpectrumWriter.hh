@@ -0,0 +1,51 @@
+#ifndef SUBRUN_SPECTRUM_WRITER_HH
+#define SUBRUN_SPECTRUM_WRITER_HH
+
+#include "HistogramBase.hh"
+
+#include <memory>
+
+template <typename Grid> class SubrunSpectrumTree;
+template <typename Grid> class SubrunSpectrumNTuple;
+
+// =================================================================================================
+
+// columnar output of one UniformGrid2D spectrum per subrun, independent of the container (see StorageFormat)
+// every row holds runIndex, subrunIndex, entries and the bin contents in the grid's cell layout (ROOT global bins,
+// cell = binx + (nx + 2) * biny), plus sumw2 for weighted grids; zero-suppressed rows hold only the non-empty cells
+// and their cell indices; the container is created in the current directory (gDirectory)
+template <typename Grid>
+class SubrunSpectrumWriter {
+
+  public:
+
+    virtual ~SubrunSpectrumWriter() {}
+
+    // writer for the given format
+    static std::unique_ptr<SubrunSpectrumWriter> create(StorageFormat format, const char* name, const char* title, bool zeroSuppressed);
+
+    // add a per-row double column, copied from *value at every fill(); only before the first fill()
+    virtual void addScalar(const char* name, const double* value) = 0;
+
+    // append one row with the contents of 'grid'
+    virtual void fill(int runIndex, int subrunIndex, const Grid& grid) = 0;
+
+    // write the rows to the directory the writer was created in
+    virtual void write() = 0;
+
+};
+
+// =================================================================================================
+
+#include "SubrunSpectrumNTuple.hh"
+#include "SubrunSpectrumTree.hh"
+
+template <typename Grid>
+std::unique_ptr<SubrunSpectrumWriter<Grid>> SubrunSpectrumWriter<Grid>::create(StorageFormat format, const char* name, const char* title, bool zeroSuppressed) {
+  if (format == StorageFormat::rntuple) {
+    return std::unique_ptr<SubrunSpectrumWriter<Grid>>(new SubrunSpectrumNTuple<Grid>(name, title, zeroSuppressed));
+  }
+  return std::unique_ptr<SubrunSpectrumWriter<Grid>>(new SubrunSpectrumTree<Grid>(name, title, zeroSuppressed));
+}
+
+#endif
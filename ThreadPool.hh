@@ -0,0 +1,126 @@
+#ifndef THREAD_POOL_HH
+#define THREAD_POOL_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// =================================================================================================
+
+// fixed-size pool of worker threads for data-parallel loops
+// the thread calling parallelFor() always works on its own loop too, so parallelFor() may be nested inside a task
+// without deadlocking: idle workers help with whichever loop is waiting, and the caller can finish its loop alone
+class ThreadPool {
+
+  public:
+
+    // nThreads counts the calling thread, so nThreads - 1 workers are started (none for nThreads <= 1)
+    ThreadPool(int nThreads) : stopping_(false) {
+      for (int i = 1; i < nThreads; i++) {
+        workers_.emplace_back(&ThreadPool::workerLoop, this);
+      }
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      wakeup_.notify_all();
+      for (std::thread& worker: workers_) {
+        worker.join();
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return workers_.size() + 1; }
+
+    // call task(i) for every i in [0, count), in no particular order, and return once all calls have finished
+    void parallelFor(std::size_t count, const std::function<void(std::size_t)>& task) {
+
+      if (count == 0) {
+        return;
+      }
+
+      std::shared_ptr<Job> job = std::make_shared<Job>(&task, count);
+
+      if (!workers_.empty() && count > 1) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          jobs_.push_back(job);
+        }
+        wakeup_.notify_all();
+      }
+
+      runJob(*job);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      finished_.wait(lock, [&job] { return job -> done == job -> count; });
+
+    }
+
+  private:
+
+    // one parallelFor() call: indices are handed out through 'next', and 'done' counts finished calls
+    class Job {
+      public:
+        Job(const std::function<void(std::size_t)>* task, std::size_t count) : task(task), count(count), next(0), done(0) {}
+        const std::function<void(std::size_t)>* task; // owned by the parallelFor() caller, only valid while next < count
+        const std::size_t count;
+        std::atomic<std::size_t> next;
+        std::atomic<std::size_t> done;
+    };
+
+    void runJob(Job& job) {
+      std::size_t i;
+      while ((i = job.next++) < job.count) {
+        (*job.task)(i);
+        if (++job.done == job.count) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          finished_.notify_all();
+        }
+      }
+    }
+
+    void workerLoop() {
+      while (true) {
+        std::shared_ptr<Job> job;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          while (true) {
+            // drop loops whose indices have all been handed out
+            while (!jobs_.empty() && jobs_.front() -> next >= jobs_.front() -> count) {
+              jobs_.pop_front();
+            }
+            if (!jobs_.empty() || stopping_) {
+              break;
+            }
+            wakeup_.wait(lock);
+          }
+          if (jobs_.empty()) {
+            return;
+          }
+          job = jobs_.front();
+        }
+        runJob(*job);
+      }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::shared_ptr<Job>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable finished_;
+    bool stopping_;
+
+};
+
+#endif
@@ -0,0 +1,464 @@
+#include "TreeSkimReader.hh"
+
+#include "TBasket.h"
+#include "TBranch.h"
+#include "TBuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// =================================================================================================
+
+TreeSkimReader::TreeSkimReader(const std::vector<std::string>& skimFilePaths)
+  : skimFilePaths_(skimFilePaths), fields_(SkimFields::all), prefetchedSingles_(0), prefetchedDoubles_(0), prefetchedTriples_(0),
+    tempPositronEntry_(), doubleBuffers_(), tripleBuffers_() {
+
+  // chain the TTrees of all skim files
+  singlesTree_ = new TChain("crystalTreeMaker1EP/ntuple");
+  doublesTree_ = new TChain("crystalTreeMaker2EP/ntuple");
+  triplesTree_ = new TChain("crystalTreeMaker3EP/ntuple");
+  for (const std::string& path: skimFilePaths_) {
+    singlesTree_ -> Add(path.c_str());
+    doublesTree_ -> Add(path.c_str());
+    triplesTree_ -> Add(path.c_str());
+  }
+
+  // point the singles TTree branches to the member variables in the PositronData object
+  // singlesTree_ -> SetBranchAddress("laserInFill", &(tempPositronEntry_.laserInFill));
+  singlesTree_ -> SetBranchAddress("gpsInteger", &(tempPositronEntry_.gpsInteger));
+  singlesTree_ -> SetBranchAddress("time", &(tempPositronEntry_.time));
+  singlesTree_ -> SetBranchAddress("energy", &(tempPositronEntry_.energy));
+  singlesTree_ -> SetBranchAddress("x", &(tempPositronEntry_.x));
+  singlesTree_ -> SetBranchAddress("y", &(tempPositronEntry_.y));
+  singlesTree_ -> SetBranchAddress("caloIndex", &(tempPositronEntry_.caloIndex));
+  singlesTree_ -> SetBranchAddress("runIndex", &(tempPositronEntry_.runIndex));
+  singlesTree_ -> SetBranchAddress("subrunIndex", &(tempPositronEntry_.subrunIndex));
+  singlesTree_ -> SetBranchAddress("fillIndex", &(tempPositronEntry_.fillIndex));
+  singlesTree_ -> SetBranchAddress("bunchNumber", &(tempPositronEntry_.bunchNumber));
+  // singlesTree_ -> SetBranchAddress("inFillGain", &(tempPositronEntry_.inFillGain));
+  // singlesTree_ -> SetBranchAddress("crystalEnergy", &(tempPositronEntry_.crystalEnergy));
+
+  bindPileupBranches(doublesTree_, doubleBuffers_);
+  bindPileupBranches(triplesTree_, tripleBuffers_);
+
+}
+
+TreeSkimReader::~TreeSkimReader() {
+  delete singlesTree_;
+  delete doublesTree_;
+  delete triplesTree_;
+}
+
+// =================================================================================================
+
+void TreeSkimReader::bindPileupBranches(TTree* tree, PileupBuffers& buffers) {
+
+  // vector types must point to the pointers-to-vectors of this tree's buffers
+  // non-vector types can point directly inside the dummy object, and will be copied
+  tree -> SetBranchAddress("pileupIndex", &buffers.pileupIndex);
+  tree -> SetBranchAddress("pileupFlagged", &buffers.pileupFlagged);
+  tree -> SetBranchAddress("pileupTime", &buffers.pileupTime);
+  tree -> SetBranchAddress("pileupEnergy", &buffers.pileupEnergy);
+  tree -> SetBranchAddress("pileupX", &buffers.pileupX);
+  tree -> SetBranchAddress("pileupY", &buffers.pileupY);
+  tree -> SetBranchAddress("pileupCaloIndex", &buffers.pileupCaloIndex);
+  // tree -> SetBranchAddress("laserInFill", &(buffers.entry.laserInFill));
+  tree -> SetBranchAddress("runIndex", &(buffers.entry.runIndex));
+  tree -> SetBranchAddress("subrunIndex", &(buffers.entry.subrunIndex));
+  tree -> SetBranchAddress("fillIndex", &(buffers.entry.fillIndex));
+  tree -> SetBranchAddress("bunchNumber", &(buffers.entry.bunchNumber));
+
+}
+
+// =================================================================================================
+
+void TreeSkimReader::selectFields(unsigned int fields, Long64_t cacheBytes) {
+
+  fields_ = fields;
+
+  const std::vector<std::pair<const char*, unsigned int>> singlesFields = {
+    {"gpsInteger", SkimFields::gpsInteger}, {"time", SkimFields::time}, {"energy", SkimFields::energy},
+    {"x", SkimFields::x}, {"y", SkimFields::y}, {"caloIndex", SkimFields::caloIndex},
+    {"runIndex", SkimFields::runIndex}, {"subrunIndex", SkimFields::subrunIndex},
+    {"fillIndex", SkimFields::fillIndex}, {"bunchNumber", SkimFields::bunchNumber}
+  };
+  const std::vector<std::pair<const char*, unsigned int>> pileupFields = {
+    {"pileupIndex", SkimFields::pileupIndex}, {"pileupFlagged", SkimFields::pileupFlagged},
+    {"pileupTime", SkimFields::time}, {"pileupEnergy", SkimFields::energy},
+    {"pileupX", SkimFields::x}, {"pileupY", SkimFields::y}, {"pileupCaloIndex", SkimFields::caloIndex},
+    {"runIndex", SkimFields::runIndex}, {"subrunIndex", SkimFields::subrunIndex},
+    {"fillIndex", SkimFields::fillIndex}, {"bunchNumber", SkimFields::bunchNumber}
+  };
+
+  enableBranches(singlesTree_, singlesFields, cacheBytes);
+  enableBranches(doublesTree_, pileupFields, cacheBytes);
+  enableBranches(triplesTree_, pileupFields, cacheBytes);
+
+}
+
+void TreeSkimReader::enableBranches(TTree* tree, const std::vector<std::pair<const char*, unsigned int>>& branchFields, Long64_t cacheBytes) {
+
+  // disabled branches are neither fetched nor decompressed by GetEntry()
+  tree -> SetBranchStatus("*", false);
+  for (const auto& branch: branchFields) {
+    if (fields_ & branch.second) {
+      tree -> SetBranchStatus(branch.first, true);
+    }
+  }
+
+  // the set of branches is known up front, so the cache is filled with exactly those from the first entry on,
+  // instead of learning them from the first entries read
+  tree -> SetCacheSize(cacheBytes);
+  for (const auto& branch: branchFields) {
+    if (fields_ & branch.second) {
+      tree -> AddBranchToCache(branch.first, true);
+    }
+  }
+  tree -> StopCacheLearningPhase();
+
+}
+
+// =================================================================================================
+
+TChain* TreeSkimReader::chain(SkimStream stream) {
+  switch (stream) {
+    case SkimStream::singles: return singlesTree_;
+    case SkimStream::doubles: return doublesTree_;
+    default: return triplesTree_;
+  }
+}
+
+Long64_t TreeSkimReader::entries(SkimStream stream) {
+  return chain(stream) -> GetEntries();
+}
+
+std::vector<EntryRange> TreeSkimReader::clusterRanges(SkimStream stream, Long64_t minEntries) {
+  return treeClusterRanges(chain(stream), minEntries);
+}
+
+std::vector<EntryRange> TreeSkimReader::treeClusterRanges(TTree* tree, Long64_t minEntries) {
+
+  std::vector<EntryRange> ranges;
+
+  TChain* chain = dynamic_cast<TChain*>(tree);
+  if (chain == nullptr) {
+    appendClusterRanges(tree, 0, minEntries, ranges);
+    return ranges;
+  }
+
+  // GetEntries() opens every file of the chain, which fills in the entry offset of each file (and the total after the last one)
+  // an empty file has the same offset as the next one, where LoadTree() would land, so it is skipped instead of adding that file twice
+  chain -> GetEntries();
+  for (int i = 0; i < chain -> GetNtrees(); i++) {
+    const Long64_t offset = chain -> GetTreeOffset()[i];
+    if (chain -> GetTreeOffset()[i + 1] == offset) {
+      continue;
+    }
+    if (chain -> LoadTree(offset) < 0 || chain -> GetTreeNumber() != i) {
+      continue;
+    }
+    appendClusterRanges(chain -> GetTree(), offset, minEntries, ranges);
+  }
+
+  return ranges;
+
+}
+
+void TreeSkimReader::appendClusterRanges(TTree* tree, Long64_t offset, Long64_t minEntries, std::vector<EntryRange>& ranges) {
+
+  const Long64_t nEntries = tree -> GetEntries();
+
+  // the cluster iterator walks the entry boundaries at which all baskets of the tree were flushed together,
+  // so each range decompresses whole baskets and never re-reads a basket shared with the next range
+  TTree::TClusterIterator clusters = tree -> GetClusterIterator(0);
+  Long64_t first = 0;
+  Long64_t clusterStart = 0;
+  while ((clusterStart = clusters.Next()) < nEntries) {
+    const Long64_t clusterEnd = std::min(clusters.GetNextEntry(), nEntries);
+    if (clusterEnd - first >= minEntries) {
+      ranges.push_back(EntryRange(offset + first, offset + clusterEnd));
+      first = clusterEnd;
+    }
+  }
+
+  // leftover clusters smaller than minEntries at the end of the tree
+  if (first < nEntries) {
+    ranges.push_back(EntryRange(offset + first, offset + nEntries));
+  }
+
+}
+
+// =================================================================================================
+
+void TreeSkimReader::prefetchFile(int fileIndex, int& prefetched) {
+
+  if (fileIndex <= prefetched || fileIndex >= (int) skimFilePaths_.size()) {
+    return;
+  }
+  prefetched = fileIndex;
+
+  // POSIX_FADV_WILLNEED starts the kernel read-ahead and returns immediately; decompression still happens when the chain
+  // opens the file, and remote files are left to the tree cache's own asynchronous prefetching
+  const std::string& path = skimFilePaths_[fileIndex];
+  if (path.find("://") != std::string::npos) {
+    return;
+  }
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+
+}
+
+// =================================================================================================
+
+void TreeSkimReader::readSingles(EntryRange range, SinglesColumns& entries) {
+
+  entries.reserve(entries.size() + (range.second - range.first));
+  int treeNumber = -1;
+  for (Long64_t i = range.first; i < range.second; i++) {
+    singlesTree_ -> GetEntry(i);
+    if (singlesTree_ -> GetTreeNumber() != treeNumber) {
+      treeNumber = singlesTree_ -> GetTreeNumber();
+      prefetchFile(treeNumber + 1, prefetchedSingles_);
+    }
+    // append the contents of the dummy object to the end of each column
+    entries.push_back(tempPositronEntry_);
+  }
+
+}
+
+void TreeSkimReader::readDoubles(EntryRange range, PileupColumns& entries) {
+  readPileup(doublesTree_, doubleBuffers_, prefetchedDoubles_, range, entries);
+}
+
+void TreeSkimReader::readTriples(EntryRange range, PileupColumns& entries) {
+  readPileup(triplesTree_, tripleBuffers_, prefetchedTriples_, range, entries);
+}
+
+void TreeSkimReader::readPileup(TChain* tree, PileupBuffers& buffers, int& prefetched, EntryRange range, PileupColumns& entries) {
+
+  // clusters of fields that are not read are appended as empty vectors, which leaves their columns empty
+  static const std::vector<int> noInts;
+  static const std::vector<bool> noBools;
+  static const std::vector<double> noDoubles;
+  const bool readIndex = fields_ & SkimFields::pileupIndex;
+  const bool readFlagged = fields_ & SkimFields::pileupFlagged;
+  const bool readTime = fields_ & SkimFields::time;
+  const bool readEnergy = fields_ & SkimFields::energy;
+  const bool readX = fields_ & SkimFields::x;
+  const bool readY = fields_ & SkimFields::y;
+  const bool readCalo = fields_ & SkimFields::caloIndex;
+
+  // one segment per file of the chain that the range touches
+  Long64_t first = range.first;
+  while (first < range.second) {
+    const Long64_t localFirst = tree -> LoadTree(first);
+    if (localFirst < 0) {
+      break;
+    }
+    TTree* fileTree = tree -> GetTree();
+    const Long64_t offset = first - localFirst;
+    const Long64_t last = std::min(range.second, offset + fileTree -> GetEntries());
+    prefetchFile(tree -> GetTreeNumber() + 1, prefetched);
+
+    if (!decodePileup(fileTree, localFirst, last - offset, entries)) {
+      for (Long64_t i = first; i < last; i++) {
+        tree -> GetEntry(i);
+        // must explicitly copy temporary pointers-to-vectors into the flattened columns
+        // because ROOT will overwrite its internal buffer that pointers-to-vectors point to
+        entries.push_back(buffers.entry, readIndex ? *buffers.pileupIndex : noInts, readFlagged ? *buffers.pileupFlagged : noBools,
+                          readTime ? *buffers.pileupTime : noDoubles, readEnergy ? *buffers.pileupEnergy : noDoubles,
+                          readX ? *buffers.pileupX : noDoubles, readY ? *buffers.pileupY : noDoubles, readCalo ? *buffers.pileupCaloIndex : noInts);
+      }
+    }
+
+    first = last;
+  }
+
+}
+
+// =================================================================================================
+
+// value of type T stored big-endian (ROOT's on-disk byte order) at 'bytes'
+template <typename T>
+static T fromBigEndian(const char* bytes) {
+  T value;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  char swapped[sizeof(T)];
+  for (std::size_t k = 0; k < sizeof(T); k++) {
+    swapped[k] = bytes[sizeof(T) - 1 - k];
+  }
+  std::memcpy(&value, swapped, sizeof(T));
+#else
+  std::memcpy(&value, bytes, sizeof(T));
+#endif
+  return value;
+}
+
+// call visit(bytes, size) with the serialized bytes of each entry in [first, last) of 'branch', basket by basket,
+// as TBranch::GetEntry() would locate them; stops and returns false if a basket is missing or visit() returns false
+template <typename Visit>
+static bool forEachSerializedEntry(TBranch* branch, Long64_t first, Long64_t last, Visit visit) {
+
+  const Long64_t* basketEntry = branch -> GetBasketEntry();
+  const int nBaskets = branch -> GetWriteBasket() + 1;
+
+  Long64_t entry = first;
+  while (entry < last) {
+    const int basketIndex = int(std::upper_bound(basketEntry, basketEntry + nBaskets, entry) - basketEntry) - 1;
+    // point the tree at the entry, so that the tree cache prefetches the baskets that follow it
+    branch -> GetTree() -> LoadTree(entry);
+    TBasket* basket = (basketIndex >= 0) ? branch -> GetBasket(basketIndex) : nullptr;
+    if (basket == nullptr) {
+      return false;
+    }
+
+    const Long64_t basketFirst = basketEntry[basketIndex];
+    const int nEntries = basket -> GetNevBuf();
+    const int* entryOffset = basket -> GetEntryOffset();
+    const char* buffer = basket -> GetBufferRef() -> Buffer();
+    const Long64_t basketLast = std::min(basketFirst + nEntries, last);
+    if (basketLast <= entry) {
+      return false;
+    }
+
+    for (; entry < basketLast; entry++) {
+      const int j = int(entry - basketFirst);
+      // variable-size entries are located by the basket's entry offsets, fixed-size ones follow the key back to back
+      int begin;
+      int end;
+      if (entryOffset != nullptr) {
+        begin = entryOffset[j];
+        end = (j + 1 < nEntries) ? entryOffset[j + 1] : basket -> GetLast();
+      } else {
+        begin = basket -> GetKeylen() + j * basket -> GetNevBufSize();
+        end = begin + basket -> GetNevBufSize();
+      }
+      if (!visit(buffer + begin, end - begin)) {
+        return false;
+      }
+    }
+
+    // the decoded basket is not needed anymore
+    branch -> DropBaskets("all");
+  }
+
+  return true;
+
+}
+
+// append a fundamental-type branch (one value per entry) to a column
+template <typename T>
+static bool decodeValues(TBranch* branch, Long64_t first, Long64_t last, std::vector<T>& column) {
+  column.reserve(column.size() + (last - first));
+  return forEachSerializedEntry(branch, first, last, [&column](const char* bytes, int size) {
+    if (size != (int) sizeof(T)) {
+      return false;
+    }
+    column.push_back(fromBigEndian<T>(bytes));
+    return true;
+  });
+}
+
+// append a std::vector branch to a flat column, and the number of elements of each entry to 'counts' (if not null)
+// each entry is streamed as a 10-byte header (byte count with kByteCountMask, class version, number of elements)
+// followed by the elements; bool elements take one byte, like the char column they go to
+template <typename T>
+static bool decodeVectors(TBranch* branch, Long64_t first, Long64_t last, std::vector<T>& column, std::vector<std::uint32_t>* counts) {
+  static constexpr std::uint32_t byteCountMask = 0x40000000;
+  static constexpr int headerBytes = 10;
+  return forEachSerializedEntry(branch, first, last, [&column, counts](const char* bytes, int size) {
+    if (size < headerBytes || (fromBigEndian<std::uint32_t>(bytes) ^ byteCountMask) != std::uint32_t(size - 4)) {
+      return false;
+    }
+    const std::uint32_t n = fromBigEndian<std::uint32_t>(bytes + 6);
+    if (headerBytes + std::uint64_t(n) * sizeof(T) != std::uint64_t(size)) {
+      return false;
+    }
+    const std::size_t start = column.size();
+    column.resize(start + n);
+    for (std::uint32_t k = 0; k < n; k++) {
+      column[start + k] = fromBigEndian<T>(bytes + headerBytes + k * sizeof(T));
+    }
+    if (counts != nullptr) {
+      counts -> push_back(n);
+    }
+    return true;
+  });
+}
+
+bool TreeSkimReader::decodePileup(TTree* tree, Long64_t first, Long64_t last, PileupColumns& entries) {
+
+  const std::size_t nEvents = entries.size();
+  const std::size_t nClusters = entries.clusters();
+  const std::size_t nNew = last - first;
+
+  // per-event branches; those that are not read get zeros, like the untouched dummy entry in the per-entry path
+  const std::vector<std::pair<const char*, std::vector<int>*>> eventBranches = {
+    {"runIndex", &entries.runIndex}, {"subrunIndex", &entries.subrunIndex},
+    {"fillIndex", &entries.fillIndex}, {"bunchNumber", &entries.bunchNumber}
+  };
+  const unsigned int eventFields[] = {SkimFields::runIndex, SkimFields::subrunIndex, SkimFields::fillIndex, SkimFields::bunchNumber};
+
+  bool ok = true;
+  for (unsigned int k = 0; k < eventBranches.size() && ok; k++) {
+    if (fields_ & eventFields[k]) {
+      TBranch* branch = tree -> GetBranch(eventBranches[k].first);
+      ok = branch != nullptr && decodeValues(branch, first, last, *eventBranches[k].second);
+    } else {
+      eventBranches[k].second -> resize(nEvents + nNew, 0);
+    }
+  }
+
+  // per-cluster branches; the first one read gives the number of clusters of each event, which all others must match
+  std::vector<std::uint32_t> counts;
+  bool counted = false;
+  std::size_t total = nClusters;
+  auto decodeColumn = [&](const char* name, unsigned int field, auto& column) {
+    if (!ok || !(fields_ & field)) {
+      return;
+    }
+    TBranch* branch = tree -> GetBranch(name);
+    ok = branch != nullptr && decodeVectors(branch, first, last, column, counted ? nullptr : &counts);
+    if (ok && !counted) {
+      counted = true;
+      ok = counts.size() == nNew;
+      total = column.size();
+    }
+    ok = ok && column.size() == total;
+  };
+  decodeColumn("pileupIndex", SkimFields::pileupIndex, entries.pileupIndex);
+  decodeColumn("pileupFlagged", SkimFields::pileupFlagged, entries.pileupFlagged);
+  decodeColumn("pileupTime", SkimFields::time, entries.pileupTime);
+  decodeColumn("pileupEnergy", SkimFields::energy, entries.pileupEnergy);
+  decodeColumn("pileupX", SkimFields::x, entries.pileupX);
+  decodeColumn("pileupY", SkimFields::y, entries.pileupY);
+  decodeColumn("pileupCaloIndex", SkimFields::caloIndex, entries.pileupCaloIndex);
+
+  for (const auto& branch: eventBranches) {
+    ok = ok && branch.second -> size() == nEvents + nNew;
+  }
+
+  if (!ok) {
+    entries.truncate(nEvents);
+    return false;
+  }
+
+  entries.offset.reserve(entries.offset.size() + nNew);
+  if (!counted) {
+    // no per-cluster field is read: every event has zero clusters, as in the per-entry path
+    entries.offset.resize(entries.offset.size() + nNew, nClusters);
+  } else {
+    for (std::uint32_t n: counts) {
+      entries.offset.push_back(entries.offset.back() + n);
+    }
+  }
+  return true;
+
+}
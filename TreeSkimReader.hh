@@ -0,0 +1,99 @@
+#ifndef TREE_SKIM_READER_HH
+#define TREE_SKIM_READER_HH
+
+#include "SkimReader.hh"
+
+#include "TChain.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// =================================================================================================
+
+// SkimReader for skims stored as TTrees: chains the singles, double-pileup and triple-pileup trees of all skim files,
+// binds their branches to dummy entry objects, and reads arbitrary entry ranges from them
+class TreeSkimReader : public SkimReader {
+
+  public:
+
+    TreeSkimReader(const std::vector<std::string>& skimFilePaths);
+    ~TreeSkimReader() override;
+
+    TreeSkimReader(const TreeSkimReader&) = delete;
+    TreeSkimReader& operator=(const TreeSkimReader&) = delete;
+
+    // disables all branches outside the fields, and reads the rest through a tree cache of cacheBytes per tree
+    // that holds exactly those branches (no learning phase)
+    void selectFields(unsigned int fields, Long64_t cacheBytes) override;
+
+    Long64_t entries(SkimStream stream) override;
+
+    // cluster (basket flush) boundaries of each file of the chain
+    std::vector<EntryRange> clusterRanges(SkimStream stream, Long64_t minEntries) override;
+
+    void readSingles(EntryRange range, SinglesColumns& entries) override;
+    void readDoubles(EntryRange range, PileupColumns& entries) override;
+    void readTriples(EntryRange range, PileupColumns& entries) override;
+
+    // cluster ranges of any tree or chain, as above
+    static std::vector<EntryRange> treeClusterRanges(TTree* tree, Long64_t minEntries);
+
+  private:
+
+    TChain* chain(SkimStream stream);
+
+    // dummy object and temporary pointers-to-vectors that one pileup tree's branches are bound to (SetBranchAddress)
+    // the doubles and triples have a set each, since fused mode reads both streams at the same time on different threads
+    // the vector contents must be appended to the flattened pileup columns for each entry
+    class PileupBuffers {
+      public:
+        PileupBuffers() : entry(), pileupIndex(0), pileupFlagged(0), pileupTime(0), pileupEnergy(0), pileupX(0), pileupY(0), pileupCaloIndex(0) {}
+        PileupData entry;
+        std::vector<int>* pileupIndex;
+        std::vector<bool>* pileupFlagged;
+        std::vector<double>* pileupTime;
+        std::vector<double>* pileupEnergy;
+        std::vector<double>* pileupX;
+        std::vector<double>* pileupY;
+        std::vector<int>* pileupCaloIndex;
+    };
+
+    void bindPileupBranches(TTree* tree, PileupBuffers& buffers);
+    void enableBranches(TTree* tree, const std::vector<std::pair<const char*, unsigned int>>& branchFields, Long64_t cacheBytes);
+    void readPileup(TChain* tree, PileupBuffers& buffers, int& prefetched, EntryRange range, PileupColumns& entries);
+
+    // decode the local entries [first, last) of one file's pileup tree straight from its baskets into the columns,
+    // without going through GetEntry() and the temporary vectors below; returns false (leaving the columns unchanged)
+    // if a basket cannot be read or does not have the expected layout, in which case the entries are read one by one
+    bool decodePileup(TTree* tree, Long64_t first, Long64_t last, PileupColumns& entries);
+
+    // cluster ranges of one file's tree, shifted by the entry offset of that file in its chain
+    static void appendClusterRanges(TTree* tree, Long64_t offset, Long64_t minEntries, std::vector<EntryRange>& ranges);
+
+    // when a chain reaches one of its files, ask the operating system to read the following file ahead in the background,
+    // so that its compressed bytes are already in the page cache when the chain gets there; this is only OS read-ahead:
+    // the file is not opened by ROOT, its baskets are not decompressed in advance, and remote files are not touched
+    // 'prefetched' is the highest file index already requested for that chain
+    void prefetchFile(int fileIndex, int& prefetched);
+
+    TChain* singlesTree_;
+    TChain* doublesTree_;
+    TChain* triplesTree_;
+
+    std::vector<std::string> skimFilePaths_;
+    unsigned int fields_;
+    int prefetchedSingles_;
+    int prefetchedDoubles_;
+    int prefetchedTriples_;
+
+    // dummy objects holding the data from the current TTree entry
+    PositronData tempPositronEntry_;
+    PileupBuffers doubleBuffers_;
+    PileupBuffers tripleBuffers_;
+
+};
+
+#endif
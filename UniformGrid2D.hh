@@ -0,0 +1,171 @@
+#ifndef UNIFORM_GRID_2D_HH
+#define UNIFORM_GRID_2D_HH
+
+#include "CellKernel.hh"
+
+#include "TH2F.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// =================================================================================================
+
+// lightweight replacement for TH2F::Fill in hot loops: a dense 2D histogram with a uniform binning fixed at compile time
+// Binning must provide static constexpr members nx, xMin, xMax, ny, yMin, yMax (nx bins in [xMin, xMax), ny bins in [yMin, yMax))
+// cells use ROOT's global bin layout (under/overflow included, cell = binx + (nx + 2) * biny), so conversion to TH2F is a copy
+// Weighted == true additionally keeps the sum of squared weights, as TH2F does after its first weighted Fill()
+template <typename Binning, bool Weighted>
+class UniformGrid2D {
+
+  public:
+
+    static constexpr int nx = Binning::nx;
+    static constexpr int ny = Binning::ny;
+    static constexpr double xMin = Binning::xMin;
+    static constexpr double xMax = Binning::xMax;
+    static constexpr double yMin = Binning::yMin;
+    static constexpr double yMax = Binning::yMax;
+
+    static constexpr bool weighted = Weighted;
+
+    static constexpr int nCellsX = nx + 2;
+    static constexpr int nCells = (nx + 2) * (ny + 2);
+
+    // inverse bin widths, so that bin lookup is a multiply instead of a divide
+    static constexpr double invWidthX = nx / (xMax - xMin);
+    static constexpr double invWidthY = ny / (yMax - yMin);
+
+    UniformGrid2D() : sumw_(nCells, 0), sumw2_(Weighted ? nCells : 0, 0), entries_(0) {}
+
+    // bin along one axis from the position u measured in bin widths from the lower edge: 0 = underflow, n + 1 = overflow
+    // u is clamped before the integer conversion; NaN goes to the underflow bin through isNaNBits(), which still works under -ffast-math
+    static int bin(double u, int n) {
+      u = (u >= 0 && !isNaNBits(u)) ? u : -1.0;
+      u = (u < n) ? u : n;
+      return int(u) + 1;
+    }
+
+    static int cell(double x, double y) {
+      return bin((x - xMin) * invWidthX, nx) + nCellsX * bin((y - yMin) * invWidthY, ny);
+    }
+
+    void fill(double x, double y) {
+      fillCell(cell(x, y), 1.0);
+      entries_++;
+    }
+
+    void fill(double x, double y, double w) {
+      fillCell(cell(x, y), w);
+      entries_++;
+    }
+
+    static CellGeometry geometry() {
+      CellGeometry geometry;
+      geometry.xMin = xMin;
+      geometry.invWidthX = invWidthX;
+      geometry.nx = nx;
+      geometry.yMin = yMin;
+      geometry.invWidthY = invWidthY;
+      geometry.ny = ny;
+      geometry.nCellsX = nCellsX;
+      return geometry;
+    }
+
+    // fill n points (w == nullptr -> unit weights)
+    void fillN(std::size_t n, const double* x, const double* y, const double* w) {
+      fillScaled(n, x, 1.0, nullptr, y, w);
+    }
+
+    // fill n points with x = xRaw[i] * xScale + xShift[i] (xShift == nullptr -> 0), e.g. clock ticks converted to microseconds
+    // cells are computed a block at a time by the SIMD cell kernel chosen for this CPU, and then accumulated
+    void fillScaled(std::size_t n, const double* xRaw, double xScale, const double* xShift, const double* y, const double* w) {
+      static const CellGeometry grid = geometry();
+      const CellKernelFunction kernel = cellKernel();
+      int cells[blockSize];
+      for (std::size_t first = 0; first < n; first += blockSize) {
+        const std::size_t count = std::min<std::size_t>(blockSize, n - first);
+        kernel(count, xRaw + first, xScale, xShift ? xShift + first : nullptr, y + first, cells, grid);
+        fillCells(count, cells, w ? w + first : nullptr);
+      }
+      entries_ += n;
+    }
+
+    // histogram-increment stage: add w[i] (w == nullptr -> 1) to cells[i]; does not count entries
+    void fillCells(std::size_t n, const int* cells, const double* w) {
+      if (w == nullptr) {
+        for (std::size_t i = 0; i < n; i++) {
+          fillCell(cells[i], 1.0);
+        }
+      } else {
+        for (std::size_t i = 0; i < n; i++) {
+          fillCell(cells[i], w[i]);
+        }
+      }
+    }
+
+    // add to one cell and to the entry count directly, e.g. when reading stored contents back
+    void addCell(int cell, double sumw, double sumw2) {
+      sumw_[cell] += sumw;
+      if (Weighted) {
+        sumw2_[cell] += sumw2;
+      }
+    }
+
+    void addEntries(long long n) {
+      entries_ += n;
+    }
+
+    void add(const UniformGrid2D& other) {
+      for (int i = 0; i < nCells; i++) {
+        sumw_[i] += other.sumw_[i];
+      }
+      for (std::size_t i = 0; i < sumw2_.size(); i++) {
+        sumw2_[i] += other.sumw2_[i];
+      }
+      entries_ += other.entries_;
+    }
+
+    void reset() {
+      std::fill(sumw_.begin(), sumw_.end(), 0.0f);
+      std::fill(sumw2_.begin(), sumw2_.end(), 0.0);
+      entries_ = 0;
+    }
+
+    // overwrite a TH2F with the same binning by this grid's contents
+    // statistics (means, RMS) are recomputed from the bin contents, since individual fill values are not kept
+    void copyTo(TH2F* hist) const {
+      hist -> Reset();
+      std::copy(sumw_.begin(), sumw_.end(), hist -> GetArray());
+      if (Weighted) {
+        if (hist -> GetSumw2N() == 0) {
+          hist -> Sumw2();
+        }
+        std::copy(sumw2_.begin(), sumw2_.end(), hist -> GetSumw2() -> GetArray());
+      }
+      hist -> ResetStats();
+      hist -> SetEntries(entries_);
+    }
+
+    const float* contents() const { return sumw_.data(); }
+    const double* sumw2() const { return Weighted ? sumw2_.data() : nullptr; }
+    long long entries() const { return entries_; }
+
+  private:
+
+    static constexpr std::size_t blockSize = 256;
+
+    void fillCell(int cell, double w) {
+      sumw_[cell] += w;
+      if (Weighted) {
+        sumw2_[cell] += w * w;
+      }
+    }
+
+    std::vector<float> sumw_; // float like TH2F; per-subrun counts stay far below float's exact-integer range
+    std::vector<double> sumw2_;
+    long long entries_;
+
+};
+
+#endif
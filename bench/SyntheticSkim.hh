@@ -0,0 +1,182 @@
+#ifndef SYNTHETIC_SKIM_HH
+#define SYNTHETIC_SKIM_HH
+
+#include "../HistogramBase.hh"
+
+#include "TRandom3.h"
+
+#include <cmath>
+#include <vector>
+
+// =================================================================================================
+
+// shape and size of a synthetic skim; the defaults give ~400k singles, a few seconds of work on a laptop
+class SyntheticSkimOptions {
+
+  public:
+
+    SyntheticSkimOptions()
+      : firstRun(15921), runs(1), subrunsPerRun(20), fillsPerSubrun(200), positronsPerFill(100),
+        doublesPerFill(2.0), triplesPerFill(0.1), seed(1) {}
+
+    int firstRun;
+    int runs;
+    int subrunsPerRun;
+    int fillsPerSubrun;
+    double positronsPerFill; // mean, Poisson distributed
+    double doublesPerFill; // mean number of double-pileup events per fill
+    double triplesPerFill; // mean number of triple-pileup events per fill
+    unsigned int seed;
+
+};
+
+// =================================================================================================
+
+// generates skim entries fill by fill, in (run, subrun, fill) order, as the crystalTreeMaker1EP/2EP/3EP producers write them:
+// positron times follow the muon decay with the g-2 wiggle, N(t) ~ exp(-t/tau) (1 + A(E) cos(omega_a t + phi)), with the
+// energy spectrum N(E) and asymmetry A(E) of decays in the lab frame, on 24 calorimeters
+// pileup events carry the clusters their correction uses: doubles the two singles (indices 0, 1) and their sum (2),
+// triples 13 clusters (3 singles, 3 pairs, the triplet and 6 shadow combinations); only their multiplicities, times and
+// energies matter for timing, the pileup spectra themselves are not meant to be physical
+class SyntheticSkimGenerator {
+
+  public:
+
+    static constexpr double clockTick = 1.25e-3; // microseconds, the skims store times in clock ticks
+    static constexpr double lifetime = 64.44; // dilated muon lifetime, microseconds
+    static constexpr double omegaA = 1.4392; // anomalous precession frequency, rad / microsecond
+    static constexpr double phase = 2.08;
+    static constexpr double fillStart = 25.0; // first time in a fill, microseconds
+    static constexpr double fillEnd = 700.0;
+    static constexpr double maxEnergy = 3100.0; // MeV
+    static constexpr int calorimeters = 24;
+    static constexpr int fillsPerSecond = 12;
+
+    SyntheticSkimGenerator(const SyntheticSkimOptions& options) : options_(options), random_(options.seed) {}
+
+    // call fill(runIndex, subrunIndex, fillIndex, gpsInteger) for every fill of the skim, in order
+    template <typename Function>
+    void forEachFill(Function fill) {
+      unsigned int gpsInteger = 1500000000u;
+      for (int run = options_.firstRun; run < options_.firstRun + options_.runs; run++) {
+        for (int subrun = 1; subrun <= options_.subrunsPerRun; subrun++) {
+          for (int fillIndex = 0; fillIndex < options_.fillsPerSubrun; fillIndex++) {
+            fill(run, subrun, fillIndex, gpsInteger + fillIndex / fillsPerSecond);
+          }
+          gpsInteger += options_.fillsPerSubrun / fillsPerSecond + 1;
+        }
+      }
+    }
+
+    // append the entries of one fill to the columns
+    void generateFill(int runIndex, int subrunIndex, int fillIndex, unsigned int gpsInteger,
+                      SinglesColumns& singles, PileupColumns& doubles, PileupColumns& triples) {
+
+      PositronData positron;
+      positron.gpsInteger = gpsInteger;
+      positron.runIndex = runIndex;
+      positron.subrunIndex = subrunIndex;
+      positron.fillIndex = fillIndex;
+      positron.bunchNumber = fillIndex % 8;
+      positron.laserInFill = false;
+
+      const int nSingles = random_.Poisson(options_.positronsPerFill);
+      for (int i = 0; i < nSingles; i++) {
+        decay(positron.time, positron.energy);
+        positron.time /= clockTick;
+        positron.caloIndex = 1 + random_.Integer(calorimeters);
+        positron.x = random_.Gaus(0, 1.5);
+        positron.y = random_.Gaus(0, 1.0);
+        singles.push_back(positron);
+      }
+
+      PileupData header;
+      header.runIndex = runIndex;
+      header.subrunIndex = subrunIndex;
+      header.fillIndex = fillIndex;
+      header.bunchNumber = positron.bunchNumber;
+      header.laserInFill = false;
+
+      const int nDoubles = random_.Poisson(options_.doublesPerFill);
+      for (int i = 0; i < nDoubles; i++) {
+        pileupEvent(2, header, doubles);
+      }
+      const int nTriples = random_.Poisson(options_.triplesPerFill);
+      for (int i = 0; i < nTriples; i++) {
+        pileupEvent(3, header, triples);
+      }
+
+    }
+
+  private:
+
+    // decay positron time (microseconds) and energy (MeV), by rejection from the joint (t, E) distribution
+    void decay(double& time, double& energy) {
+      while (true) {
+        time = fillStart + random_.Exp(lifetime);
+        if (time >= fillEnd) {
+          continue;
+        }
+        const double y = random_.Uniform(0, 1);
+        const double number = (y - 1) * (4 * y * y - 5 * y - 5);
+        const double asymmetryNumber = (y - 1) * (-8 * y * y + y + 1);
+        // number + asymmetryNumber * cos(...) is at most 6 everywhere on [0, 1]
+        if (random_.Uniform(0, 6) < number + asymmetryNumber * std::cos(omegaA * time + phase)) {
+          energy = y * maxEnergy;
+          return;
+        }
+      }
+    }
+
+    // one pileup event made of 'multiplicity' decay positrons within a few ns on the same calorimeter
+    void pileupEvent(int multiplicity, const PileupData& header, PileupColumns& events) {
+
+      double time[3];
+      double energy[3];
+      decay(time[0], energy[0]);
+      for (int k = 1; k < multiplicity; k++) {
+        double ignored;
+        decay(ignored, energy[k]);
+        time[k] = time[0] + random_.Uniform(0, 0.005);
+      }
+      const int calo = 1 + random_.Integer(calorimeters);
+
+      std::vector<int> index;
+      std::vector<double> times;
+      std::vector<double> energies;
+      auto cluster = [&](double t, double e) {
+        index.push_back(index.size());
+        times.push_back(t / clockTick);
+        energies.push_back(e);
+      };
+
+      if (multiplicity == 2) {
+        cluster(time[0], energy[0]);
+        cluster(time[1], energy[1]);
+        cluster(time[0], energy[0] + energy[1]);
+      } else {
+        cluster(time[0], energy[0] + energy[1]);
+        cluster(time[0], energy[0] + energy[2]);
+        cluster(time[1], energy[1] + energy[2]);
+        cluster(time[0], energy[0]);
+        cluster(time[1], energy[1]);
+        cluster(time[2], energy[2]);
+        cluster(time[0], energy[0] + energy[1] + energy[2]);
+        for (int k = 0; k < 3; k++) {
+          cluster(time[k], energy[k]);
+          cluster(time[k], energy[k] + energy[(k + 1) % 3]);
+        }
+      }
+
+      const std::size_t n = index.size();
+      events.push_back(header, index, std::vector<bool>(n, false), times, energies,
+                       std::vector<double>(n, 0.0), std::vector<double>(n, 0.0), std::vector<int>(n, calo));
+
+    }
+
+    SyntheticSkimOptions options_;
+    TRandom3 random_;
+
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include "SyntheticSkim.hh"
+#include "../Byu2Histograms.hh"
+#include "../SkimReader.hh"
+
+#include "TFile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include <sys/resource.h>
+
+// =================================================================================================
+
+// micro-benchmarks of the Byu2Histograms fill kernels on synthetic entries held in memory, and of the skim preload
+// "./benchKernels" with optional "-f fillsPerSubrun", "-e positronsPerFill", "-r repetitions" (fills of the same entries),
+// "-o scratchPath" (file the histograms are booked in, default /tmp/benchKernels.root), "-p skimPath" to also time
+// reading a skim into columns, and "--input-format tree|rntuple" for that skim
+// "./benchKernels --check-ranges -p 'skims/*.root'" only checks that the streamed chunks (cluster ranges) of the chained skim files
+// cover every entry of each stream exactly once, e.g. with an empty file in the chain, and exits with 1 if they don't
+// each line reports the entries (clusters, for the pileup fills) processed per second and the peak resident memory so far
+
+// =================================================================================================
+
+static long peakRssKiB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// run 'work' (which processes 'entries' entries) 'repetitions' times and print its throughput
+static void benchmark(const char* name, long long entries, int repetitions, const std::function<void()>& work) {
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repetitions; i++) {
+    work();
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const long long total = entries * repetitions;
+  printf("%-28s %12lld entries %10.3f s %14.0f entries/s %10.1f MiB peak RSS\n",
+         name, total, seconds, (seconds > 0) ? total / seconds : 0.0, peakRssKiB() / 1024.0);
+}
+
+// the cluster ranges of one stream must be consecutive, non-empty and end at the last entry
+static bool checkClusterRanges(SkimReader& reader, SkimStream stream, const char* name) {
+  const Long64_t entries = reader.entries(stream);
+  Long64_t next = 0;
+  bool valid = true;
+  for (const EntryRange& range: reader.clusterRanges(stream, 1)) {
+    valid = valid && range.first == next && range.second > range.first;
+    next = range.second;
+  }
+  valid = valid && next == entries;
+  printf("%-28s %12lld entries %s\n", name, entries, valid ? "ok" : "FAILED: cluster ranges don't cover every entry exactly once");
+  return valid;
+}
+
+// =================================================================================================
+
+int main(int argc, char** argv) {
+
+  SyntheticSkimOptions options;
+  options.subrunsPerRun = 10;
+  int repetitions = 5;
+  std::string scratchPath = "/tmp/benchKernels.root";
+  std::string skimPath = "";
+  StorageFormat inputFormat = StorageFormat::tree;
+  bool checkRanges = false;
+
+  const struct option longOptions[] = {
+    {"input-format", required_argument, 0, 'I'},
+    {"check-ranges", no_argument, 0, 'C'},
+    {0, 0, 0, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "f:e:r:o:p:", longOptions, 0)) != -1) {
+    switch (option) {
+      case 'f': options.fillsPerSubrun = std::atoi(optarg); break;
+      case 'e': options.positronsPerFill = std::atof(optarg); break;
+      case 'r': repetitions = std::atoi(optarg); break;
+      case 'o': scratchPath = optarg; break;
+      case 'p': skimPath = optarg; break;
+      case 'I': inputFormat = parseStorageFormat(optarg); break;
+      case 'C': checkRanges = true; break;
+      default:
+        printf("Unrecognized input option '%c'.\n", option);
+        std::exit(1);
+    }
+  }
+
+  if (checkRanges) {
+    std::unique_ptr<SkimReader> reader = SkimReader::open(inputFormat, SkimReader::listInputFiles(skimPath, ""));
+    bool valid = checkClusterRanges(*reader, SkimStream::singles, "clusterRanges (singles)");
+    valid = checkClusterRanges(*reader, SkimStream::doubles, "clusterRanges (doubles)") && valid;
+    valid = checkClusterRanges(*reader, SkimStream::triples, "clusterRanges (triples)") && valid;
+    return valid ? 0 : 1;
+  }
+
+  // synthetic entries, as the driver would hand them over
+  SinglesColumns singles;
+  PileupColumns doubles;
+  PileupColumns triples;
+  SyntheticSkimGenerator generator(options);
+  generator.forEachFill([&](int runIndex, int subrunIndex, int fillIndex, unsigned int gpsInteger) {
+    generator.generateFill(runIndex, subrunIndex, fillIndex, gpsInteger, singles, doubles, triples);
+  });
+  printf("%zu singles, %zu doubles (%zu clusters), %zu triples (%zu clusters), %d repetitions\n",
+         singles.size(), doubles.size(), doubles.clusters(), triples.size(), triples.clusters(), repetitions);
+
+  // per-entry randomization amounts (their values don't change the work done)
+  const std::size_t maxEntries = std::max(singles.size(), std::max(doubles.size(), triples.size()));
+  std::vector<double> frRandomization(maxEntries, 0.01);
+  std::vector<double> vwRandomization(maxEntries, 0.0);
+
+  // the instance books its trees in the scratch file, which is never written
+  TFile scratch(scratchPath.c_str(), "RECREATE");
+  scratch.cd();
+  std::unique_ptr<Byu2Histograms> instance(new Byu2Histograms());
+  instance -> bookHistograms(0, 0);
+
+  const SinglesBatch singlesBatch = singles.batch();
+  const PileupBatch doublesBatch = doubles.batch();
+  const PileupBatch triplesBatch = triples.batch();
+
+  benchmark("fillSinglesBatch", singles.size(), repetitions, [&]() {
+    instance -> fillSinglesBatch(singlesBatch, frRandomization.data(), vwRandomization.data(), 0, 0);
+  });
+  benchmark("fillSinglesHistograms", singles.size(), repetitions, [&]() {
+    for (std::size_t i = 0; i < singlesBatch.size; i++) {
+      PositronData entry = singlesBatch.entry(i);
+      instance -> fillSinglesHistograms(entry, frRandomization[i], vwRandomization[i], 0, 0);
+    }
+  });
+  benchmark("fillDoublesBatch", doubles.clusters(), repetitions, [&]() {
+    instance -> fillDoublesBatch(doublesBatch, frRandomization.data(), vwRandomization.data(), 0, 0);
+  });
+  benchmark("fillDoublesHistograms", doubles.clusters(), repetitions, [&]() {
+    for (std::size_t i = 0; i < doublesBatch.size; i++) {
+      PileupData entry = doublesBatch.entry(i);
+      instance -> fillDoublesHistograms(entry, frRandomization[i], vwRandomization[i], 0, 0);
+    }
+  });
+  benchmark("fillTriplesBatch", triples.clusters(), repetitions, [&]() {
+    instance -> fillTriplesBatch(triplesBatch, frRandomization.data(), vwRandomization.data(), 0, 0);
+  });
+  benchmark("fillTriplesHistograms", triples.clusters(), repetitions, [&]() {
+    for (std::size_t i = 0; i < triplesBatch.size; i++) {
+      PileupData entry = triplesBatch.entry(i);
+      instance -> fillTriplesHistograms(entry, frRandomization[i], vwRandomization[i], 0, 0);
+    }
+  });
+
+  // the same singles with per-calorimeter spectra as well
+  instance.reset(new Byu2Histograms());
+  OutputOptions perCalo;
+  perCalo.perCalo = true;
+  instance -> setOutputOptions(perCalo);
+  instance -> bookHistograms(0, 0);
+  benchmark("fillSinglesBatch (per-calo)", singles.size(), repetitions, [&]() {
+    instance -> fillSinglesBatch(singlesBatch, frRandomization.data(), vwRandomization.data(), 0, 0);
+  });
+
+  instance.reset();
+  scratch.Close();
+
+  // preload of a skim file, with the fields runHistogramming reads for Byu2Histograms
+  if (!skimPath.empty()) {
+    std::unique_ptr<SkimReader> reader = SkimReader::open(inputFormat, std::vector<std::string>(1, skimPath));
+    reader -> selectFields(Byu2Histograms().requiredFields() | SkimFields::fillIndex, 64LL * 1024 * 1024);
+    SinglesColumns preloadedSingles;
+    PileupColumns preloadedDoubles;
+    PileupColumns preloadedTriples;
+    benchmark("readSingles", reader -> entries(SkimStream::singles), 1, [&]() {
+      reader -> readSingles(EntryRange(0, reader -> entries(SkimStream::singles)), preloadedSingles);
+    });
+    benchmark("readDoubles", reader -> entries(SkimStream::doubles), 1, [&]() {
+      reader -> readDoubles(EntryRange(0, reader -> entries(SkimStream::doubles)), preloadedDoubles);
+    });
+    benchmark("readTriples", reader -> entries(SkimStream::triples), 1, [&]() {
+      reader -> readTriples(EntryRange(0, reader -> entries(SkimStream::triples)), preloadedTriples);
+    });
+  }
+
+}
@@ -0,0 +1,337 @@
+#include "SyntheticSkim.hh"
+#include "../RNTupleSupport.hh"
+
+#include "TFile.h"
+#include "TTree.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <getopt.h>
+
+// =================================================================================================
+
+// writes a synthetic skim file with the crystalTreeMaker1EP/2EP/3EP "ntuple" trees (or RNTuples) that runHistogramming reads
+// "./makeSyntheticSkim -o skimPath" with optional "-r runs", "-s subrunsPerRun", "-f fillsPerSubrun", "-e positronsPerFill",
+// "--doubles meanPerFill", "--triples meanPerFill", "--seed N" and "--format tree|rntuple"
+
+// =================================================================================================
+
+// the three skim streams of one file, filled entry by entry from the generated columns
+class SkimWriter {
+
+  public:
+
+    virtual ~SkimWriter() {}
+    virtual void write(const SinglesColumns& singles, const PileupColumns& doubles, const PileupColumns& triples) = 0;
+    virtual void close() = 0;
+
+};
+
+class TreeSkimWriter : public SkimWriter {
+
+  public:
+
+    TreeSkimWriter(TFile* file) : file_(file) {
+      singles_ = makeTree("crystalTreeMaker1EP");
+      singles_ -> Branch("gpsInteger", &positron_.gpsInteger, "gpsInteger/i");
+      singles_ -> Branch("time", &positron_.time, "time/D");
+      singles_ -> Branch("energy", &positron_.energy, "energy/D");
+      singles_ -> Branch("x", &positron_.x, "x/D");
+      singles_ -> Branch("y", &positron_.y, "y/D");
+      singles_ -> Branch("caloIndex", &positron_.caloIndex, "caloIndex/I");
+      singles_ -> Branch("runIndex", &positron_.runIndex, "runIndex/I");
+      singles_ -> Branch("subrunIndex", &positron_.subrunIndex, "subrunIndex/I");
+      singles_ -> Branch("fillIndex", &positron_.fillIndex, "fillIndex/I");
+      singles_ -> Branch("bunchNumber", &positron_.bunchNumber, "bunchNumber/I");
+      doubles_ = makePileupTree("crystalTreeMaker2EP");
+      triples_ = makePileupTree("crystalTreeMaker3EP");
+    }
+
+    void write(const SinglesColumns& singles, const PileupColumns& doubles, const PileupColumns& triples) override {
+      const SinglesBatch batch = singles.batch();
+      for (std::size_t i = 0; i < batch.size; i++) {
+        positron_ = batch.entry(i);
+        singles_ -> Fill();
+      }
+      writePileup(doubles, doubles_);
+      writePileup(triples, triples_);
+    }
+
+    ~TreeSkimWriter() override {
+      delete pileupIndex_;
+      delete pileupFlagged_;
+      delete pileupTime_;
+      delete pileupEnergy_;
+      delete pileupX_;
+      delete pileupY_;
+      delete pileupCaloIndex_;
+    }
+
+    // the trees are owned by their directories in the file
+    void close() override {
+      file_ -> Write();
+    }
+
+  private:
+
+    TTree* makeTree(const char* directory) {
+      file_ -> mkdir(directory) -> cd();
+      return new TTree("ntuple", directory);
+    }
+
+    TTree* makePileupTree(const char* directory) {
+      TTree* tree = makeTree(directory);
+      tree -> Branch("pileupIndex", &pileupIndex_);
+      tree -> Branch("pileupFlagged", &pileupFlagged_);
+      tree -> Branch("pileupTime", &pileupTime_);
+      tree -> Branch("pileupEnergy", &pileupEnergy_);
+      tree -> Branch("pileupX", &pileupX_);
+      tree -> Branch("pileupY", &pileupY_);
+      tree -> Branch("pileupCaloIndex", &pileupCaloIndex_);
+      tree -> Branch("runIndex", &pileup_.runIndex, "runIndex/I");
+      tree -> Branch("subrunIndex", &pileup_.subrunIndex, "subrunIndex/I");
+      tree -> Branch("fillIndex", &pileup_.fillIndex, "fillIndex/I");
+      tree -> Branch("bunchNumber", &pileup_.bunchNumber, "bunchNumber/I");
+      return tree;
+    }
+
+    void writePileup(const PileupColumns& events, TTree* tree) {
+      const PileupBatch batch = events.batch();
+      for (std::size_t i = 0; i < batch.size; i++) {
+        pileup_ = batch.entry(i);
+        *pileupIndex_ = pileup_.pileupIndex;
+        *pileupFlagged_ = pileup_.pileupFlagged;
+        *pileupTime_ = pileup_.pileupTime;
+        *pileupEnergy_ = pileup_.pileupEnergy;
+        *pileupX_ = pileup_.pileupX;
+        *pileupY_ = pileup_.pileupY;
+        *pileupCaloIndex_ = pileup_.pileupCaloIndex;
+        tree -> Fill();
+      }
+    }
+
+    TFile* file_;
+    TTree* singles_;
+    TTree* doubles_;
+    TTree* triples_;
+
+    PositronData positron_;
+    PileupData pileup_;
+
+    // the branches of vector type point to these
+    std::vector<int>* pileupIndex_ = new std::vector<int>();
+    std::vector<bool>* pileupFlagged_ = new std::vector<bool>();
+    std::vector<double>* pileupTime_ = new std::vector<double>();
+    std::vector<double>* pileupEnergy_ = new std::vector<double>();
+    std::vector<double>* pileupX_ = new std::vector<double>();
+    std::vector<double>* pileupY_ = new std::vector<double>();
+    std::vector<int>* pileupCaloIndex_ = new std::vector<int>();
+
+};
+
+#ifdef HISTOGRAMMING_RNTUPLE
+
+class NTupleSkimWriter : public SkimWriter {
+
+  public:
+
+    NTupleSkimWriter(TFile* file) {
+      auto singles = rntuple::RNTupleModel::Create();
+      gpsInteger_ = singles -> MakeField<unsigned int>("gpsInteger");
+      time_ = singles -> MakeField<double>("time");
+      energy_ = singles -> MakeField<double>("energy");
+      x_ = singles -> MakeField<double>("x");
+      y_ = singles -> MakeField<double>("y");
+      caloIndex_ = singles -> MakeField<int>("caloIndex");
+      singlesHeader_.make(*singles);
+      singles_ = rntuple::RNTupleWriter::Append(std::move(singles), "ntuple", *file -> mkdir("crystalTreeMaker1EP"));
+      doubles_.open(file, "crystalTreeMaker2EP");
+      triples_.open(file, "crystalTreeMaker3EP");
+    }
+
+    void write(const SinglesColumns& singles, const PileupColumns& doubles, const PileupColumns& triples) override {
+      for (std::size_t i = 0; i < singles.size(); i++) {
+        *gpsInteger_ = singles.gpsInteger[i];
+        *time_ = singles.time[i];
+        *energy_ = singles.energy[i];
+        *x_ = singles.x[i];
+        *y_ = singles.y[i];
+        *caloIndex_ = singles.caloIndex[i];
+        singlesHeader_.set(singles.runIndex[i], singles.subrunIndex[i], singles.fillIndex[i], singles.bunchNumber[i]);
+        singles_ -> Fill();
+      }
+      doubles_.write(doubles);
+      triples_.write(triples);
+    }
+
+    void close() override {
+      singles_ -> CommitDataset();
+      doubles_.writer -> CommitDataset();
+      triples_.writer -> CommitDataset();
+    }
+
+  private:
+
+    // runIndex, subrunIndex, fillIndex and bunchNumber fields, shared by all streams
+    class Header {
+      public:
+        void make(rntuple::RNTupleModel& model) {
+          runIndex = model.MakeField<int>("runIndex");
+          subrunIndex = model.MakeField<int>("subrunIndex");
+          fillIndex = model.MakeField<int>("fillIndex");
+          bunchNumber = model.MakeField<int>("bunchNumber");
+        }
+        void set(int run, int subrun, int fill, int bunch) {
+          *runIndex = run; *subrunIndex = subrun; *fillIndex = fill; *bunchNumber = bunch;
+        }
+        std::shared_ptr<int> runIndex, subrunIndex, fillIndex, bunchNumber;
+    };
+
+    class PileupStream {
+      public:
+        void open(TFile* file, const char* directory) {
+          auto model = rntuple::RNTupleModel::Create();
+          pileupIndex = model -> MakeField<std::vector<int>>("pileupIndex");
+          pileupFlagged = model -> MakeField<std::vector<bool>>("pileupFlagged");
+          pileupTime = model -> MakeField<std::vector<double>>("pileupTime");
+          pileupEnergy = model -> MakeField<std::vector<double>>("pileupEnergy");
+          pileupX = model -> MakeField<std::vector<double>>("pileupX");
+          pileupY = model -> MakeField<std::vector<double>>("pileupY");
+          pileupCaloIndex = model -> MakeField<std::vector<int>>("pileupCaloIndex");
+          header.make(*model);
+          writer = rntuple::RNTupleWriter::Append(std::move(model), "ntuple", *file -> mkdir(directory));
+        }
+        void write(const PileupColumns& events) {
+          const PileupBatch batch = events.batch();
+          for (std::size_t i = 0; i < batch.size; i++) {
+            const PileupData event = batch.entry(i);
+            *pileupIndex = event.pileupIndex;
+            *pileupFlagged = event.pileupFlagged;
+            *pileupTime = event.pileupTime;
+            *pileupEnergy = event.pileupEnergy;
+            *pileupX = event.pileupX;
+            *pileupY = event.pileupY;
+            *pileupCaloIndex = event.pileupCaloIndex;
+            header.set(event.runIndex, event.subrunIndex, event.fillIndex, event.bunchNumber);
+            writer -> Fill();
+          }
+        }
+        std::unique_ptr<rntuple::RNTupleWriter> writer;
+        std::shared_ptr<std::vector<int>> pileupIndex, pileupCaloIndex;
+        std::shared_ptr<std::vector<bool>> pileupFlagged;
+        std::shared_ptr<std::vector<double>> pileupTime, pileupEnergy, pileupX, pileupY;
+        Header header;
+    };
+
+    std::unique_ptr<rntuple::RNTupleWriter> singles_;
+    std::shared_ptr<unsigned int> gpsInteger_;
+    std::shared_ptr<double> time_, energy_, x_, y_;
+    std::shared_ptr<int> caloIndex_;
+    Header singlesHeader_;
+
+    PileupStream doubles_;
+    PileupStream triples_;
+
+};
+
+#endif
+
+// =================================================================================================
+
+int main(int argc, char** argv) {
+
+  SyntheticSkimOptions options;
+  std::string outputPath = "";
+  std::string format = "tree";
+
+  const struct option longOptions[] = {
+    {"doubles", required_argument, 0, 'D'},
+    {"triples", required_argument, 0, 'T'},
+    {"seed", required_argument, 0, 'R'},
+    {"format", required_argument, 0, 'F'},
+    {0, 0, 0, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "o:r:s:f:e:", longOptions, 0)) != -1) {
+    switch (option) {
+      case 'o': outputPath = optarg; break;
+      case 'r': options.runs = std::atoi(optarg); break;
+      case 's': options.subrunsPerRun = std::atoi(optarg); break;
+      case 'f': options.fillsPerSubrun = std::atoi(optarg); break;
+      case 'e': options.positronsPerFill = std::atof(optarg); break;
+      case 'D': options.doublesPerFill = std::atof(optarg); break;
+      case 'T': options.triplesPerFill = std::atof(optarg); break;
+      case 'R': options.seed = std::atoi(optarg); break;
+      case 'F': format = optarg; break;
+      default:
+        printf("Unrecognized input option '%c'.\n", option);
+        std::exit(1);
+    }
+  }
+
+  if (outputPath.empty()) {
+    printf("Usage: makeSyntheticSkim -o skimPath [-r runs] [-s subrunsPerRun] [-f fillsPerSubrun] [-e positronsPerFill] "
+           "[--doubles meanPerFill] [--triples meanPerFill] [--seed N] [--format tree|rntuple]\n");
+    std::exit(1);
+  }
+
+  TFile file(outputPath.c_str(), "RECREATE");
+  if (file.IsZombie()) {
+    printf("Cannot create skim file '%s'.\n", outputPath.c_str());
+    std::exit(1);
+  }
+
+  std::unique_ptr<SkimWriter> writer;
+  if (format == "tree") {
+    writer.reset(new TreeSkimWriter(&file));
+  } else if (format == "rntuple") {
+#ifdef HISTOGRAMMING_RNTUPLE
+    writer.reset(new NTupleSkimWriter(&file));
+#else
+    printf("RNTuple skims need ROOT 6.34 or later.\n");
+    std::exit(1);
+#endif
+  } else {
+    printf("Storage format '%s' not recognized (tree or rntuple).\n", format.c_str());
+    std::exit(1);
+  }
+
+  // generated and written one subrun at a time
+  SyntheticSkimGenerator generator(options);
+  SinglesColumns singles;
+  PileupColumns doubles;
+  PileupColumns triples;
+  long long nSingles = 0;
+  long long nDoubles = 0;
+  long long nTriples = 0;
+  int lastSubrun = -1;
+
+  auto flush = [&]() {
+    writer -> write(singles, doubles, triples);
+    nSingles += singles.size();
+    nDoubles += doubles.size();
+    nTriples += triples.size();
+    singles.clear();
+    doubles.clear();
+    triples.clear();
+  };
+
+  generator.forEachFill([&](int runIndex, int subrunIndex, int fillIndex, unsigned int gpsInteger) {
+    if (subrunIndex != lastSubrun) {
+      flush();
+      lastSubrun = subrunIndex;
+    }
+    generator.generateFill(runIndex, subrunIndex, fillIndex, gpsInteger, singles, doubles, triples);
+  });
+  flush();
+
+  writer -> close();
+  writer.reset();
+  file.Close();
+
+  printf("Wrote %lld singles, %lld doubles and %lld triples to '%s'.\n", nSingles, nDoubles, nTriples, outputPath.c_str());
+
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# benchmark baseline of the package on a synthetic skim, offline: fill kernels and skim preload (benchKernels), then
+# end-to-end runHistogramming in preload, stream and fused mode, each reporting entries/s and peak RSS
+# usage: bench/runBenchmarks.sh [workDir] [threads]   (run "make bench" to build everything first)
+# the skim is generated once per work directory; delete it (or pass another directory) to change its size
+set -e
+
+cd "$(dirname "$0")/.."
+work=${1:-bench/work}
+threads=${2:-4}
+mkdir -p "$work"
+
+skim="$work/syntheticSkim.root"
+if [ ! -f "$skim" ]; then
+  bench/makeSyntheticSkim -o "$skim"
+fi
+
+echo "== fill kernels and preload"
+bench/benchKernels -o "$work/kernels.root" -p "$skim"
+
+# streamed chunks of a chain whose middle file is empty must still cover every entry exactly once, in both skim formats
+echo "== chained skims with an empty file"
+for format in tree rntuple; do
+  chain="$work/chain_$format"
+  mkdir -p "$chain"
+  if [ ! -f "$chain/skim2.root" ]; then
+    bench/makeSyntheticSkim -o "$chain/skim0.root" -s 2 --seed 1 --format $format
+    bench/makeSyntheticSkim -o "$chain/skim1.root" -s 2 -e 0 --doubles 0 --triples 0 --format $format
+    bench/makeSyntheticSkim -o "$chain/skim2.root" -s 2 --seed 2 --format $format
+  fi
+  bench/benchKernels --check-ranges -p "$chain/skim*.root" --input-format $format
+done
+
+# entries/s of a job = entries read from all three streams / job wall time, from its --profile report
+report() {
+  local profile=$1
+  local entries wall rss
+  entries=$(grep -o '"name": "read\(Singles\|Doubles\|Triples\)", "calls": [0-9]*, "seconds": [0-9.]*, "entries": [0-9]*' "$profile" \
+            | awk '{ sum += $NF } END { print sum + 0 }')
+  wall=$(grep -o '"wallSeconds": [0-9.]*' "$profile" | awk '{ print $2 }')
+  rss=$(grep -o '"peakRssKiB": [0-9]*' "$profile" | awk '{ print $2 }')
+  awk -v e="$entries" -v w="$wall" -v r="$rss" -v m="$2" \
+      'BEGIN { printf "%-28s %12d entries %10.3f s %14.0f entries/s %10.1f MiB peak RSS\n", m, e, w, (w > 0) ? e / w : 0, r / 1024 }'
+}
+
+echo "== runHistogramming, $threads threads"
+for mode in preload stream fused; do
+  case $mode in
+    preload) flags="" ;;
+    stream) flags="--stream" ;;
+    fused) flags="--fused" ;;
+  esac
+  ./runHistogramming -d 2F -s 0 -p "$skim" -c Byu2Histograms -o "$work" -n 4 -j "$threads" $flags --profile "$work/profile_$mode.json" > /dev/null
+  report "$work/profile_$mode.json" "runHistogramming $mode"
+done
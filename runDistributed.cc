@@ -0,0 +1,438 @@
+#include "ShardManifest.hh"
+#include "SkimReader.hh"
+
+#include "TFileMerger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <getopt.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// =================================================================================================
+
+// distributed execution of runHistogramming over a whole dataset, in three steps:
+//
+//   ./runDistributed plan -d dataset -c class1,... -p 'skims/*.root' (or --file-list listPath) -n seedsPerSkim -o jobDir
+//                         [--seeds-per-shard K] [--first-skim S] [-- runHistogramming arguments ...]
+//     splits the dataset into (skim, seed range) shards and writes jobDir/manifest.txt; the skim files get indices S, S + 1, ...
+//     in sorted path order, and every shard runs K seeds (default: all seeds of its skim)
+//
+//   ./runDistributed work -m jobDir/manifest.txt [-w processes] [--worker path] [--rank r --ranks n]
+//     runs the shards as runHistogramming processes, at most 'processes' at a time on this machine, each writing to its own
+//     shard directory; shards that already completed (see ShardManifest::doneMarker) are skipped, so a failed or preempted
+//     work step is simply run again; with several ranks, rank r takes shards r, r + n, r + 2n, ... so that the ranks of one
+//     job share the work without talking to each other; under mpirun/srun the rank and the number of ranks are taken from the
+//     launcher's environment (Open MPI, MPICH and other PMI launchers, Slurm), so no MPI library is needed
+//
+//   ./runDistributed reduce -m jobDir/manifest.txt [-w processes] [--fan-in k]
+//     merges the shard outputs of each class into jobDir/<class>_dataset<dataset>.root as a tree of merges of k files at a
+//     time (default 8): level 1 merges shards 0..k-1, k..2k-1, ..., level 2 merges those results in the same way, and so on
+//     the grouping depends only on the manifest, so the result is the same however the merges of a level are scheduled;
+//     per-subrun rows are concatenated in shard order and histograms are summed in a fixed order
+//
+//   ./runDistributed run -m jobDir/manifest.txt [-w processes] runs work and reduce on one machine
+//
+// all shard outputs of a class must fit the usual hadd semantics: seeds of the same skim are in different seedN directories,
+// and rows of the same seed from different skims are appended (the subruns of a dataset are split between its skim files)
+
+// =================================================================================================
+
+static void usage() {
+  printf("Usage: runDistributed plan|work|reduce|run [options], see runDistributed.cc.\n");
+  std::exit(1);
+}
+
+// create a directory and its parents
+static void makeDirectories(const std::string& path) {
+  for (std::size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+    const std::string prefix = path.substr(0, slash);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      printf("Cannot create directory '%s': %s\n", prefix.c_str(), std::strerror(errno));
+      std::exit(1);
+    }
+    if (slash == std::string::npos) {
+      return;
+    }
+  }
+}
+
+static bool fileExists(const std::string& path) {
+  struct stat status;
+  return stat(path.c_str(), &status) == 0;
+}
+
+// position of this process among the ranks of a job started by a launcher, which exports it in the environment;
+// a process started any other way is rank 0 of 1
+static void launcherRank(int& rank, int& ranks) {
+  const char* const variables[][2] = {
+    {"OMPI_COMM_WORLD_RANK", "OMPI_COMM_WORLD_SIZE"},
+    {"PMI_RANK", "PMI_SIZE"},
+    {"SLURM_PROCID", "SLURM_NTASKS"}
+  };
+  for (const auto& variable: variables) {
+    const char* rankValue = std::getenv(variable[0]);
+    const char* ranksValue = std::getenv(variable[1]);
+    if (rankValue != nullptr && ranksValue != nullptr) {
+      rank = std::atoi(rankValue);
+      ranks = std::atoi(ranksValue);
+      return;
+    }
+  }
+  rank = 0;
+  ranks = 1;
+}
+
+// =================================================================================================
+
+// run job(i) for i in [0, n) in child processes, at most 'width' at a time; job(i) runs in the child and returns its exit status
+// (or replaces the child with exec); finished(i, ok) is called in this process as each child exits; returns the number of failures
+static int runInProcesses(std::size_t n, int width, const std::function<int(std::size_t)>& job, const std::function<void(std::size_t, bool)>& finished) {
+  std::map<pid_t, std::size_t> running;
+  std::size_t next = 0;
+  int failures = 0;
+  while (next < n || !running.empty()) {
+    while (next < n && int(running.size()) < width) {
+      fflush(stdout);
+      const pid_t pid = fork();
+      if (pid < 0) {
+        printf("Cannot start a process: %s\n", std::strerror(errno));
+        std::exit(1);
+      }
+      if (pid == 0) {
+        const int status = job(next);
+        fflush(stdout);
+        _exit(status);
+      }
+      running[pid] = next;
+      next++;
+    }
+    int status = 0;
+    const pid_t pid = wait(&status);
+    if (pid < 0) {
+      printf("Waiting for processes failed: %s\n", std::strerror(errno));
+      std::exit(1);
+    }
+    std::map<pid_t, std::size_t>::iterator it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    const bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+      failures++;
+    }
+    finished(it -> second, ok);
+    running.erase(it);
+  }
+  return failures;
+}
+
+// =================================================================================================
+
+// plan: split the skims of a dataset into shards
+static int plan(int argc, char** argv) {
+
+  ShardManifest manifest;
+  std::string classList = "";
+  std::string skimPattern = "";
+  std::string fileListPath = "";
+  int nSeeds = 1;
+  int seedsPerShard = 0;
+  int firstSkim = 0;
+
+  const struct option longOptions[] = {
+    {"file-list", required_argument, 0, 'L'},
+    {"seeds-per-shard", required_argument, 0, 'K'},
+    {"first-skim", required_argument, 0, 'S'},
+    {0, 0, 0, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc, argv, "d:c:p:n:o:", longOptions, 0)) != -1) {
+    switch (option) {
+      case 'd': manifest.dataset = optarg; break;
+      case 'c': classList = optarg; break;
+      case 'p': skimPattern = optarg; break;
+      case 'n': nSeeds = std::atoi(optarg); break;
+      case 'o': manifest.outputDir = optarg; break;
+      case 'L': fileListPath = optarg; break;
+      case 'K': seedsPerShard = std::atoi(optarg); break;
+      case 'S': firstSkim = std::atoi(optarg); break;
+      default: usage();
+    }
+  }
+
+  // everything after "--" is passed on to every worker
+  for (int i = optind; i < argc; i++) {
+    manifest.workerArgs.push_back(argv[i]);
+  }
+
+  if (manifest.dataset.empty() || classList.empty() || manifest.outputDir.empty() || (skimPattern.empty() && fileListPath.empty())) {
+    printf("plan needs -d dataset, -c classes, -p skimPattern (or --file-list) and -o jobDir.\n");
+    std::exit(1);
+  }
+  if (seedsPerShard <= 0) {
+    seedsPerShard = nSeeds;
+  }
+
+  std::stringstream classNames(classList);
+  std::string className;
+  while (std::getline(classNames, className, ',')) {
+    manifest.classNames.push_back(className);
+  }
+
+  const std::vector<std::string> skimPaths = SkimReader::listInputFiles(skimPattern, fileListPath);
+  for (std::size_t skim = 0; skim < skimPaths.size(); skim++) {
+    for (int firstSeed = 0; firstSeed < nSeeds; firstSeed += seedsPerShard) {
+      Shard shard;
+      shard.index = manifest.shards.size();
+      shard.skimIndex = firstSkim + skim;
+      shard.firstSeed = firstSeed;
+      shard.nSeeds = std::min(seedsPerShard, nSeeds - firstSeed);
+      shard.inputPath = skimPaths[skim];
+      manifest.shards.push_back(shard);
+    }
+  }
+
+  makeDirectories(manifest.outputDir);
+  const std::string manifestPath = manifest.outputDir + "/manifest.txt";
+  if (!manifest.write(manifestPath)) {
+    printf("Cannot write shard manifest '%s'.\n", manifestPath.c_str());
+    std::exit(1);
+  }
+  printf("%zu shards (%zu skims x %d seeds) written to %s\n", manifest.shards.size(), skimPaths.size(), nSeeds, manifestPath.c_str());
+  return 0;
+
+}
+
+// =================================================================================================
+
+// work: run this rank's shards that are not done yet
+static int work(const ShardManifest& manifest, int processes, const std::string& workerPath, int rank, int ranks) {
+
+  std::vector<const Shard*> shards;
+  for (const Shard& shard: manifest.shards) {
+    if (shard.index % ranks == rank && !fileExists(manifest.doneMarker(shard))) {
+      shards.push_back(&shard);
+    }
+  }
+  printf("Rank %d of %d: %zu shards to run, %d at a time.\n", rank, ranks, shards.size(), processes);
+
+  std::string classList;
+  for (const std::string& className: manifest.classNames) {
+    classList += (classList.empty() ? "" : ",") + className;
+  }
+  for (const Shard* shard: shards) {
+    makeDirectories(manifest.shardDir(*shard));
+  }
+
+  const int failures = runInProcesses(shards.size(), processes,
+    [&](std::size_t i) {
+      // the child becomes the worker, with its output in the shard directory
+      const Shard& shard = *shards[i];
+      std::vector<std::string> arguments = {
+        workerPath, "-d", manifest.dataset, "-s", std::to_string(shard.skimIndex), "-p", shard.inputPath, "-c", classList,
+        "-o", manifest.shardDir(shard), "-n", std::to_string(shard.nSeeds), "--first-seed", std::to_string(shard.firstSeed)
+      };
+      arguments.insert(arguments.end(), manifest.workerArgs.begin(), manifest.workerArgs.end());
+      std::vector<char*> argv;
+      for (std::string& argument: arguments) {
+        argv.push_back(&argument[0]);
+      }
+      argv.push_back(nullptr);
+      const std::string logPath = manifest.shardDir(shard) + "/worker.log";
+      const int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (log >= 0) {
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        close(log);
+      }
+      execv(workerPath.c_str(), argv.data());
+      printf("Cannot run worker '%s': %s\n", workerPath.c_str(), std::strerror(errno));
+      return 127;
+    },
+    [&](std::size_t i, bool ok) {
+      const Shard& shard = *shards[i];
+      if (ok) {
+        FILE* marker = fopen(manifest.doneMarker(shard).c_str(), "w");
+        if (marker != nullptr) {
+          fclose(marker);
+        }
+      }
+      printf("Shard %d (skim %d, seeds %d-%d) %s\n", shard.index, shard.skimIndex, shard.firstSeed,
+             shard.firstSeed + shard.nSeeds - 1, ok ? "done" : ("failed, see " + manifest.shardDir(shard) + "/worker.log").c_str());
+    });
+
+  if (failures > 0) {
+    printf("%d shards failed; run the work step again to retry them.\n", failures);
+    return 1;
+  }
+  return 0;
+
+}
+
+// =================================================================================================
+
+static bool mergeFiles(const std::vector<std::string>& inputs, const std::string& output) {
+  TFileMerger merger(false);
+  merger.SetPrintLevel(0);
+  if (!merger.OutputFile(output.c_str(), "RECREATE")) {
+    return false;
+  }
+  for (const std::string& input: inputs) {
+    if (!merger.AddFile(input.c_str(), false)) {
+      return false;
+    }
+  }
+  return merger.Merge();
+}
+
+// reduce: merge the shard outputs of every class, level by level
+static int reduce(const ShardManifest& manifest, int processes, int fanIn) {
+
+  for (const Shard& shard: manifest.shards) {
+    if (!fileExists(manifest.doneMarker(shard))) {
+      printf("Shard %d is not done; run the work step first.\n", shard.index);
+      return 1;
+    }
+  }
+
+  for (const std::string& className: manifest.classNames) {
+
+    std::vector<std::string> level;
+    for (const Shard& shard: manifest.shards) {
+      level.push_back(manifest.shardOutput(shard, className));
+    }
+
+    const std::string reduceDir = manifest.outputDir + "/reduce/" + className;
+    makeDirectories(reduceDir);
+    bool intermediate = false;
+
+    for (int depth = 1; ; depth++) {
+
+      // groups of fanIn consecutive files of the previous level; the last level writes the final output directly
+      const std::size_t nGroups = (level.size() + fanIn - 1) / fanIn;
+      std::vector<std::string> next;
+      for (std::size_t group = 0; group < nGroups; group++) {
+        next.push_back((nGroups == 1) ? manifest.finalOutput(className) : Form("%s/level%d_%05zu.root", reduceDir.c_str(), depth, group));
+      }
+
+      const int failures = runInProcesses(nGroups, processes,
+        [&](std::size_t group) {
+          const std::size_t first = group * fanIn;
+          const std::vector<std::string> inputs(level.begin() + first, level.begin() + std::min(first + fanIn, level.size()));
+          return mergeFiles(inputs, next[group]) ? 0 : 1;
+        },
+        [](std::size_t, bool) {});
+      if (failures > 0) {
+        printf("%s: %d merges of level %d failed.\n", className.c_str(), failures, depth);
+        return 1;
+      }
+
+      // intermediate files of the previous level are not needed any more
+      if (intermediate) {
+        for (const std::string& path: level) {
+          std::remove(path.c_str());
+        }
+      }
+      printf("%s: level %d, %zu files merged into %zu\n", className.c_str(), depth, level.size(), next.size());
+      level = next;
+      intermediate = true;
+      if (nGroups == 1) {
+        break;
+      }
+    }
+
+    printf("%s: %s\n", className.c_str(), manifest.finalOutput(className).c_str());
+
+  }
+
+  return 0;
+
+}
+
+// =================================================================================================
+
+int main(int argc, char** argv) {
+
+  if (argc < 2) {
+    usage();
+  }
+  const std::string command = argv[1];
+  if (command == "plan") {
+    return plan(argc - 1, argv + 1);
+  }
+  if (command != "work" && command != "reduce" && command != "run") {
+    usage();
+  }
+
+  std::string manifestPath = "";
+  int processes = 1;
+  int fanIn = 8;
+  int rank = -1;
+  int ranks = -1;
+
+  // the worker is runHistogramming next to this program, unless given
+  std::string workerPath = argv[0];
+  const std::size_t slash = workerPath.rfind('/');
+  workerPath = ((slash == std::string::npos) ? std::string(".") : workerPath.substr(0, slash)) + "/runHistogramming";
+
+  const struct option longOptions[] = {
+    {"worker", required_argument, 0, 'W'},
+    {"fan-in", required_argument, 0, 'F'},
+    {"rank", required_argument, 0, 'R'},
+    {"ranks", required_argument, 0, 'N'},
+    {0, 0, 0, 0}
+  };
+
+  int option;
+  while ((option = getopt_long(argc - 1, argv + 1, "m:w:", longOptions, 0)) != -1) {
+    switch (option) {
+      case 'm': manifestPath = optarg; break;
+      case 'w': processes = std::atoi(optarg); break;
+      case 'W': workerPath = optarg; break;
+      case 'F': fanIn = std::atoi(optarg); break;
+      case 'R': rank = std::atoi(optarg); break;
+      case 'N': ranks = std::atoi(optarg); break;
+      default: usage();
+    }
+  }
+
+  if (manifestPath.empty() || processes < 1 || fanIn < 2) {
+    printf("%s needs -m manifest, at least one process (-w) and a fan-in of at least 2.\n", command.c_str());
+    std::exit(1);
+  }
+  if (rank < 0 || ranks < 1) {
+    launcherRank(rank, ranks);
+  }
+  if (rank >= ranks) {
+    printf("Rank %d is not below the number of ranks %d.\n", rank, ranks);
+    std::exit(1);
+  }
+  if (command == "run" && ranks > 1) {
+    printf("run is for a single machine; with %d ranks, run work on every rank and then reduce once.\n", ranks);
+    std::exit(1);
+  }
+
+  const ShardManifest manifest = ShardManifest::read(manifestPath);
+
+  if (command == "work" || command == "run") {
+    const int status = work(manifest, processes, workerPath, rank, ranks);
+    if (status != 0 || command == "work") {
+      return status;
+    }
+  }
+  return reduce(manifest, processes, fanIn);
+
+}
@@ -1,9 +1,19 @@
 #include "HistogramBase.hh"
-// #include "CornellHistograms.hh"
-#include "Byu2Histograms.hh"
-// #include "RatioHistograms.hh"
 
+#include "CounterRandom.hh"
+#include "FillRandomization.hh"
+#include "HistogramRegistry.hh"
+#include "JobCheckpoint.hh"
+#include "Profiler.hh"
+#include "SkimReader.hh"
+#include "SubrunAccumulator.hh"
+#include "ThreadPool.hh"
+
+#include "TROOT.h"
+#include "TEnv.h"
 #include "TTree.h"
+#include "TTreeCacheUnzip.h"
+#include "TFileMerger.h"
 #include "TRandom3.h"
 
 #include <map>
@@ -11,40 +21,167 @@
 #include <iostream>
 #include <algorithm>
 #include <memory>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <cstdio>
+#include <getopt.h>
 
 // =================================================================================================
 
 static constexpr double frPeriod = 0.1492; // microseconds
 static constexpr double vwPeriod = 0.4366; // microseconds
 
+// tree cache size per input tree
+static constexpr long long readCacheBytes = 64LL * 1024 * 1024;
+
+// skim fields the driver itself reads, for the per-fill randomization
+static constexpr unsigned int driverFields = SkimFields::runIndex | SkimFields::subrunIndex | SkimFields::fillIndex;
+
 // =================================================================================================
 
-static std::vector<std::string> allowedClassNames = {
-  // "CornellHistograms",
-  "RatioHistograms",
-  "Byu2Histograms"
-};
+static constexpr int maxDatasetsPerYear = 100;
+static constexpr int maxSkimsPerDataset = 20000;
+static constexpr int maxSeedsPerSkim = 1000;
+
+// =================================================================================================
 
+// HistogramBase subclasses register themselves in their .cc files (REGISTER_HISTOGRAM_CLASS), and are available here
+// as soon as they are linked in (CornellHistograms and RatioHistograms are not part of this package yet)
 bool validClassName(std::string& className) {
-  return std::find(allowedClassNames.begin(), allowedClassNames.end(), className) != allowedClassNames.end();
+  return HistogramRegistry::instance().contains(className);
+}
+
+// exit with the list of registered classes
+void unknownClassName(const std::string& className) {
+  printf("HistogramBase subclass '%s' not recognized. Available:", className.c_str());
+  for (const std::string& name: HistogramRegistry::instance().classNames()) {
+    printf(" %s", name.c_str());
+  }
+  printf("\n");
+  std::exit(1);
+}
+
+// =================================================================================================
+
+// projection "name:eMin:eMax[:rebin[:A]]", e.g. "T:1700:3060" or "A:1050:3060:1:A" (A-weighted)
+ProjectionSpec parseProjection(const std::string& text) {
+  ProjectionSpec spec;
+  std::vector<std::string> fields;
+  std::size_t start = 0;
+  while (true) {
+    const std::size_t end = text.find(':', start);
+    fields.push_back(text.substr(start, (end == std::string::npos) ? std::string::npos : end - start));
+    if (end == std::string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  bool valid = (fields.size() >= 3 && fields.size() <= 5 && !fields[0].empty());
+  if (valid) {
+    spec.name = fields[0];
+    spec.eMin = std::atof(fields[1].c_str());
+    spec.eMax = std::atof(fields[2].c_str());
+    spec.rebin = (fields.size() >= 4) ? std::atoi(fields[3].c_str()) : 1;
+    spec.asymmetryWeighted = (fields.size() == 5 && fields[4] == "A");
+    valid = (spec.eMin < spec.eMax && spec.rebin >= 1 && (fields.size() < 5 || spec.asymmetryWeighted));
+  }
+  if (!valid) {
+    printf("Projection '%s' not recognized (name:eMin:eMax[:rebin[:A]], energies in MeV, e.g. T:1700:3060 or A:1050:3060:1:A).\n", text.c_str());
+    std::exit(1);
+  }
+  return spec;
+}
+
+// calorimeter indices listed as comma-separated numbers and ranges, e.g. "18" or "1-12,19-24"
+std::vector<int> parseCaloList(const std::string& list) {
+  std::vector<int> caloIndices;
+  std::size_t start = 0;
+  while (start <= list.size()) {
+    std::size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    const std::string token = list.substr(start, end - start);
+    int first = 0;
+    int last = 0;
+    char extra = 0;
+    const int fields = std::sscanf(token.c_str(), "%d-%d%c", &first, &last, &extra);
+    if (fields == 1) {
+      last = first;
+    }
+    if ((fields != 1 && fields != 2) || first < 1 || last > CaloMask::nCalos || first > last) {
+      printf("Calorimeter list '%s' not recognized (numbers and ranges between 1 and %d, e.g. 1-12,19-24).\n", list.c_str(), CaloMask::nCalos);
+      std::exit(1);
+    }
+    for (int caloIndex = first; caloIndex <= last; caloIndex++) {
+      caloIndices.push_back(caloIndex);
+    }
+    start = end + 1;
+  }
+  return caloIndices;
 }
 
 // =================================================================================================
 
 // read command line inputs of the form "./runHistogramming -d dataset -s skimIndex -p skimFilePath -l lostMuonPath -c class1,class2,... -o outputPath"
-void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int& datasetIndex, int& skimIndex, std::string& skimFilePath, std::string& lostMuonPath, std::vector<std::string>& classNames, std::string& outputPath) {
+// optional: "-n seeds" random seed replicas (default 1), "-j threads" worker threads (default 1),
+// "--first-seed F" to run seeds F .. F + seeds - 1 of the skim instead of 0 .. seeds - 1 (one shard of a distributed job),
+// "--stream" to fill from TTree clusters as they are read instead of preloading, "--chunk-entries N" for the minimum streamed chunk size,
+// "--fused" to stream singles, doubles and triples together subrun by subrun and write each subrun as soon as it is complete (implies --stream),
+// "--checkpoint seconds" to close the outputs and save the job's progress at the first subrun boundary after every 'seconds' (implies --fused),
+// so that the same command, run again after the job was killed, resumes after the last saved subrun
+// "--counter-rng" to derive each fill's randomization from (seed, unique fill index) instead of a sequential TRandom3,
+// "--columnar" to store per-subrun spectra as flat arrays, "--zero-suppress" to store only their non-empty cells (implies --columnar)
+// several skim files are chained into one job by passing a glob pattern to -p (quoted, e.g. -p 'skims/*.root'), or "--file-list listPath"
+// "--input-format tree|rntuple" for skims stored as TTrees (default) or RNTuples,
+// "--output-format tree|rntuple" to store the columnar per-subrun spectra as TTrees (default) or RNTuples (implies --columnar)
+// "--profile reportPath" to write per-phase timings and counters as JSON, "--perf-counters" to add Linux hardware counters to it
+// "--calos list" to histogram only the listed calorimeters, "--exclude-calos list" to drop some (e.g. --exclude-calos 18 for Run2F);
+// a selection that leaves out any calorimeter also drops clusters with a caloIndex outside 1..24 (otherwise they are kept in all but
+// the per-calorimeter spectra),
+// "--per-calo" to also store per-subrun spectra of every calorimeter,
+// "--projection name:eMin:eMax[:rebin[:A]]" (repeatable) to also store the wiggle plot of energies in [eMin, eMax) MeV, rebin time
+// bins (cyclotron periods) per bin, A-weighted with ":A"
+void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int& datasetIndex, int& skimIndex, std::string& skimFilePath, std::string& fileListPath, StorageFormat& inputFormat, std::string& lostMuonPath, std::vector<std::string>& classNames, std::string& outputPath, int& nSeeds, int& firstSeed, int& nThreads, bool& streamMode, bool& fusedMode, int& checkpointSeconds, long long& chunkEntries, bool& counterRandom, OutputOptions& outputOptions, CaloMask& caloMask, std::string& profilePath, bool& hardwareCounters) {
 
   // list single-char argument keys (':' = value required, '::' = value optional, otherwise flag)
-  const char* const options = "d:s:p:l:c:o:";
+  const char* const options = "d:s:p:l:c:o:n:j:";
+
+  // long-only argument keys, mapped onto chars outside the single-char set above
+  const struct option longOptions[] = {
+    {"stream", no_argument, 0, 'S'},
+    {"fused", no_argument, 0, 'F'},
+    {"chunk-entries", required_argument, 0, 'C'},
+    {"counter-rng", no_argument, 0, 'R'},
+    {"columnar", no_argument, 0, 'K'},
+    {"zero-suppress", no_argument, 0, 'Z'},
+    {"file-list", required_argument, 0, 'L'},
+    {"input-format", required_argument, 0, 'I'},
+    {"output-format", required_argument, 0, 'O'},
+    {"profile", required_argument, 0, 'P'},
+    {"perf-counters", no_argument, 0, 'H'},
+    {"calos", required_argument, 0, 'A'},
+    {"exclude-calos", required_argument, 0, 'X'},
+    {"per-calo", no_argument, 0, 'Q'},
+    {"projection", required_argument, 0, 'W'},
+    {"first-seed", required_argument, 0, 'G'},
+    {"checkpoint", required_argument, 0, 'T'},
+    {0, 0, 0, 0}
+  };
 
   // intermediate string to hold argument listing class names
   std::string classNamesArg = "";
 
+  // calorimeter selection, applied after all arguments are read so that the order of --calos and --exclude-calos does not matter
+  std::vector<int> includedCalos;
+  std::vector<int> excludedCalos;
+
   bool done = false;
   while (!done) {
 
     // returns next option key as char, and reads value as char* into global variable 'optarg'
-    const char option = getopt(argc, argv, options);
+    const char option = getopt_long(argc, argv, options, longOptions, 0);
 
     switch(option) {
       case -1: // argument key will be -1 when no more arguments found
@@ -68,6 +205,74 @@ void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int&
       case 'o':
         outputPath = optarg;
         break;
+      case 'n':
+        nSeeds = std::atoi(optarg);
+        break;
+      case 'j':
+        nThreads = std::atoi(optarg);
+        break;
+      case 'S':
+        streamMode = true;
+        break;
+      case 'F':
+        streamMode = true;
+        fusedMode = true;
+        break;
+      case 'C':
+        chunkEntries = std::atoll(optarg);
+        break;
+      case 'R':
+        counterRandom = true;
+        break;
+      case 'K':
+        outputOptions.columnar = true;
+        break;
+      case 'Z':
+        outputOptions.columnar = true;
+        outputOptions.zeroSuppressed = true;
+        break;
+      case 'L':
+        fileListPath = optarg;
+        break;
+      case 'I':
+        inputFormat = parseStorageFormat(optarg);
+        break;
+      case 'O':
+        outputOptions.format = parseStorageFormat(optarg);
+        if (outputOptions.format == StorageFormat::rntuple) {
+          outputOptions.columnar = true;
+        }
+        break;
+      case 'P':
+        profilePath = optarg;
+        break;
+      case 'H':
+        hardwareCounters = true;
+        break;
+      case 'A':
+        includedCalos = parseCaloList(optarg);
+        break;
+      case 'X':
+        excludedCalos = parseCaloList(optarg);
+        break;
+      case 'Q':
+        outputOptions.perCalo = true;
+        break;
+      case 'W':
+        outputOptions.projections.push_back(parseProjection(optarg));
+        break;
+      case 'G':
+        firstSeed = std::atoi(optarg);
+        break;
+      case 'T':
+        streamMode = true;
+        fusedMode = true;
+        checkpointSeconds = std::atoi(optarg);
+        if (checkpointSeconds < 1) {
+          printf("Checkpoint interval must be at least 1 second.\n");
+          std::exit(1);
+        }
+        break;
       default:
         printf("Unrecognized input option '%c'.\n", option);
         std::exit(1);
@@ -75,6 +280,40 @@ void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int&
 
   }
 
+  if (nSeeds < 1 || nSeeds > maxSeedsPerSkim) {
+    printf("Number of seeds must be between 1 and %d.\n", maxSeedsPerSkim);
+    std::exit(1);
+  }
+
+  if (firstSeed < 0 || firstSeed + nSeeds > maxSeedsPerSkim) {
+    printf("Seeds %d to %d are outside the %d seeds of a skim.\n", firstSeed, firstSeed + nSeeds - 1, maxSeedsPerSkim);
+    std::exit(1);
+  }
+
+  if (nThreads < 1) {
+    printf("Number of threads must be at least 1.\n");
+    std::exit(1);
+  }
+
+  for (std::size_t i = 0; i < outputOptions.projections.size(); i++) {
+    for (std::size_t j = 0; j < i; j++) {
+      if (outputOptions.projections[i].name == outputOptions.projections[j].name) {
+        printf("Projection name '%s' used more than once.\n", outputOptions.projections[i].name.c_str());
+        std::exit(1);
+      }
+    }
+  }
+
+  if (!includedCalos.empty()) {
+    caloMask = CaloMask::none();
+    for (int caloIndex: includedCalos) {
+      caloMask.include(caloIndex);
+    }
+  }
+  for (int caloIndex: excludedCalos) {
+    caloMask.exclude(caloIndex);
+  }
+
   // extract the run year and production dataset letters from the dataset name
   runYear = dataset[0] - '0';
 
@@ -95,8 +334,7 @@ void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int&
     if (validClassName(token)) {
       classNames.push_back(token);
     } else {
-      printf("HistogramBase subclass '%s' not recognized.\n", token.c_str());
-      std::exit(1);
+      unknownClassName(token);
     }
 
     // remove this token and delimiter, so the string begins with the next token
@@ -108,8 +346,7 @@ void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int&
     if (validClassName(classNamesArg)) {
       classNames.push_back(classNamesArg);
     } else {
-      printf("HistogramBase subclass '%s' not recognized.\n", classNamesArg.c_str());
-      std::exit(1);
+      unknownClassName(classNamesArg);
     }
   }
 
@@ -117,9 +354,6 @@ void parseInputs(int argc, char** argv, std::string& dataset, int& runYear, int&
 
 // =================================================================================================
 
-static constexpr int maxDatasetsPerYear = 100;
-static constexpr int maxSkimsPerDataset = 20000;
-static constexpr int maxSeedsPerSkim = 1000;
 
 static const int maxSeedsPerDataset = maxSkimsPerDataset * maxSeedsPerSkim;
 static const int maxSeedsPerYear = maxDatasetsPerYear * maxSeedsPerDataset;
@@ -138,9 +372,430 @@ long long getUniqueFillIndex(int runIndex, int subrunIndex, int fillIndex) {
 
 // =================================================================================================
 
+// state of one random seed replica: its own generator, per-fill randomization amounts and instances of each subclass
+// workers for different seeds only share the read-only fill slot index, so they can be filled concurrently
+class SeedWorker {
+
+  public:
+
+    int seedIndex;
+
+    // unique seed for this skim file + seed index combination
+    int seed;
+
+    // random number generator seeded with 'seed', or nullptr when the randomization is counter-based
+    TRandom3* generator;
+
+    // fast rotation and vertical waist randomization amounts, indexed by the fill's slot in the shared FillSlotIndex
+    std::vector<FillRandomization> randomizationPerFill;
+
+    // one instance per requested class, in the same order as the output files, and the class names for the profile
+    std::vector<HistogramBase*> classInstances;
+    std::vector<std::string> classNames;
+
+    // pool the instances are filled on, side by side
+    ThreadPool* threadPool;
+
+};
+
+// =================================================================================================
+
+HistogramBase* createInstance(std::string& className) {
+  HistogramBase* instance = HistogramRegistry::instance().create(className);
+  if (instance == nullptr) {
+    unknownClassName(className);
+  }
+  return instance;
+}
+
+// create the class instances of a started seed
+// instances are constructed inside the seed's directory of each output file, so anything they attach to gDirectory lives there
+// with more than one thread, instances also get the pool to split their own batch fills (e.g. by subrun)
+void bookInstances(SeedWorker& worker, const OutputOptions& outputOptions, const CaloMask& caloMask, std::vector<TFile*>& outputFiles, int skimIndex) {
+
+  ScopedTimer timer("startSeed");
+  std::lock_guard<std::recursive_mutex> lock(outputMutex());
+  std::string seedLabel = Form("seed%d", worker.seedIndex);
+  for (unsigned int instanceIndex = 0; instanceIndex < worker.classNames.size(); instanceIndex++) {
+    outputFiles[instanceIndex] -> cd(seedLabel.c_str());
+    worker.classInstances.push_back(createInstance(worker.classNames[instanceIndex]));
+    worker.classInstances.back() -> setOutputOptions(outputOptions);
+    worker.classInstances.back() -> setCaloMask(caloMask);
+    worker.classInstances.back() -> bookHistograms(worker.seedIndex, skimIndex);
+    if (worker.threadPool -> size() > 1) {
+      worker.classInstances.back() -> setThreadPool(worker.threadPool);
+    }
+  }
+
+}
+
+// create the generator and the class instances for one seed
+void startSeed(SeedWorker& worker, int seedIndex, int seedOffset, bool counterRandom, const OutputOptions& outputOptions, const CaloMask& caloMask, std::vector<std::string>& classNames, std::vector<TFile*>& outputFiles, ThreadPool& threadPool, int skimIndex) {
+
+  worker.seedIndex = seedIndex;
+  worker.seed = seedOffset + seedIndex;
+  worker.generator = counterRandom ? nullptr : new TRandom3(worker.seed);
+  worker.classNames = classNames;
+  worker.threadPool = &threadPool;
+
+  bookInstances(worker, outputOptions, caloMask, outputFiles, skimIndex);
+
+}
+
+// write the histograms of a seed's class instances to disk and delete the instances; the generator and the randomization amounts
+// are kept, so that new instances (e.g. in the next part files of a checkpointed job) continue with the same random numbers
+void writeInstances(SeedWorker& worker, std::vector<TFile*>& outputFiles) {
+
+  std::lock_guard<std::recursive_mutex> lock(outputMutex());
+  std::string seedLabel = Form("seed%d", worker.seedIndex);
+  for (unsigned int instanceIndex = 0; instanceIndex < worker.classInstances.size(); instanceIndex++) {
+    outputFiles[instanceIndex] -> cd(seedLabel.c_str());
+    ScopedTimer timer("writeHistograms", worker.classNames[instanceIndex].c_str());
+    worker.classInstances[instanceIndex] -> writeHistograms(outputFiles[instanceIndex], worker.seedIndex);
+    delete worker.classInstances[instanceIndex];
+  }
+
+  worker.classInstances.clear();
+
+}
+
+// write histograms to disk for one seed and release everything the seed held
+void finishSeed(SeedWorker& worker, std::vector<TFile*>& outputFiles) {
+
+  writeInstances(worker, outputFiles);
+  worker.randomizationPerFill.clear();
+  delete worker.generator;
+  worker.generator = nullptr;
+
+}
+
+// =================================================================================================
+
+// add the fills of a block of positron entries to the shared slot index, in order of first appearance
+// must not run concurrently with any fill, which reads the index
+void addFillSlots(const SinglesBatch& positronEntries, FillSlotIndex& fillSlots) {
+
+  ScopedTimer timer("addFillSlots");
+  timer.addEntries(positronEntries.size);
+  long long lookups = 0;
+
+  // keep track of the last uniqueFillIndex so that we don't search the index for each positron's unique fill index
+  // this will save time when we're iterating through a sequence of positrons from the same fill, for example
+  long long lastUniqueFillIndex = -1;
+
+  for (std::size_t i = 0; i < positronEntries.size; i++) {
+
+    // literals need 'LL' to avoid overflows from intermediate types that are too small
+    long long uniqueFillIndex = getUniqueFillIndex(positronEntries.runIndex[i], positronEntries.subrunIndex[i], positronEntries.fillIndex[i]);
+
+    // if (positronEntry.laserInFill) { // for now, skip entries from laser-fills
+    //   laserFillIndices.insert(uniqueFillIndex);
+    //   continue;
+    // }
+
+    if (lastUniqueFillIndex != uniqueFillIndex) {
+      fillSlots.add(uniqueFillIndex);
+      lastUniqueFillIndex = uniqueFillIndex;
+      lookups++;
+    }
+
+  }
+
+  profiler().count("fill slot lookups", lookups);
+
+}
+
+// counter-based randomization amounts of one fill: a pure function of (seed, unique fill index),
+// so they don't depend on which thread, node or entry order meets the fill first
+FillRandomization counterFillRandomization(int seed, long long uniqueFillIndex) {
+  const std::uint32_t key[2] = {std::uint32_t(seed), 0};
+  const std::uint32_t counter[4] = {std::uint32_t(uniqueFillIndex), std::uint32_t(uniqueFillIndex >> 32), 0, 0};
+  std::uint32_t bits[4];
+  Philox4x32::generate(key, counter, bits);
+  FillRandomization randomization;
+  randomization.fr = (Philox4x32::uniform(bits[0], bits[1]) - 0.5) * frPeriod;
+  randomization.vw = (Philox4x32::uniform(bits[2], bits[3]) - 0.5) * vwPeriod;
+  return randomization;
+}
+
+// draw randomization amounts for the fills added to the slot index since the last call, in slot order
+// with TRandom3, every seed consumes its generator in the order in which fills first appear in the singles
+void drawFillRandomization(const FillSlotIndex& fillSlots, SeedWorker& worker) {
+  ScopedTimer timer("drawFillRandomization");
+  timer.addEntries(fillSlots.size() - worker.randomizationPerFill.size());
+  while (worker.randomizationPerFill.size() < fillSlots.size()) {
+    FillRandomization randomization;
+    if (worker.generator == nullptr) {
+      randomization = counterFillRandomization(worker.seed, fillSlots.uniqueFillIndex(worker.randomizationPerFill.size()));
+    } else {
+      randomization.fr = ((worker.generator -> Rndm()) - 0.5) * frPeriod;
+      randomization.vw = ((worker.generator -> Rndm()) - 0.5) * vwPeriod;
+    }
+    worker.randomizationPerFill.push_back(randomization);
+  }
+}
+
+// per-entry randomization amounts of a block of entries, looked up by fill
+// entries from fills without singles, and all entries of seedIndex == -1 (unrandomized), get zero
+template <typename Batch>
+void lookupFillRandomization(const Batch& entries, const FillSlotIndex& fillSlots, const SeedWorker& worker,
+                             std::vector<double>& frRandomization, std::vector<double>& vwRandomization) {
+
+  ScopedTimer timer("lookupFillRandomization");
+  timer.addEntries(entries.size);
+
+  frRandomization.assign(entries.size, 0.0);
+  vwRandomization.assign(entries.size, 0.0);
+  if (worker.seedIndex < 0) {
+    return;
+  }
+
+  long long lastUniqueFillIndex = -1;
+  long slot = -1;
+  long long lookups = 0;
+
+  for (std::size_t i = 0; i < entries.size; i++) {
+    long long uniqueFillIndex = getUniqueFillIndex(entries.runIndex[i], entries.subrunIndex[i], entries.fillIndex[i]);
+    if (lastUniqueFillIndex != uniqueFillIndex) {
+      slot = fillSlots.find(uniqueFillIndex);
+      lastUniqueFillIndex = uniqueFillIndex;
+      lookups++;
+    }
+    if (slot >= 0) {
+      frRandomization[i] = worker.randomizationPerFill[slot].fr;
+      vwRandomization[i] = worker.randomizationPerFill[slot].vw;
+    }
+  }
+
+  profiler().count("fill slot lookups", lookups);
+
+}
+
+// hand the same block of entries to every class instance of a seed: fill(instance) runs for all instances in parallel on the
+// seed's pool, so each additional class costs its own compute, but the entries are read, decoded and randomized only once
+// (the pool is shared with the other seeds; nested loops are picked up by whichever threads are idle)
+template <typename FillFunction>
+void dispatchToInstances(SeedWorker& worker, const char* phase, std::size_t entries, FillFunction fill) {
+  worker.threadPool -> parallelFor(worker.classInstances.size(), [&](std::size_t instanceIndex) {
+    ScopedTimer timer(phase, worker.classNames[instanceIndex].c_str());
+    timer.addEntries(entries);
+    fill(worker.classInstances[instanceIndex]);
+  });
+}
+
+// fill every class instance of a seed from a block of positron entries, whose fills must already be in the slot index
+void fillSingles(const SinglesBatch& positronEntries, const FillSlotIndex& fillSlots, SeedWorker& worker, int skimIndex) {
+
+  drawFillRandomization(fillSlots, worker);
+
+  // per-entry randomization amounts for the whole block, handed to the instances alongside the columns
+  std::vector<double> frRandomization;
+  std::vector<double> vwRandomization;
+  lookupFillRandomization(positronEntries, fillSlots, worker, frRandomization, vwRandomization);
+
+  dispatchToInstances(worker, "fillSinglesBatch", positronEntries.size, [&](HistogramBase* instance) {
+    instance -> fillSinglesBatch(positronEntries, frRandomization.data(), vwRandomization.data(), worker.seedIndex, skimIndex);
+  });
+
+}
+
+// fill every class instance of a seed from a block of double-pileup (triples == false) or triple-pileup (triples == true) entries
+void fillPileup(const PileupBatch& pileupEntries, bool triples, const FillSlotIndex& fillSlots, SeedWorker& worker, int skimIndex) {
+
+  // if (pileupEntry.laserInFill) { // for now, skip entries from laser-fills
+  //   continue;
+  // }
+
+  std::vector<double> frRandomization;
+  std::vector<double> vwRandomization;
+  lookupFillRandomization(pileupEntries, fillSlots, worker, frRandomization, vwRandomization);
+
+  dispatchToInstances(worker, triples ? "fillTriplesBatch" : "fillDoublesBatch", pileupEntries.size, [&](HistogramBase* instance) {
+    if (triples) {
+      instance -> fillTriplesBatch(pileupEntries, frRandomization.data(), vwRandomization.data(), worker.seedIndex, skimIndex);
+    } else {
+      instance -> fillDoublesBatch(pileupEntries, frRandomization.data(), vwRandomization.data(), worker.seedIndex, skimIndex);
+    }
+  });
+
+}
+
+// =================================================================================================
+
+// read a tree chunk by chunk and hand each chunk to 'fill', while the next chunk is read and decompressed on a background thread
+// at most two chunks are held in memory at any time
+template <typename Columns, typename ReadFunction, typename FillFunction>
+void streamChunks(const std::vector<EntryRange>& ranges, ReadFunction read, FillFunction fill) {
+
+  if (ranges.empty()) {
+    return;
+  }
+
+  auto readChunk = [&read](EntryRange range) {
+    Columns chunk;
+    read(range, chunk);
+    return chunk;
+  };
+
+  std::future<Columns> nextChunk = std::async(std::launch::async, readChunk, ranges[0]);
+  for (unsigned int i = 0; i < ranges.size(); i++) {
+    // time the fill loop spends waiting for the reader, i.e. how far the job is I/O bound
+    ScopedTimer wait("waitForChunk");
+    Columns chunk = nextChunk.get();
+    wait.stop();
+    if (i + 1 < ranges.size()) {
+      nextChunk = std::async(std::launch::async, readChunk, ranges[i + 1]);
+    }
+    fill(chunk);
+  }
+
+}
+
+// =================================================================================================
+
+// position in one skim stream read chunk by chunk for the fused mode, with the next chunk read on a background thread
+// entries are consumed in segments of consecutive entries from the same (run, subrun)
+template <typename Columns>
+class ChunkCursor {
+
+  public:
+
+    typedef std::function<void(EntryRange, Columns&)> ReadFunction;
+
+    ChunkCursor(const std::vector<EntryRange>& ranges, ReadFunction read) : ranges_(ranges), read_(read), nextRange_(0), position_(0) {
+      requestNext();
+      advance(0);
+    }
+
+    bool done() const { return position_ >= chunk_.size(); }
+
+    const Columns& chunk() const { return chunk_; }
+    std::size_t position() const { return position_; }
+
+    // (run, subrun) of the current entry
+    SubrunKey key() const { return SubrunKey(chunk_.runIndex[position_], chunk_.subrunIndex[position_]); }
+
+    // end of the segment starting at the current entry (exclusive, within the current chunk)
+    std::size_t segmentEnd() const {
+      std::size_t end = position_ + 1;
+      while (end < chunk_.size() && chunk_.runIndex[end] == chunk_.runIndex[position_] && chunk_.subrunIndex[end] == chunk_.subrunIndex[position_]) {
+        end++;
+      }
+      return end;
+    }
+
+    // move past the current segment, on to the next non-empty chunk if this one is used up
+    void advance(std::size_t end) {
+      position_ = end;
+      while (position_ >= chunk_.size() && next_.valid()) {
+        loadNext();
+      }
+    }
+
+  private:
+
+    void requestNext() {
+      if (nextRange_ < ranges_.size()) {
+        const EntryRange range = ranges_[nextRange_++];
+        ReadFunction read = read_;
+        next_ = std::async(std::launch::async, [read, range]() {
+          Columns chunk;
+          read(range, chunk);
+          return chunk;
+        });
+      }
+    }
+
+    void loadNext() {
+      ScopedTimer wait("waitForChunk");
+      chunk_ = next_.valid() ? next_.get() : Columns();
+      wait.stop();
+      position_ = 0;
+      requestNext();
+    }
+
+    std::vector<EntryRange> ranges_;
+    ReadFunction read_;
+    std::size_t nextRange_;
+
+    Columns chunk_;
+    std::size_t position_;
+    std::future<Columns> next_;
+
+};
+
+// =================================================================================================
+
+// for a job resumed from a checkpoint: the ranges left after dropping the leading ones whose entries all belong to subruns up to
+// and including 'last'; entries are in (run, subrun) order (as fused mode needs anyway), so the first range to keep is found by
+// reading the last entry of O(log n) ranges instead of reading through the finished subruns
+template <typename Columns, typename ReadFunction>
+std::vector<EntryRange> rangesAfter(const std::vector<EntryRange>& ranges, ReadFunction read, const SubrunKey& last) {
+  std::size_t low = 0;
+  std::size_t high = ranges.size();
+  while (low < high) {
+    const std::size_t middle = (low + high) / 2;
+    Columns lastEntry;
+    read(EntryRange(ranges[middle].second - 1, ranges[middle].second), lastEntry);
+    if (lastEntry.size() > 0 && last < SubrunKey(lastEntry.runIndex[0], lastEntry.subrunIndex[0])) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return std::vector<EntryRange>(ranges.begin() + low, ranges.end());
+}
+
+bool fileExists(const std::string& path) {
+  if (FILE* file = fopen(path.c_str(), "r")) {
+    fclose(file);
+    return true;
+  }
+  return false;
+}
+
+// one output file per class, with the seed directories created up front, so that their order doesn't depend on thread scheduling
+std::vector<TFile*> openOutputFiles(const std::vector<std::string>& paths, int firstSeed, int nSeeds) {
+  std::vector<TFile*> outputFiles;
+  for (const std::string& path: paths) {
+    outputFiles.push_back(new TFile(path.c_str(), "RECREATE"));
+    for (int seedIndex = firstSeed; seedIndex < firstSeed + nSeeds; seedIndex++) {
+      outputFiles.back() -> mkdir(Form("seed%d", seedIndex));
+    }
+  }
+  return outputFiles;
+}
+
+void closeOutputFiles(std::vector<TFile*>& outputFiles) {
+  for (TFile* outputFile: outputFiles) {
+    outputFile -> Close();
+    delete outputFile;
+  }
+  outputFiles.clear();
+}
+
+// concatenate the part files of a checkpointed job into its output: rows are appended in part order, histograms are added
+bool mergeParts(const std::vector<std::string>& parts, const std::string& output) {
+  TFileMerger merger(false);
+  merger.SetPrintLevel(0);
+  if (!merger.OutputFile(output.c_str(), "RECREATE")) {
+    return false;
+  }
+  for (const std::string& part: parts) {
+    if (!merger.AddFile(part.c_str(), false)) {
+      return false;
+    }
+  }
+  return merger.Merge();
+}
+
+// =================================================================================================
+
 int main(int argc, char** argv) {
   // declare variables for inputs: dataset name, skim file index, and list of classes to run
   std::string skimFilePath = "";
+  std::string fileListPath = "";
+  StorageFormat inputFormat = StorageFormat::tree;
   std::string lostMuonPath = "";
   std::string dataset = "";
   int runYear = -1;
@@ -148,11 +803,33 @@ int main(int argc, char** argv) {
   int skimIndex = -1;
   std::vector<std::string> classNames;
   std::string outputPath = "";
+  int nSeeds = 1;
+  int firstSeed = 0;
+  int nThreads = 1;
+  bool streamMode = false;
+  bool fusedMode = false;
+  int checkpointSeconds = 0;
+  long long chunkEntries = 0;
+  bool counterRandom = false;
+  OutputOptions outputOptions;
+  CaloMask caloMask;
+  std::string profilePath = "";
+  bool hardwareCounters = false;
 
   // parse command line arguments into above variables (modified by reference)
-  parseInputs(argc, argv, dataset, runYear, datasetIndex, skimIndex, skimFilePath, lostMuonPath, classNames, outputPath);
+  parseInputs(argc, argv, dataset, runYear, datasetIndex, skimIndex, skimFilePath, fileListPath, inputFormat, lostMuonPath, classNames, outputPath, nSeeds, firstSeed, nThreads, streamMode, fusedMode, checkpointSeconds, chunkEntries, counterRandom, outputOptions, caloMask, profilePath, hardwareCounters);
   // std::cout << "[Debug] parsed" << std::endl;
 
+  // with --profile, the phases below are timed and the report is written when main() returns, after the thread pool has stopped
+  ProfileSession profileSession(profilePath, hardwareCounters);
+  profiler().setInfo("dataset", dataset);
+  profiler().setInfo("skimIndex", std::to_string(skimIndex));
+  profiler().setInfo("seeds", std::to_string(nSeeds));
+  profiler().setInfo("firstSeed", std::to_string(firstSeed));
+  profiler().setInfo("threads", std::to_string(nThreads));
+  profiler().setInfo("mode", fusedMode ? "fused" : (streamMode ? "stream" : "preload"));
+  profiler().setInfo("checkpointSeconds", std::to_string(checkpointSeconds));
+
   // compute global offset for the batch of 100 unique random seeds this skim file will use
   const int seedOffset = getSeedOffset(runYear, datasetIndex, skimIndex);
 
@@ -161,133 +838,114 @@ int main(int argc, char** argv) {
   // skimFilePath = "skimTest.root";
   // std::string lostMuonPath = "lostmuon.root";
 
-  // open the skim file and lost muon file
-  TFile* skimFile = new TFile(skimFilePath.c_str(), "READ");
-  // TFile* lostMuonFile = new TFile(lostMuonPath.c_str(), "READ");
-
-  // fetch the TTrees from the skim file
-  TTree* singlesTree = (TTree*) skimFile -> Get("crystalTreeMaker1EP/ntuple");
-  TTree* doublesTree = (TTree*) skimFile -> Get("crystalTreeMaker2EP/ntuple");
-  TTree* triplesTree = (TTree*) skimFile -> Get("crystalTreeMaker3EP/ntuple");
-  // TTree* lostMuonTree = (TTree*) skimFile -> Get("lostMuonEP/ntuple");
-
-  // preload the TTree entries into vectors in memory
-  std::vector<PositronData> positronEntries;
-  std::vector<PileupData> doubleEntries;
-  std::vector<PileupData> tripleEntries;
-  // std::vector<LostMuonData> lostMuonEntries;
+  // the tree caches fetch their next block of baskets on ROOT's prefetching thread while the current one is being read;
+  // with several threads, seeds are filled concurrently, and in streaming mode the chunk for the histogram filling is read on
+  // a background thread, and ROOT baskets are decompressed in parallel by the tree cache
+  // the prefetching thread alone means ROOT is used concurrently in every mode, so it must be prepared for that before opening any files
+  gEnv -> SetValue("TFile.AsyncPrefetching", 1);
+  ROOT::EnableThreadSafety();
+  if (streamMode) {
+    TTreeCacheUnzip::SetParallelUnzip(TTreeCacheUnzip::kEnable);
+  }
 
-  // ===============================================================================================
+  // open the lost muon file
+  // TFile* lostMuonFile = new TFile(lostMuonPath.c_str(), "READ");
 
-  // create dummy positron data object to hold data from current TTree entry
-  PositronData tempPositronEntry;
-
-  // point the singles TTree branches to the member variables in the PositronData object
-  // singlesTree -> SetBranchAddress("laserInFill", &(tempPositronEntry.laserInFill));
-  singlesTree -> SetBranchAddress("gpsInteger", &(tempPositronEntry.gpsInteger));
-  singlesTree -> SetBranchAddress("time", &(tempPositronEntry.time));
-  singlesTree -> SetBranchAddress("energy", &(tempPositronEntry.energy));
-  singlesTree -> SetBranchAddress("x", &(tempPositronEntry.x));
-  singlesTree -> SetBranchAddress("y", &(tempPositronEntry.y));
-  singlesTree -> SetBranchAddress("caloIndex", &(tempPositronEntry.caloIndex));
-  singlesTree -> SetBranchAddress("runIndex", &(tempPositronEntry.runIndex));
-  singlesTree -> SetBranchAddress("subrunIndex", &(tempPositronEntry.subrunIndex));
-  singlesTree -> SetBranchAddress("fillIndex", &(tempPositronEntry.fillIndex));
-  singlesTree -> SetBranchAddress("bunchNumber", &(tempPositronEntry.bunchNumber));
-  // singlesTree -> SetBranchAddress("inFillGain", &(tempPositronEntry.inFillGain));
-  // singlesTree -> SetBranchAddress("crystalEnergy", &(tempPositronEntry.crystalEnergy));
-
-  // std::cout << "[Debug] before the singlesTree loop" << std::endl;
-  // loop over the tree
-  for (int i = 0; i < singlesTree -> GetEntries(); i++) {
-    singlesTree -> GetEntry(i);
-    // add a *copy* of the dummy object to the list of positron objects
-    positronEntries.push_back(tempPositronEntry);
+  // open the skim file(s) in their storage format; entries of all files are filled into the same histograms,
+  // and one output file per class is written for the whole job
+  // with --checkpoint, the progress saved by an earlier run of the same job, if any: it resumes after the last saved subrun
+  const std::string checkpointPath = JobCheckpoint::path(outputPath, dataset, skimIndex);
+  JobCheckpoint checkpoint;
+  checkpoint.dataset = dataset;
+  checkpoint.skimIndex = skimIndex;
+  checkpoint.firstSeed = firstSeed;
+  checkpoint.nSeeds = nSeeds;
+  for (std::string& className: classNames) {
+    checkpoint.classList += (checkpoint.classList.empty() ? "" : ",") + className;
+  }
+  checkpoint.counterRandom = counterRandom;
+  std::vector<std::unique_ptr<TRandom3>> savedGenerators;
+  bool resumed = false;
+  if (checkpointSeconds > 0) {
+    JobCheckpoint saved;
+    if (JobCheckpoint::read(checkpointPath, saved, savedGenerators)) {
+      if (!saved.sameJob(checkpoint)) {
+        printf("Checkpoint '%s' was written by a different job (dataset, skim, seeds, classes or --counter-rng); remove it to start over.\n", checkpointPath.c_str());
+        std::exit(1);
+      }
+      for (std::string& className: classNames) {
+        for (int part = 0; part < saved.nParts; part++) {
+          if (!fileExists(JobCheckpoint::partPath(outputPath, className, dataset, skimIndex, part))) {
+            printf("Checkpoint '%s' lists output part %d of %s, which is missing; remove the checkpoint to start over.\n", checkpointPath.c_str(), part, className.c_str());
+            std::exit(1);
+          }
+        }
+      }
+      checkpoint.nParts = saved.nParts;
+      checkpoint.last = saved.last;
+      resumed = true;
+      printf("Resuming after run %d subrun %d from checkpoint '%s'.\n", saved.last.first, saved.last.second, checkpointPath.c_str());
+      profiler().setInfo("resumedAfter", Form("%d:%d", saved.last.first, saved.last.second));
+    }
   }
 
-  // ===============================================================================================
-
-  // create dummy pileup data object to hold data from current TTree entry
-  PileupData tempDoubleEntry;
+  ScopedTimer openTimer("openSkims");
+  std::unique_ptr<SkimReader> skimReader = SkimReader::open(inputFormat, SkimReader::listInputFiles(skimFilePath, fileListPath));
+  // TTree* lostMuonTree = (TTree*) skimFile -> Get("lostMuonEP/ntuple");
 
-  // temporary pointers-to-vectors to use for SetBranchAddress
-  // these vector contents must be be copied into each pileup data object for each entry
-  std::vector<int>* tempPileupIndex = 0;
-  std::vector<bool>* tempPileupFlagged = 0;
-  std::vector<double>* tempPileupTime = 0;
-  std::vector<double>* tempPileupEnergy = 0;
-  std::vector<double>* tempPileupX = 0;
-  std::vector<double>* tempPileupY = 0;
-  std::vector<int>* tempPileupCaloIndex = 0;
-
-  // point the doubles TTree branches to the member variables in the PileupData object for doubles
-  // vector types must point to the pointers-to-vectors above
-  // non-vector types can point directly inside the dummy object, and will be copied
-  doublesTree -> SetBranchAddress("pileupIndex", &tempPileupIndex);
-  doublesTree -> SetBranchAddress("pileupFlagged", &tempPileupFlagged);
-  doublesTree -> SetBranchAddress("pileupTime", &tempPileupTime);
-  doublesTree -> SetBranchAddress("pileupEnergy", &tempPileupEnergy);
-  doublesTree -> SetBranchAddress("pileupX", &tempPileupX);
-  doublesTree -> SetBranchAddress("pileupY", &tempPileupY);
-  doublesTree -> SetBranchAddress("pileupCaloIndex", &tempPileupCaloIndex);
-  // doublesTree -> SetBranchAddress("laserInFill", &(tempDoubleEntry.laserInFill));
-  doublesTree -> SetBranchAddress("runIndex", &(tempDoubleEntry.runIndex));
-  doublesTree -> SetBranchAddress("subrunIndex", &(tempDoubleEntry.subrunIndex));
-  doublesTree -> SetBranchAddress("fillIndex", &(tempDoubleEntry.fillIndex));
-  doublesTree -> SetBranchAddress("bunchNumber", &(tempDoubleEntry.bunchNumber));
-
-  // std::cout << "[Debug] before the doublesTree loop" << std::endl;
-  // loop over the tree
-  for (int i = 0; i < doublesTree -> GetEntries(); i++) {
-    doublesTree -> GetEntry(i);
-    // add a *copy* of the dummy object to the list of double-pileup objects
-    doubleEntries.push_back(tempDoubleEntry);
-    // must explicitly copy temporary pointers-to-vectors into data object's vectors
-    // because ROOT will overwrite its internal buffer that pointers-to-vectors point to
-    doubleEntries.back().pileupIndex = *tempPileupIndex;
-    doubleEntries.back().pileupFlagged = *tempPileupFlagged;
-    doubleEntries.back().pileupTime = *tempPileupTime;
-    doubleEntries.back().pileupEnergy = *tempPileupEnergy;
-    doubleEntries.back().pileupX = *tempPileupX;
-    doubleEntries.back().pileupY = *tempPileupY;
-    doubleEntries.back().pileupCaloIndex = *tempPileupCaloIndex;
+  // read only the branches that the driver or at least one of the requested classes uses
+  unsigned int fields = driverFields;
+  for (std::string& className: classNames) {
+    HistogramBase* instance = createInstance(className);
+    fields |= instance -> requiredFields();
+    delete instance;
   }
-  // ===============================================================================================
+  skimReader -> selectFields(fields, readCacheBytes);
+  openTimer.stop();
+
+  // preload the TTree entries into columns in memory (left empty in streaming mode)
+  SinglesColumns positronEntries;
+  PileupColumns doubleEntries;
+  PileupColumns tripleEntries;
+  // std::vector<LostMuonData> lostMuonEntries;
 
-  // create dummy pileup data object to hold data from current TTree entry
-  PileupData tempTripleEntry;
-
-  // point the triples TTree branches to the member variables in the PileupData object for triples
-  // vector types must point to the pointers-to-vectors declared above for double pileup (reused here)
-  // non-vector types can point directly inside the dummy object, and will be copied
-  triplesTree -> SetBranchAddress("pileupIndex", &tempPileupIndex);
-  triplesTree -> SetBranchAddress("pileupFlagged", &tempPileupFlagged);
-  triplesTree -> SetBranchAddress("pileupTime", &tempPileupTime);
-  triplesTree -> SetBranchAddress("pileupEnergy", &tempPileupEnergy);
-  triplesTree -> SetBranchAddress("pileupX", &tempPileupX);
-  triplesTree -> SetBranchAddress("pileupY", &tempPileupY);
-  triplesTree -> SetBranchAddress("pileupCaloIndex", &tempPileupCaloIndex);
-  // triplesTree -> SetBranchAddress("laserInFill", &(tempTripleEntry.laserInFill));
-  triplesTree -> SetBranchAddress("runIndex", &(tempTripleEntry.runIndex));
-  triplesTree -> SetBranchAddress("subrunIndex", &(tempTripleEntry.subrunIndex));
-  triplesTree -> SetBranchAddress("fillIndex", &(tempTripleEntry.fillIndex));
-  triplesTree -> SetBranchAddress("bunchNumber", &(tempTripleEntry.bunchNumber));
-
-  // std::cout << "[Debug] before the triplesTree loop" << std::endl;
-  // loop over the tree
-  for (int i = 0; i < triplesTree -> GetEntries(); i++) {
-    triplesTree -> GetEntry(i);
-    // add a *copy* of the dummy object to the list of triple-pileup objects
-    tripleEntries.push_back(tempTripleEntry);
-    // must explicitly copy temporary pointers-to-vectors into data object's vectors
-    // because ROOT will overwrite its internal buffer that pointers-to-vectors point to
-    tripleEntries.back().pileupIndex = *tempPileupIndex;
-    tripleEntries.back().pileupFlagged = *tempPileupFlagged;
-    tripleEntries.back().pileupTime = *tempPileupTime;
-    tripleEntries.back().pileupEnergy = *tempPileupEnergy;
-    tripleEntries.back().pileupX = *tempPileupX;
-    tripleEntries.back().pileupY = *tempPileupY;
-    tripleEntries.back().pileupCaloIndex = *tempPileupCaloIndex;
+  // entry ranges aligned to the cluster boundaries of each tree, for streaming mode
+  std::vector<EntryRange> singlesRanges;
+  std::vector<EntryRange> doublesRanges;
+  std::vector<EntryRange> triplesRanges;
+
+  // read a range of entries into columns (all entries when preloading, otherwise one chunk, on a background thread)
+  auto readSinglesChunk = [&skimReader](EntryRange range, SinglesColumns& chunk) {
+    ScopedTimer timer("readSingles");
+    skimReader -> readSingles(range, chunk);
+    timer.addEntries(chunk.size());
+  };
+  auto readDoublesChunk = [&skimReader](EntryRange range, PileupColumns& chunk) {
+    ScopedTimer timer("readDoubles");
+    skimReader -> readDoubles(range, chunk);
+    timer.addEntries(chunk.size());
+  };
+  auto readTriplesChunk = [&skimReader](EntryRange range, PileupColumns& chunk) {
+    ScopedTimer timer("readTriples");
+    skimReader -> readTriples(range, chunk);
+    timer.addEntries(chunk.size());
+  };
+
+  if (streamMode) {
+    singlesRanges = skimReader -> clusterRanges(SkimStream::singles, chunkEntries);
+    doublesRanges = skimReader -> clusterRanges(SkimStream::doubles, chunkEntries);
+    triplesRanges = skimReader -> clusterRanges(SkimStream::triples, chunkEntries);
+    if (resumed) {
+      ScopedTimer skipTimer("skipCheckpointedRanges");
+      singlesRanges = rangesAfter<SinglesColumns>(singlesRanges, readSinglesChunk, checkpoint.last);
+      doublesRanges = rangesAfter<PileupColumns>(doublesRanges, readDoublesChunk, checkpoint.last);
+      triplesRanges = rangesAfter<PileupColumns>(triplesRanges, readTriplesChunk, checkpoint.last);
+    }
+  } else {
+    // std::cout << "[Debug] before the TTree preload" << std::endl;
+    readSinglesChunk(EntryRange(0, skimReader -> entries(SkimStream::singles)), positronEntries);
+    readDoublesChunk(EntryRange(0, skimReader -> entries(SkimStream::doubles)), doubleEntries);
+    readTriplesChunk(EntryRange(0, skimReader -> entries(SkimStream::triples)), tripleEntries);
   }
 
   // ===============================================================================================
@@ -367,184 +1025,273 @@ int main(int argc, char** argv) {
   // ===============================================================================================
 
   // initialize one output file for each subclass
-  std::vector<TFile*> outputFiles;
+  // with --checkpoint, each class writes a sequence of part files instead, one per checkpoint, merged into its output at the end
+  std::vector<std::string> outputPaths;
   for (std::string& className: classNames) {
-    outputFiles.push_back(new TFile(Form("%s/%s_dataset%s_skim%05d.root", outputPath.c_str(), className.c_str(), dataset.c_str(), skimIndex), "RECREATE"));
+    outputPaths.push_back(Form("%s/%s_dataset%s_skim%05d.root", outputPath.c_str(), className.c_str(), dataset.c_str(), skimIndex));
   }
-
-  // initialize instances of each subclass and book their histograms
-  std::vector<HistogramBase*> classInstances;
-  for (std::string& className: classNames) {
-    // if (className == "CornellHistograms") {
-    //   classInstances.push_back(new CornellHistograms());
-    // } else if (className == "RatioHistograms") {
-      // classInstances.push_back(new RatioHistograms());
-    // } else if (className == "Byu2Histograms") {
-      // classInstances.push_back(new Byu2Histograms());
-    // }
-    if (className == "Byu2Histograms") {
-      classInstances.push_back(new Byu2Histograms());
+  auto partPaths = [&](int part) {
+    std::vector<std::string> paths;
+    for (std::string& className: classNames) {
+      paths.push_back(JobCheckpoint::partPath(outputPath, className, dataset, skimIndex, part));
     }
-    classInstances.back() -> bookHistograms(0, skimIndex);
-  }
+    return paths;
+  };
+  std::vector<TFile*> outputFiles = openOutputFiles((checkpointSeconds > 0) ? partPaths(checkpoint.nParts) : outputPaths, firstSeed, nSeeds);
 
   // keep track of which fills were marked as in-fill laser fills, since lost muon tree is missing this information
   std::set<long long> laserFillIndices;
 
-  // std::cout << "[Debug] before the random seed loop" << std::endl;
-  // loop over random seeds
-  for (int seedIndex = 0; seedIndex < 1; seedIndex++) {
-    // fprintf(stderr, "Creating histograms for seedIndex = %i\n", seedIndex);
-
-    // create maps from unique fill index to fast rotation and vertical waist randomization amounts
-    std::map<long long, double> frRandomizationPerFill;
-    std::map<long long, double> vwRandomizationPerFill;
-
-    // create random number generator with unique seed for this skim file + seed index combination
-    TRandom3* generator = new TRandom3(seedOffset + seedIndex);
-
-    // keep track of the last uniqueFillIndex so that we don't check if randomization map contains each positron's unique fill index
-    // this will save time when we're iterating through a sequence of positrons from the same fill, for example
-    long long lastUniqueFillIndex = -1;
-    
-    // std::cout << "Loop over singles" << std::endl;
-    // loop over the preloaded positron entries
-    for (int i = 0; i < positronEntries.size(); i++) {
-      
-      PositronData& positronEntry = positronEntries[i];
-
-      // literals need 'LL' to avoid overflows from intermediate types that are too small
-      long long uniqueFillIndex = getUniqueFillIndex(positronEntry.runIndex, positronEntry.subrunIndex, positronEntry.fillIndex);
-
-      // if (positronEntry.laserInFill) { // for now, skip entries from laser-fills
-      //   laserFillIndices.insert(uniqueFillIndex);
-      //   continue;
-      // }
-
-      // if the fill index has changed...
-      if (lastUniqueFillIndex != uniqueFillIndex){
-        // ...and it's definitely not already in the map (in case entries are out of order)...
-        if (frRandomizationPerFill.count(uniqueFillIndex) == 0) {
-          // ...add new randomization amounts to the maps for this fill
-          frRandomizationPerFill[uniqueFillIndex] = ((generator -> Rndm()) - 0.5) * frPeriod;
-          vwRandomizationPerFill[uniqueFillIndex] = ((generator -> Rndm()) - 0.5) * vwPeriod;
-        }
-      }
+  // slot of every fill seen in the singles, shared read-only by all seeds while they fill
+  FillSlotIndex fillSlots;
 
-      // leave randomization amounts at zero for seedIndex == -1 (unrandomized)
-      double frRandomization = 0.0;
-      double vwRandomization = 0.0;
+  // one worker per random seed, each with its own generator, randomization amounts and class instances
+  std::vector<SeedWorker> seedWorkers(nSeeds);
+  ThreadPool threadPool(nThreads);
 
-      // update randomization amounts from map when seedIndex > -1
-      if (seedIndex > -1) {
-        frRandomization = frRandomizationPerFill[uniqueFillIndex];
-        vwRandomization = vwRandomizationPerFill[uniqueFillIndex];
-      }
-
-      for (HistogramBase* instance: classInstances) {
-        instance -> fillSinglesHistograms(positronEntry, frRandomization, vwRandomization, seedIndex, skimIndex);
-      }
+  // std::cout << "[Debug] before the random seed loop" << std::endl;
+  if (fusedMode) {
 
+    for (int seedIndex = 0; seedIndex < nSeeds; seedIndex++) {
+      startSeed(seedWorkers[seedIndex], firstSeed + seedIndex, seedOffset, counterRandom, outputOptions, caloMask, classNames, outputFiles, threadPool, skimIndex);
     }
 
-    // std::cout << "Loop over doubles" << std::endl;
-    // loop over the preloaded double-pileup entries
-    for (int i = 0; i < doubleEntries.size(); i++) {
-      
-      PileupData& doubleEntry = doubleEntries[i];
-      // if (doubleEntry.laserInFill) { // for now, skip entries from laser-fills
-      //   continue;
-      // }
-
-      // literals need 'LL' to avoid overflows from intermediate types that are too small
-      long long uniqueFillIndex = getUniqueFillIndex(doubleEntry.runIndex, doubleEntry.subrunIndex, doubleEntry.fillIndex);
+    // a resumed job continues every seed's generator where the checkpoint left it, so that the fills of the remaining subruns
+    // get the same randomization as in an uninterrupted job (none are saved with --counter-rng, which needs no state)
+    for (std::size_t i = 0; i < savedGenerators.size(); i++) {
+      delete seedWorkers[i].generator;
+      seedWorkers[i].generator = savedGenerators[i].release();
+    }
 
-      double frRandomization = 0.0;
-      double vwRandomization = 0.0;
+    // checkpoint: write and close the current part files, which then hold every subrun up to and including 'last', and save the
+    // progress and the generators; only subruns after 'last' are filled into anything that is not on disk yet
+    auto commitPart = [&](const SubrunKey& last) {
+      ScopedTimer timer("checkpoint");
+      for (SeedWorker& worker: seedWorkers) {
+        writeInstances(worker, outputFiles);
+      }
+      closeOutputFiles(outputFiles);
+      checkpoint.nParts++;
+      checkpoint.last = last;
+      std::vector<TRandom3*> generators;
+      for (SeedWorker& worker: seedWorkers) {
+        if (worker.generator != nullptr) {
+          generators.push_back(worker.generator);
+        }
+      }
+      if (!checkpoint.write(checkpointPath, generators)) {
+        printf("Checkpoint '%s' could not be written.\n", checkpointPath.c_str());
+        std::exit(1);
+      }
+      profiler().count("checkpoints");
+    };
+    std::chrono::steady_clock::time_point lastCheckpoint = std::chrono::steady_clock::now();
+
+    // the three streams are read concurrently and traversed together, one (run, subrun) at a time, which needs them in subrun order
+    // within a subrun, singles go first, since they add the fills that pileup entries look up
+    ChunkCursor<SinglesColumns> singles(singlesRanges, readSinglesChunk);
+    ChunkCursor<PileupColumns> doubles(doublesRanges, readDoublesChunk);
+    ChunkCursor<PileupColumns> triples(triplesRanges, readTriplesChunk);
+
+    bool started = false;
+    SubrunKey previous;
+    while (!singles.done() || !doubles.done() || !triples.done()) {
+
+      // next subrun: the smallest (run, subrun) at the front of any stream
+      SubrunKey key;
+      bool found = false;
+      if (!singles.done()) { key = singles.key(); found = true; }
+      if (!doubles.done() && (!found || doubles.key() < key)) { key = doubles.key(); found = true; }
+      if (!triples.done() && (!found || triples.key() < key)) { key = triples.key(); found = true; }
+
+      // a subrun already reported complete can't be reopened
+      if (started && !(previous < key)) {
+        printf("Fused mode needs skim entries in (run, subrun) order, but run %d subrun %d follows run %d subrun %d.\n",
+               key.first, key.second, previous.first, previous.second);
+        std::exit(1);
+      }
 
-      // seedIndex -1 is unrandomized; set randomizationTime to 0
-      if (seedIndex > -1) {
-        frRandomization = frRandomizationPerFill[uniqueFillIndex];
-        vwRandomization = vwRandomizationPerFill[uniqueFillIndex];
+      // subruns saved by the checkpoint this job resumed from are passed over unfilled (only the first chunk of a stream can hold any)
+      if (resumed && !(checkpoint.last < key)) {
+        while (!singles.done() && singles.key() == key) {
+          singles.advance(singles.segmentEnd());
+        }
+        while (!doubles.done() && doubles.key() == key) {
+          doubles.advance(doubles.segmentEnd());
+        }
+        while (!triples.done() && triples.key() == key) {
+          triples.advance(triples.segmentEnd());
+        }
+        previous = key;
+        started = true;
+        continue;
       }
 
-      for (HistogramBase* instance: classInstances) {
-        instance -> fillDoublesHistograms(doubleEntry, frRandomization, vwRandomization, seedIndex, skimIndex);
+      while (!singles.done() && singles.key() == key) {
+        const std::size_t end = singles.segmentEnd();
+        const SinglesBatch batch = singles.chunk().batch(singles.position(), end);
+        addFillSlots(batch, fillSlots);
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillSingles(batch, fillSlots, seedWorkers[i], skimIndex); });
+        singles.advance(end);
+      }
+      while (!doubles.done() && doubles.key() == key) {
+        const std::size_t end = doubles.segmentEnd();
+        const PileupBatch batch = doubles.chunk().batch(doubles.position(), end);
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillPileup(batch, false, fillSlots, seedWorkers[i], skimIndex); });
+        doubles.advance(end);
+      }
+      while (!triples.done() && triples.key() == key) {
+        const std::size_t end = triples.segmentEnd();
+        const PileupBatch batch = triples.chunk().batch(triples.position(), end);
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillPileup(batch, true, fillSlots, seedWorkers[i], skimIndex); });
+        triples.advance(end);
       }
 
+      // every stream is past this subrun now, so the instances may write it out and free it
+      ScopedTimer finishTimer("finishSubrunsUpTo");
+      threadPool.parallelFor(nSeeds, [&](std::size_t i) {
+        dispatchToInstances(seedWorkers[i], "finishSubrunsUpTo", 0, [&](HistogramBase* instance) {
+          instance -> finishSubrunsUpTo(key.first, key.second);
+        });
+      });
+      finishTimer.stop();
+      previous = key;
+      started = true;
+
+      // the seeds continue in the next part files with new instances, and keep their generators and randomization amounts
+      if (checkpointSeconds > 0 && std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(checkpointSeconds)) {
+        commitPart(key);
+        outputFiles = openOutputFiles(partPaths(checkpoint.nParts), firstSeed, nSeeds);
+        for (SeedWorker& worker: seedWorkers) {
+          bookInstances(worker, outputOptions, caloMask, outputFiles, skimIndex);
+        }
+        lastCheckpoint = std::chrono::steady_clock::now();
+      }
     }
 
-    // std::cout << "Loop over triples" << std::endl;
-    // loop over the preloaded triple-pileup entries
-    for (int i = 0; i < tripleEntries.size(); i++) {
-      
-      PileupData& tripleEntry = tripleEntries[i];
-      // if (tripleEntry.laserInFill) { // for now, skip entries from laser-fills
-      //   continue;
-      // }
-
-      // literals need 'LL' to avoid overflows from intermediate types that are too small
-      long long uniqueFillIndex = getUniqueFillIndex(tripleEntry.runIndex, tripleEntry.subrunIndex, tripleEntry.fillIndex);
+    // the last part is committed like the others, so that a job killed while merging the parts doesn't fill anything again
+    if (checkpointSeconds > 0) {
+      commitPart((started && checkpoint.last < previous) ? previous : checkpoint.last);
+    }
 
-      double frRandomization = 0.0;
-      double vwRandomization = 0.0;
+    for (SeedWorker& worker: seedWorkers) {
+      finishSeed(worker, outputFiles);
+    }
 
-      // seedIndex -1 is unrandomized; set randomizationTime to 0
-      if (seedIndex > -1) {
-        frRandomization = frRandomizationPerFill[uniqueFillIndex];
-        vwRandomization = vwRandomizationPerFill[uniqueFillIndex];
-      }
+  } else if (streamMode) {
 
-      for (HistogramBase* instance: classInstances) {
-        instance -> fillTriplesHistograms(tripleEntry, frRandomization, vwRandomization, seedIndex, skimIndex);
-      }
+    // every seed stays alive while the chunks go by, so that each chunk is read only once and then filled into all seeds in parallel
+    for (int seedIndex = 0; seedIndex < nSeeds; seedIndex++) {
+      startSeed(seedWorkers[seedIndex], firstSeed + seedIndex, seedOffset, counterRandom, outputOptions, caloMask, classNames, outputFiles, threadPool, skimIndex);
+    }
 
-    } // end for loop over triplesTree
+    // std::cout << "Stream singles, doubles, triples" << std::endl;
+    // singles are streamed completely first, since they add the per-fill randomization amounts that pileup entries look up
+    // the new fills of each chunk are added to the slot index before the seeds fill it in parallel
+    streamChunks<SinglesColumns>(singlesRanges,
+      readSinglesChunk,
+      [&](const SinglesColumns& chunk) {
+        addFillSlots(chunk.batch(), fillSlots);
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillSingles(chunk.batch(), fillSlots, seedWorkers[i], skimIndex); });
+      });
+    streamChunks<PileupColumns>(doublesRanges,
+      readDoublesChunk,
+      [&](const PileupColumns& chunk) {
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillPileup(chunk.batch(), false, fillSlots, seedWorkers[i], skimIndex); });
+      });
+    streamChunks<PileupColumns>(triplesRanges,
+      readTriplesChunk,
+      [&](const PileupColumns& chunk) {
+        threadPool.parallelFor(nSeeds, [&](std::size_t i) { fillPileup(chunk.batch(), true, fillSlots, seedWorkers[i], skimIndex); });
+      });
+
+    for (SeedWorker& worker: seedWorkers) {
+      finishSeed(worker, outputFiles);
+    }
 
-    // std::cout << "Loop over lost muons" << std::endl;
-    // // loop over the preloaded lost muon candidate entries
-    // for (int i = 0; i < lostMuonEntries.size(); i++) {
+  } else {
+
+    // all fills are known up front, so the slot index is built in one pass before any seed starts
+    addFillSlots(positronEntries.batch(), fillSlots);
+
+    // each seed is started, filled from the shared read-only preloaded columns and written on its own,
+    // so at most nThreads seeds hold histograms in memory at any time
+    // with fewer seeds than threads, the idle threads are picked up by the instances' own per-subrun parallel fills, whose shard
+    // grids come from a pool shared by all seeds (at most one per thread), so concurrent seeds add no shards of their own
+    threadPool.parallelFor(nSeeds, [&](std::size_t i) {
+      // fprintf(stderr, "Creating histograms for seedIndex = %i\n", (int) i);
+      SeedWorker& worker = seedWorkers[i];
+      startSeed(worker, firstSeed + i, seedOffset, counterRandom, outputOptions, caloMask, classNames, outputFiles, threadPool, skimIndex);
+      // std::cout << "Loop over singles, doubles, triples" << std::endl;
+      fillSingles(positronEntries.batch(), fillSlots, worker, skimIndex);
+      fillPileup(doubleEntries.batch(), false, fillSlots, worker, skimIndex);
+      fillPileup(tripleEntries.batch(), true, fillSlots, worker, skimIndex);
+      finishSeed(worker, outputFiles);
+    });
 
-    //   LostMuonData& lostMuonEntry = lostMuonEntries[i];
+  }
 
-    //   // literals need 'LL' to avoid overflows from intermediate types that are too small
-    //   long long uniqueFillIndex = getUniqueFillIndex(lostMuonEntry.runIndex, lostMuonEntry.subrunIndex, lostMuonEntry.fillIndex);
+  // the lost muon pass would run per seed worker between fillPileup() and finishSeed(), looking up worker.randomizationPerFill through fillSlots
+  // std::cout << "Loop over lost muons" << std::endl;
+  // // loop over the preloaded lost muon candidate entries
+  // for (int i = 0; i < lostMuonEntries.size(); i++) {
 
-    //   if (laserFillIndices.find(uniqueFillIndex) != laserFillIndices.end()) { // for now, skip entries from laser-fills
-    //     continue;
-    //   }
+  //   LostMuonData& lostMuonEntry = lostMuonEntries[i];
 
-    //   double frRandomization = 0.0;
-    //   double vwRandomization = 0.0;
+  //   // literals need 'LL' to avoid overflows from intermediate types that are too small
+  //   long long uniqueFillIndex = getUniqueFillIndex(lostMuonEntry.runIndex, lostMuonEntry.subrunIndex, lostMuonEntry.fillIndex);
 
-    //   // seedIndex -1 is unrandomized; set randomizationTime to 0
-    //   if (seedIndex > -1) {
-    //     frRandomization = frRandomizationPerFill[uniqueFillIndex];
-    //     vwRandomization = vwRandomizationPerFill[uniqueFillIndex];
-    //   }
+  //   if (laserFillIndices.find(uniqueFillIndex) != laserFillIndices.end()) { // for now, skip entries from laser-fills
+  //     continue;
+  //   }
 
-    //   // for (HistogramBase* instance: classInstances) {
-    //   //   instance -> fillLostMuonHistograms(lostMuonEntry, lostMuonInput, frRandomization, vwRandomization, seedIndex, skimIndex);
-    //   // }
+  //   double frRandomization = 0.0;
+  //   double vwRandomization = 0.0;
 
-    // }
+  //   // seedIndex -1 is unrandomized; set randomizationTime to 0
+  //   if (seedIndex > -1) {
+  //     frRandomization = frRandomizationPerFill[uniqueFillIndex];
+  //     vwRandomization = vwRandomizationPerFill[uniqueFillIndex];
+  //   }
 
-    // std::cout << "Loop over classes" << std::endl;
-    // loop over the instances and write histograms to disk for this seed
-    for (unsigned int instanceIndex = 0; instanceIndex < classInstances.size(); instanceIndex++) {
-      std::string seedLabel = Form("seed%d", seedIndex);
-      outputFiles[instanceIndex] -> mkdir(seedLabel.c_str());
-      outputFiles[instanceIndex] -> cd(seedLabel.c_str());
-      classInstances[instanceIndex] -> writeHistograms(outputFiles[instanceIndex], seedIndex);
-    }
+  //   // for (HistogramBase* instance: classInstances) {
+  //   //   instance -> fillLostMuonHistograms(lostMuonEntry, lostMuonInput, frRandomization, vwRandomization, seedIndex, skimIndex);
+  //   // }
 
-  } // end loop over seedIndex
+  // }
 
-  // close input and output files
-  skimFile -> Close();
+  // close output files (the skim files are closed with their chains)
   // lostMuonFile -> Close();
-  for (TFile* outputFile: outputFiles) {
-    outputFile -> Close();
+  ScopedTimer closeTimer("closeOutput");
+  closeOutputFiles(outputFiles);
+  closeTimer.stop();
+
+  // a checkpointed job is complete: its parts become the outputs, and the checkpoint is removed, so that running the job again
+  // starts over; a single part is renamed after the checkpoint is gone (being killed in between only means starting over)
+  if (checkpointSeconds > 0) {
+    ScopedTimer mergeTimer("mergeParts");
+    for (std::size_t instanceIndex = 0; instanceIndex < classNames.size(); instanceIndex++) {
+      std::vector<std::string> parts;
+      for (int part = 0; part < checkpoint.nParts; part++) {
+        parts.push_back(partPaths(part)[instanceIndex]);
+      }
+      if (parts.size() > 1 && !mergeParts(parts, outputPaths[instanceIndex])) {
+        printf("Output parts of %s could not be merged into '%s'; running the job again retries from the checkpoint.\n",
+               classNames[instanceIndex].c_str(), outputPaths[instanceIndex].c_str());
+        std::exit(1);
+      }
+    }
+    std::remove(checkpointPath.c_str());
+    for (std::size_t instanceIndex = 0; instanceIndex < classNames.size(); instanceIndex++) {
+      for (int part = 0; part < checkpoint.nParts; part++) {
+        const std::string partPath = partPaths(part)[instanceIndex];
+        if (checkpoint.nParts == 1) {
+          std::rename(partPath.c_str(), outputPaths[instanceIndex].c_str());
+        } else {
+          std::remove(partPath.c_str());
+        }
+      }
+    }
   }
 
 }